@@ -10,24 +10,96 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define IPC_KEY 0x9876
-#define BUFFER_SIZE 5
-#define MAX_STR_LEN 100
+#define DEFAULT_CAPACITY 4096 // 缓冲区默认字节数, 可用 -b 指定
+#define REC_ALIGN 16          // 记录按 16 字节对齐, 也是 EMPTY 信号量计数的单位
+#define REC_PAD 1             // 填充记录: 环尾剩余空间放不下一条记录时占满它, 消费者直接跳过
 #define CONSUMER_TIMEOUT 5 // 消费者等待超时时间（秒）
+#define CACHE_LINE 64
+#define SPIN_TRIES 64      // 环满/空时先自旋重试的次数, 之后才用 futex 睡眠
+#define PRODUCER_BATCH 32  // 生产者每批最多的记录条数, 可用 -k 指定
+#define MAX_BATCH 4096     // -k 的上限, 生产者按它在栈上准备每批的行表
+#define CONSUMER_BATCH (IOV_MAX / 2) // 消费者一次最多取走的记录条数: 每条配一个换行, 正好一次 writev
+#define READ_CHUNK 65536   // 生产者每次从文件读入的字节数
+#define BENCH_RECORD 64    // 基准测试中每条记录的默认字节数, 可用 -s 指定
+
+// 延迟直方图: 每个 2 的幂区间再等分成 HIST_SUB 格, 相对误差不超过 1/HIST_SUB
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
 
 // 信号量索引
 #define SEM_MUTEX 0
 #define SEM_EMPTY 1
 #define SEM_FULL  2
 
-// 共享内存中的缓冲池结构
+// 传输方式: 三个 SysV 信号量保护的缓冲池, 或者无锁的多生产者多消费者环
+enum Transport { TRANSPORT_SYSV, TRANSPORT_RING };
+
+// 缓冲区中每条记录的头部, 负载紧跟其后, 整条记录按 REC_ALIGN 对齐。
+// stamp 表示记录的状态: 等于记录的起始位置 + 1 时已提交可读, + 2 时已被消费者释放。
+// 位置是单调递增的字节计数, 上一轮残留的 stamp 不会与本轮的值相等
+struct RecordHeader {
+    unsigned long stamp;
+    unsigned int len;      // 负载字节数
+    unsigned int flags;
+};
+
+// 共享内存中的缓冲池: 按字节分配的环形缓冲区, 容量运行时指定。
+// 生产者推进 write_pos 认领空间, 在缓冲区中就地写入记录后提交; 消费者推进 read_pos 认领记录,
+// 就地处理完再释放。释放可能乱序, free_pos 只越过连续的已释放记录, 它之前的空间才能重新写入。
+// 无锁环方式下用 CAS 推进这几个位置, 只有环空或环满时才在 futex 上睡眠: not_empty / not_full
+// 是 futex 字, 每次有新数据 / 新空位时加一, *_waiters 记录正在睡眠的进程数, 没人睡眠时不做 futex 唤醒
 struct BufferPool {
-    char buffers[BUFFER_SIZE][MAX_STR_LEN];
-    int write_pos;
-    int read_pos;
+    unsigned long capacity;
+    int producers_left;    // 还没结束的生产者数, 最后一个结束时关闭缓冲池
+    int closed;
+    unsigned long write_pos __attribute__((aligned(CACHE_LINE)));
+    unsigned long read_pos __attribute__((aligned(CACHE_LINE)));
+    unsigned long free_pos __attribute__((aligned(CACHE_LINE)));
+    int not_empty __attribute__((aligned(CACHE_LINE)));
+    int empty_waiters;
+    int not_full __attribute__((aligned(CACHE_LINE)));
+    int full_waiters;
+    char data[] __attribute__((aligned(CACHE_LINE)));
+};
+
+// 基准测试中每个消费者的统计, 放在单独的共享内存段里由主进程汇总。时间均为纳秒
+struct BenchStats {
+    unsigned long count;
+    unsigned long lat_sum;
+    unsigned long lat_max;
+    unsigned long last_ns;     // 处理完最后一批记录的时刻
+    unsigned long hist[HIST_BUCKETS];
 };
 
+// 一条记录: 生产者在 data 处写入 len 字节, 消费者在 data 处就地读取
+struct Record {
+    unsigned long pos;     // 记录头在环中的位置 (单调递增的字节计数)
+    char *data;
+    size_t len;
+};
+
+// 一次认领的一段连续区域, 其中可以有多条记录。生产者一次认领、一次提交一批记录,
+// 消费者一次取走所有已提交的记录, 同步的开销由整批记录分摊
+struct Batch {
+    unsigned long pos;     // 区域起点
+    unsigned long end;     // 区域终点
+    unsigned long next;    // 生产者下一条记录的写入位置 / 消费者下一条记录的读取位置
+    int count;             // 区域中的记录条数, 不含填充记录
+};
+
+enum Transport transport = TRANSPORT_SYSV;
+int batch_size = PRODUCER_BATCH;
+
 // 信号量操作所需的联合体
 union semun {
     int val;
@@ -36,9 +108,14 @@ union semun {
     struct seminfo *__buf;
 };
 
+// SEM_UNDO 只用于互斥信号量: 持锁的进程异常退出时由内核释放锁。EMPTY/FULL 是在进程之间
+// 传递的计数, 生产者退出时若撤销它做过的 V(FULL), 已放入缓冲区的产品就凭空消失, 消费者随后还会
+// 读到旧槽位中的重复数据
+#define SEM_FLAGS(sem_no) ((sem_no) == SEM_MUTEX ? SEM_UNDO : 0)
+
 // P操作（等待）
 int semaphore_p(int sem_id, int sem_no) {
-    struct sembuf sem_b = {sem_no, -1, SEM_UNDO};
+    struct sembuf sem_b = {sem_no, -1, SEM_FLAGS(sem_no)};
     if (semop(sem_id, &sem_b, 1) == -1) {
         perror("semaphore_p failed");
         return -1;
@@ -48,7 +125,7 @@ int semaphore_p(int sem_id, int sem_no) {
 
 // V操作（释放）
 int semaphore_v(int sem_id, int sem_no) {
-    struct sembuf sem_b = {sem_no, 1, SEM_UNDO};
+    struct sembuf sem_b = {sem_no, 1, SEM_FLAGS(sem_no)};
     if (semop(sem_id, &sem_b, 1) == -1) {
         perror("semaphore_v failed");
         return -1;
@@ -56,9 +133,28 @@ int semaphore_v(int sem_id, int sem_no) {
     return 0;
 }
 
+// 一次加减多个单位, 用于按字节计数的 EMPTY 信号量; n 为负时等到够减为止
+int semaphore_add(int sem_id, int sem_no, int n) {
+    struct sembuf sem_b = {sem_no, n, SEM_FLAGS(sem_no)};
+    if (semop(sem_id, &sem_b, 1) == -1) {
+        perror("semaphore_add failed");
+        return -1;
+    }
+    return 0;
+}
+
+// 不等待地减去至多 max 个单位, 返回实际减去的数量
+int sem_try_take(int sem_id, int sem_no, int max) {
+    int n = semctl(sem_id, sem_no, GETVAL);
+    if (n > max) n = max;
+    if (n <= 0) return 0;
+    struct sembuf sem_b = {sem_no, -n, SEM_FLAGS(sem_no) | IPC_NOWAIT};
+    return semop(sem_id, &sem_b, 1) == 0 ? n : 0;
+}
+
 // 带超时的P操作
 int sem_timed_p(int sem_id, int sem_no, int timeout_sec) {
-    struct sembuf sem_b = {sem_no, -1, SEM_UNDO};
+    struct sembuf sem_b = {sem_no, -1, SEM_FLAGS(sem_no)};
     struct timespec timeout = {timeout_sec, 0};
     if (semtimedop(sem_id, &sem_b, 1, &timeout) == -1) {
         return (errno == EAGAIN) ? -2 : -1; // -2 表示超时
@@ -66,68 +162,433 @@ int sem_timed_p(int sem_id, int sem_no, int timeout_sec) {
     return 0;
 }
 
+// 进程间共享的 futex (不能用 FUTEX_PRIVATE_FLAG): 只有 *addr 仍等于 val 时才睡眠
+int futex_wait(int *addr, int val, const struct timespec *timeout) {
+    return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+void futex_wake(int *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static inline struct RecordHeader *record_at(struct BufferPool *pool, unsigned long pos) {
+    return (struct RecordHeader *)(pool->data + pos % pool->capacity);
+}
+
+static inline size_t record_size(size_t len) {
+    return (sizeof(struct RecordHeader) + len + REC_ALIGN - 1) & ~(size_t)(REC_ALIGN - 1);
+}
+
+// 一次认领的字节数上限。认领的区域不能跨越环尾, 最坏情况要先用填充记录占掉将近同样大的空间,
+// 限制在容量的一半以内才保证空的环总能放下; 再向下对齐到 REC_ALIGN, 记录大小总是对齐的
+static inline size_t reserve_limit(size_t capacity) {
+    return (capacity / 2) & ~(size_t)(REC_ALIGN - 1);
+}
+
+size_t pool_max_reserve(struct BufferPool *pool) {
+    return reserve_limit(pool->capacity);
+}
+
+// 尝试认领 size 字节; 环尾放不下时连同前面的填充一起认领。成功返回认领的总字节数并把记录位置
+// 写入 *pos, 空间不够返回 0
+size_t ring_try_claim(struct BufferPool *pool, size_t size, unsigned long *pos) {
+    unsigned long head = __atomic_load_n(&pool->write_pos, __ATOMIC_RELAXED);
+    while (1) {
+        unsigned long tail = __atomic_load_n(&pool->free_pos, __ATOMIC_ACQUIRE);
+        if ((long)(head - tail) < 0) { // head 读得太早, 已经落后于 free_pos
+            head = __atomic_load_n(&pool->write_pos, __ATOMIC_RELAXED);
+            continue;
+        }
+        size_t room = pool->capacity - head % pool->capacity;
+        size_t pad = room < size ? room : 0;
+        if (head + pad + size - tail > pool->capacity) return 0;
+        if (__atomic_compare_exchange_n(&pool->write_pos, &head, head + pad + size, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (pad) {
+                struct RecordHeader *hdr = record_at(pool, head);
+                hdr->len = pad - sizeof(struct RecordHeader);
+                hdr->flags = REC_PAD;
+                __atomic_store_n(&hdr->stamp, head + 1, __ATOMIC_RELEASE);
+            }
+            *pos = head + pad;
+            return pad + size;
+        }
+        // CAS 失败时 head 已被更新为最新值, 直接重试
+    }
+}
+
+// 状态变化后唤醒至多 count 个等待者。先改 futex 字再检查等待人数, 与 pool_reserve / pool_peek 中
+// "先登记等待, 再读 futex 字, 再重试" 的顺序配合, 不会漏掉唤醒; 没人等待时不进内核
+void ring_signal(int *word, int *waiters, int count) {
+    __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) futex_wake(word, count);
+}
+
+// 把 [pos, end) 中的记录标记为已释放, 再让 free_pos 越过所有连续的已释放记录。
+// 返回本次调用推进 free_pos 的字节数, 多个进程同时释放时每段空间只算给推进它的那一个
+size_t pool_free(struct BufferPool *pool, unsigned long pos, unsigned long end) {
+    while (pos != end) {
+        struct RecordHeader *hdr = record_at(pool, pos);
+        size_t size = record_size(hdr->len); // 标记之后这块空间就可能被改写, 先取长度
+        __atomic_store_n(&hdr->stamp, pos + 2, __ATOMIC_RELEASE);
+        pos += size;
+    }
+    size_t freed = 0;
+    unsigned long tail = __atomic_load_n(&pool->free_pos, __ATOMIC_ACQUIRE);
+    while (1) {
+        struct RecordHeader *hdr = record_at(pool, tail);
+        if (__atomic_load_n(&hdr->stamp, __ATOMIC_ACQUIRE) != tail + 2) break;
+        size_t size = record_size(hdr->len);
+        if (__atomic_compare_exchange_n(&pool->free_pos, &tail, tail + size, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            freed += size;
+            tail += size;
+        }
+    }
+    return freed;
+}
+
+// 把 free_pos 推进出来的空间交还给等空位的生产者
+void pool_give_back(struct BufferPool *pool, int semid, size_t freed) {
+    if (freed == 0) return; // 前面还有记录没释放, 空间由释放它的进程归还
+    if (transport == TRANSPORT_SYSV) {
+        semaphore_add(semid, SEM_EMPTY, freed / REC_ALIGN);
+    } else {
+        // 每个生产者认领自己的一段, 空出的空间可能够好几个生产者用, 全部叫醒
+        ring_signal(&pool->not_full, &pool->full_waiters, INT_MAX);
+    }
+}
+
+// 尝试从 read_pos 起认领连续的已提交记录, 至多 max 条 (填充记录不计数, 一并认领);
+// 环空或下一条还没提交时返回 -1
+int ring_try_take(struct BufferPool *pool, int semid, struct Batch *b, int max) {
+    unsigned long pos = __atomic_load_n(&pool->read_pos, __ATOMIC_RELAXED);
+    while (1) {
+        unsigned long end = pos;
+        int count = 0;
+        while (count < max) {
+            struct RecordHeader *hdr = record_at(pool, end);
+            if (__atomic_load_n(&hdr->stamp, __ATOMIC_ACQUIRE) != end + 1) break;
+            if (!(hdr->flags & REC_PAD)) count++;
+            end += record_size(hdr->len);
+        }
+        if (end == pos) {
+            unsigned long now = __atomic_load_n(&pool->read_pos, __ATOMIC_RELAXED);
+            if (now == pos) return -1;
+            pos = now; // 这些已被别的消费者取走
+            continue;
+        }
+        // pos 过时的话上面读到的可能是已被改写的数据, 但那样 CAS 一定失败, 重新扫描即可
+        if (!__atomic_compare_exchange_n(&pool->read_pos, &pos, end, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if (count == 0) { // 只有填充记录
+            pool_give_back(pool, semid, pool_free(pool, pos, end));
+            pos = end;
+            continue;
+        }
+        b->pos = b->next = pos;
+        b->end = end;
+        b->count = count;
+        return 0;
+    }
+}
+
+// 在缓冲区中认领 total 字节, 用来放一批记录: total 是各条记录 record_size 之和, 不能超过
+// pool_max_reserve。之后用 batch_add 逐条布置记录并直接写入, 最后必须调用 pool_commit
+void pool_reserve(struct BufferPool *pool, int semid, size_t total, struct Batch *b) {
+    unsigned long pos;
+    size_t claimed;
+
+    if (transport == TRANSPORT_SYSV) {
+        // 在拿到互斥锁之前还不知道要不要填充环尾, 先按最坏情况 (区域本身 + 不到同样大的填充)
+        // 等空位, 认领后把多扣的退回去
+        int worst = (2 * total - REC_ALIGN) / REC_ALIGN;
+        semaphore_add(semid, SEM_EMPTY, -worst);
+        semaphore_p(semid, SEM_MUTEX);
+        while ((claimed = ring_try_claim(pool, total, &pos)) == 0) {
+            // EMPTY 的计数不会多于实际空位, 这里只是防御
+            semaphore_v(semid, SEM_MUTEX);
+            sched_yield();
+            semaphore_p(semid, SEM_MUTEX);
+        }
+        semaphore_v(semid, SEM_MUTEX);
+        if (worst > (int)(claimed / REC_ALIGN)) {
+            semaphore_add(semid, SEM_EMPTY, worst - claimed / REC_ALIGN);
+        }
+    } else {
+        for (int spins = 0; ; spins++) {
+            if (ring_try_claim(pool, total, &pos)) break;
+            if (spins < SPIN_TRIES) {
+                cpu_relax();
+                continue;
+            }
+            __atomic_add_fetch(&pool->full_waiters, 1, __ATOMIC_SEQ_CST);
+            int val = __atomic_load_n(&pool->not_full, __ATOMIC_SEQ_CST);
+            int got = ring_try_claim(pool, total, &pos) != 0;
+            if (!got) futex_wait(&pool->not_full, val, NULL);
+            __atomic_sub_fetch(&pool->full_waiters, 1, __ATOMIC_SEQ_CST);
+            if (got) break;
+        }
+    }
+
+    b->pos = b->next = pos;
+    b->end = pos + total;
+    b->count = 0;
+}
+
+// 在认领的区域中布置下一条 len 字节的记录, 返回写入负载的位置
+char *batch_add(struct BufferPool *pool, struct Batch *b, size_t len) {
+    struct RecordHeader *hdr = record_at(pool, b->next);
+    hdr->len = len;
+    hdr->flags = 0;
+    b->next += record_size(len);
+    b->count++;
+    return (char *)(hdr + 1);
+}
+
+// 一次发布整批记录, 之后生产者不能再访问这段区域
+void pool_commit(struct BufferPool *pool, int semid, struct Batch *b) {
+    for (unsigned long pos = b->pos; pos != b->next; ) {
+        struct RecordHeader *hdr = record_at(pool, pos);
+        unsigned long next = pos + record_size(hdr->len);
+        __atomic_store_n(&hdr->stamp, pos + 1, __ATOMIC_RELEASE);
+        pos = next;
+    }
+    if (transport == TRANSPORT_SYSV) {
+        semaphore_add(semid, SEM_FULL, b->count);
+    } else {
+        // 醒来的消费者会取走所有已提交的记录, 叫醒一个就够了
+        ring_signal(&pool->not_empty, &pool->empty_waiters, 1);
+    }
+}
+
+// 取走所有已提交的记录, 至多 max 条。用 batch_next 逐条就地处理, 处理完后必须调用
+// pool_release。环空时等待, timeout_sec 秒内没有数据返回 -2, 缓冲池已关闭且取空返回 -3,
+// 出错返回 -1
+int pool_peek(struct BufferPool *pool, int semid, struct Batch *b, int max, int timeout_sec) {
+    if (transport == TRANSPORT_SYSV) {
+        int ret = sem_timed_p(semid, SEM_FULL, timeout_sec);
+        if (ret < 0) return ret;
+        // 再不等待地多拿一些 FULL: 拿到几个就取几条, 不会去等别的消费者已经拿走的计数
+        int tokens = 1 + sem_try_take(semid, SEM_FULL, max - 1);
+        semaphore_p(semid, SEM_MUTEX);
+        // FULL 只说明有记录提交了, 排在前面的记录可能还在被别的生产者写入
+        while (1) {
+            int closed = __atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE);
+            if (ring_try_take(pool, semid, b, tokens) == 0) break;
+            semaphore_v(semid, SEM_MUTEX);
+            if (closed) {
+                // 拿到的是关闭时多给的计数, 传给下一个消费者
+                semaphore_add(semid, SEM_FULL, tokens);
+                return -3;
+            }
+            sched_yield();
+            semaphore_p(semid, SEM_MUTEX);
+        }
+        semaphore_v(semid, SEM_MUTEX);
+        if (tokens > b->count) semaphore_add(semid, SEM_FULL, tokens - b->count);
+        return 0;
+    }
+
+    struct timespec timeout = {timeout_sec, 0};
+    for (int spins = 0; ; spins++) {
+        if (ring_try_take(pool, semid, b, max) == 0) return 0;
+        if (spins < SPIN_TRIES) {
+            cpu_relax();
+            continue;
+        }
+        __atomic_add_fetch(&pool->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        int val = __atomic_load_n(&pool->not_empty, __ATOMIC_SEQ_CST);
+        int closed = __atomic_load_n(&pool->closed, __ATOMIC_SEQ_CST);
+        int got = ring_try_take(pool, semid, b, max) == 0;
+        int ret = got || closed ? 0 : futex_wait(&pool->not_empty, val, &timeout);
+        int timed_out = !got && ret == -1 && errno == ETIMEDOUT;
+        __atomic_sub_fetch(&pool->empty_waiters, 1, __ATOMIC_SEQ_CST);
+        if (got) return 0;
+        if (closed) return -3;
+        if (timed_out) return -2;
+    }
+}
+
+// 生产者结束时调用。最后一个生产者关闭缓冲池: 之后不会再有新记录, 等待的消费者全部叫醒,
+// 取完剩下的记录后 pool_peek 返回 -3
+void producer_done(struct BufferPool *pool, int semid) {
+    if (__atomic_sub_fetch(&pool->producers_left, 1, __ATOMIC_SEQ_CST) > 0) return;
+    __atomic_store_n(&pool->closed, 1, __ATOMIC_SEQ_CST);
+    if (transport == TRANSPORT_SYSV) {
+        // 多给一个 FULL 计数, 它会在等待的消费者之间依次传递, 把它们逐个叫醒
+        semaphore_v(semid, SEM_FULL);
+    } else {
+        ring_signal(&pool->not_empty, &pool->empty_waiters, INT_MAX);
+    }
+}
+
+// 取出批中的下一条记录, 跳过填充记录; 没有了返回 0
+int batch_next(struct BufferPool *pool, struct Batch *b, struct Record *rec) {
+    while (b->next != b->end) {
+        struct RecordHeader *hdr = record_at(pool, b->next);
+        unsigned long pos = b->next;
+        b->next += record_size(hdr->len);
+        if (hdr->flags & REC_PAD) continue;
+        rec->pos = pos;
+        rec->data = (char *)(hdr + 1);
+        rec->len = hdr->len;
+        return 1;
+    }
+    return 0;
+}
+
+// 归还整批记录占用的空间, 之后消费者不能再访问这段区域
+void pool_release(struct BufferPool *pool, int semid, struct Batch *b) {
+    pool_give_back(pool, semid, pool_free(pool, b->pos, b->end));
+}
+
+// 把 buf 中的完整行按批写入缓冲区, 返回用掉的字节数。超过单条记录上限的长行拆成多条记录;
+// final 为真时末尾不完整的一行也写入
+size_t produce_lines(struct BufferPool *pool, int semid, int id, const char *buf, size_t len, int final) {
+    size_t max_reserve = pool_max_reserve(pool);
+    size_t max_len = max_reserve - sizeof(struct RecordHeader);
+    const char *lines[MAX_BATCH];
+    size_t lens[MAX_BATCH];
+    size_t off = 0;
+
+    while (1) {
+        int n = 0;
+        size_t total = 0, scan = off;
+        while (n < batch_size && scan < len) {
+            const char *nl = memchr(buf + scan, '\n', len - scan);
+            size_t line_len = nl ? (size_t)(nl - (buf + scan)) : len - scan;
+            if (!nl && !final && line_len <= max_len) break; // 等读到这一行的剩余部分
+            size_t piece = line_len > max_len ? max_len : line_len;
+            if (total + record_size(piece) > max_reserve) break;
+            lines[n] = buf + scan;
+            lens[n] = piece;
+            total += record_size(piece);
+            n++;
+            scan += piece;
+            if (nl && piece == line_len) scan++; // 跳过换行符
+        }
+        if (n == 0) break;
+
+        struct Batch b;
+        pool_reserve(pool, semid, total, &b);
+        for (int i = 0; i < n; i++) {
+            memcpy(batch_add(pool, &b, lens[i]), lines[i], lens[i]); // 直接写进共享缓冲区
+        }
+        printf("生产者 %d -> 缓冲区[%lu]: %d 条记录\n", id, b.pos % pool->capacity, n);
+        pool_commit(pool, semid, &b);
+        off = scan;
+    }
+    return off;
+}
+
 // 生产者子进程执行的逻辑
 void run_producer(int id, int shmid, int semid) {
     char filename[32];
     sprintf(filename, "producer%d.txt", id);
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        perror("Producer: fopen failed");
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Producer: open failed");
         exit(1);
     }
 
     struct BufferPool *pool = (struct BufferPool *)shmat(shmid, NULL, 0);
-    char line[MAX_STR_LEN];
+    char *chunk = malloc(READ_CHUNK);
+    size_t have = 0;
     printf("--- 生产者 %d (PID %d) 启动, 读取文件: %s\n", id, getpid(), filename);
 
-    while (fgets(line, sizeof(line), fp)) {
-        line[strcspn(line, "\n")] = 0; // 移除换行符
-
-        semaphore_p(semid, SEM_EMPTY); // 等待空位
-        semaphore_p(semid, SEM_MUTEX); // 锁定
-
-        strcpy(pool->buffers[pool->write_pos], line);
-        printf("生产者 %d -> 缓冲区[%d]: \"%s\"\n", id, pool->write_pos, line);
-        pool->write_pos = (pool->write_pos + 1) % BUFFER_SIZE;
-
-        semaphore_v(semid, SEM_MUTEX); // 解锁
-        semaphore_v(semid, SEM_FULL);  // 通知有新产品
-        sleep(1);
+    while (1) {
+        ssize_t n = read(fd, chunk + have, READ_CHUNK - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("Producer: read failed");
+            break;
+        }
+        have += n;
+        size_t used = produce_lines(pool, semid, id, chunk, have, n == 0);
+        if (used == 0 && have == READ_CHUNK) {
+            used = produce_lines(pool, semid, id, chunk, have, 1); // 一行比读缓冲区还长, 在这里断开
+        }
+        memmove(chunk, chunk + used, have - used);
+        have -= used;
+        if (n == 0) break;
     }
 
-    fclose(fp);
+    free(chunk);
+    close(fd);
+    producer_done(pool, semid);
     shmdt(pool);
+    if (have > 0) { // 数据没能写入缓冲区, 不能当作正常结束
+        fprintf(stderr, "生产者 %d: 有 %zu 字节无法写入缓冲区\n", id, have);
+        exit(1);
+    }
     printf("--- 生产者 %d 完成文件读取, 退出\n", id);
 }
 
+// 写出 iov 中的全部数据, 处理部分写入
+int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
 // 消费者子进程执行的逻辑
 void run_consumer(int id, int shmid, int semid) {
     char filename[32];
     sprintf(filename, "consumer%d.txt", id);
-    FILE *fp = fopen(filename, "w");
-    if (!fp) {
-        perror("Consumer: fopen failed");
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Consumer: open failed");
         exit(1);
     }
     
     struct BufferPool *pool = (struct BufferPool *)shmat(shmid, NULL, 0);
-    char buffer[MAX_STR_LEN];
+    struct iovec iov[2 * CONSUMER_BATCH];
     printf("--- 消费者 %d (PID %d) 启动, 写入文件: %s\n", id, getpid(), filename);
 
     while (1) {
         printf("消费者 %d 正在等待产品...\n", id);
-        int ret = sem_timed_p(semid, SEM_FULL, CONSUMER_TIMEOUT);
-        
-        if (ret == 0) { // 成功等到产品
-            semaphore_p(semid, SEM_MUTEX);
-            strcpy(buffer, pool->buffers[pool->read_pos]);
-            pool->read_pos = (pool->read_pos + 1) % BUFFER_SIZE;
-            semaphore_v(semid, SEM_MUTEX);
-            semaphore_v(semid, SEM_EMPTY);
+        struct Batch b;
+        int ret = pool_peek(pool, semid, &b, CONSUMER_BATCH, CONSUMER_TIMEOUT);
+
+        if (ret == 0) { // 成功等到产品: 取走全部已提交的记录, 直接从缓冲区一次写进文件后释放
+            struct Record rec;
+            int n = 0;
+            while (batch_next(pool, &b, &rec)) {
+                iov[n].iov_base = rec.data;
+                iov[n++].iov_len = rec.len;
+                iov[n].iov_base = "\n";
+                iov[n++].iov_len = 1;
+            }
+            printf("消费者 %d <- 缓冲区[%lu]: %d 条记录\n", id, b.pos % pool->capacity, b.count);
+            if (writev_all(fd, iov, n) < 0) perror("Consumer: writev failed");
+            pool_release(pool, semid, &b);
 
-            printf("消费者 %d <- 缓冲区: \"%s\"\n", id, buffer);
-            fprintf(fp, "%s\n", buffer);
-            fflush(fp);
+        } else if (ret == -3) { // 生产者都已结束, 缓冲区也取空了
+            printf("--- 消费者 %d 取完所有产品, 退出\n", id);
+            break;
 
         } else if (ret == -2) { // 等待超时
             printf("\n>>> 消费者 %d 等待超时 (%d 秒). 是否继续等待? (y/n): ", id, CONSUMER_TIMEOUT);
@@ -144,20 +605,191 @@ void run_consumer(int id, int shmid, int semid) {
         }
     }
 
-    fclose(fp);
+    close(fd);
+    shmdt(pool);
+}
+
+unsigned long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int hist_index(unsigned long v) {
+    if (v < HIST_SUB) return v;
+    int msb = 63 - __builtin_clzl(v);
+    int sub = (v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// 直方图格子代表的值, 取格子的中点
+unsigned long hist_value(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    unsigned long low = ((unsigned long)HIST_SUB | (idx % HIST_SUB)) << (msb - HIST_SUB_BITS);
+    return low + ((1UL << (msb - HIST_SUB_BITS)) >> 1);
+}
+
+unsigned long percentile(const struct BenchStats *s, double p) {
+    if (s->count == 0) return 0;
+    unsigned long rank = (unsigned long)(p * s->count);
+    if (rank >= s->count) rank = s->count - 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += s->hist[i];
+        if (seen > rank) {
+            unsigned long v = hist_value(i);
+            return v > s->lat_max ? s->lat_max : v;
+        }
+    }
+    return s->lat_max;
+}
+
+// 基准测试的生产者: 不读文件, 直接在缓冲区中生成 count 条 size 字节的记录。
+// 每条记录开头是填好这一批时的时间戳, 消费者据此计算延迟
+void bench_producer(int shmid, int semid, long count, size_t size) {
+    struct BufferPool *pool = (struct BufferPool *)shmat(shmid, NULL, 0);
+    size_t rsize = record_size(size);
+    long per = batch_size;
+    if (per * rsize > pool_max_reserve(pool)) per = pool_max_reserve(pool) / rsize;
+
+    while (count > 0) {
+        long n = count < per ? count : per;
+        struct Batch b;
+        pool_reserve(pool, semid, n * rsize, &b);
+        unsigned long ts = now_ns();
+        for (long i = 0; i < n; i++) {
+            char *p = batch_add(pool, &b, size);
+            memcpy(p, &ts, sizeof(ts));
+            memset(p + sizeof(ts), 'x', size - sizeof(ts));
+        }
+        pool_commit(pool, semid, &b);
+        count -= n;
+    }
+
+    producer_done(pool, semid);
     shmdt(pool);
 }
 
+// 基准测试的消费者: 就地读出每条记录的时间戳, 把延迟记进自己的直方图
+void bench_consumer(int shmid, int semid, struct BenchStats *stats) {
+    struct BufferPool *pool = (struct BufferPool *)shmat(shmid, NULL, 0);
+    while (1) {
+        struct Batch b;
+        int ret = pool_peek(pool, semid, &b, CONSUMER_BATCH, CONSUMER_TIMEOUT);
+        if (ret == -2) continue;
+        if (ret < 0) break;
+
+        unsigned long now = now_ns();
+        struct Record rec;
+        while (batch_next(pool, &b, &rec)) {
+            unsigned long ts;
+            memcpy(&ts, rec.data, sizeof(ts));
+            unsigned long lat = now > ts ? now - ts : 0;
+            stats->hist[hist_index(lat)]++;
+            stats->lat_sum += lat;
+            if (lat > stats->lat_max) stats->lat_max = lat;
+        }
+        stats->count += b.count;
+        pool_release(pool, semid, &b);
+        stats->last_ns = now_ns();
+    }
+    shmdt(pool);
+}
+
+// 汇总各消费者的统计并输出。用时从创建子进程前算到最后一批记录处理完;
+// 上下文切换数取自所有已回收子进程的 rusage
+void print_bench_report(struct BenchStats *stats, int num_consumers, unsigned long start_ns,
+                        long expected, size_t size, long capacity) {
+    struct BenchStats total;
+    memset(&total, 0, sizeof(total));
+    unsigned long end_ns = start_ns;
+    for (int i = 0; i < num_consumers; i++) {
+        total.count += stats[i].count;
+        total.lat_sum += stats[i].lat_sum;
+        if (stats[i].lat_max > total.lat_max) total.lat_max = stats[i].lat_max;
+        if (stats[i].last_ns > end_ns) end_ns = stats[i].last_ns;
+        for (int j = 0; j < HIST_BUCKETS; j++) total.hist[j] += stats[i].hist[j];
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    double secs = (end_ns - start_ns) / 1e9;
+    unsigned long n = total.count ? total.count : 1;
+
+    printf("传输方式: %s, 缓冲区 %ld 字节, 记录 %zu 字节, 每批至多 %d 条\n",
+           transport == TRANSPORT_RING ? "无锁环" : "SysV 信号量", capacity, size, batch_size);
+    printf("记录数: %lu (应为 %ld), 用时 %.3f 秒\n", total.count, expected, secs);
+    printf("吞吐: %.0f 条/秒, %.1f ns/条, %.1f MB/秒\n",
+           total.count / secs, secs * 1e9 / n, total.count * size / secs / 1e6);
+    printf("延迟 (ns): 平均 %.0f, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, 最大 %lu\n",
+           (double)total.lat_sum / n, percentile(&total, 0.50), percentile(&total, 0.90),
+           percentile(&total, 0.99), percentile(&total, 0.999), total.lat_max);
+    printf("上下文切换: 自愿 %ld, 非自愿 %ld, 每千条 %.2f 次\n",
+           ru.ru_nvcsw, ru.ru_nivcsw, (ru.ru_nvcsw + ru.ru_nivcsw) * 1000.0 / n);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "用法: %s [-t sysv|ring] [-b 字节数] [-k 条数] [-n 条数 [-s 字节数]] <生产者数量> <消费者数量>\n", prog);
+    fprintf(stderr, "  -t  传输方式: sysv 为三个 SysV 信号量保护的缓冲池 (默认),\n"
+                    "      ring 为共享内存中的无锁环, 只在环空或环满时用 futex 睡眠\n");
+    fprintf(stderr, "  -b  缓冲区容量, 默认 %d 字节; 单条记录最长为容量的一半左右\n", DEFAULT_CAPACITY);
+    fprintf(stderr, "  -k  生产者每批最多写入的记录条数, 1 到 %d, 默认 %d\n", MAX_BATCH, PRODUCER_BATCH);
+    fprintf(stderr, "  -n  基准测试: 每个生产者生成 n 条记录, 不读写文件, 结束后报告吞吐、延迟和上下文切换\n");
+    fprintf(stderr, "  -s  基准测试中每条记录的字节数, 默认 %d, 至少 8 (记录开头的时间戳)\n", BENCH_RECORD);
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "用法: %s <生产者数量> <消费者数量>\n", argv[0]);
+    int opt;
+    long capacity = DEFAULT_CAPACITY;
+    long bench_count = 0;
+    long bench_size = BENCH_RECORD;
+    while ((opt = getopt(argc, argv, "t:b:k:n:s:")) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "sysv") == 0) transport = TRANSPORT_SYSV;
+                else if (strcmp(optarg, "ring") == 0) transport = TRANSPORT_RING;
+                else usage(argv[0]);
+                break;
+            case 'b':
+                capacity = atol(optarg);
+                break;
+            case 'k':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > MAX_BATCH) usage(argv[0]);
+                break;
+            case 'n':
+                bench_count = atol(optarg);
+                if (bench_count < 1) usage(argv[0]);
+                break;
+            case 's':
+                bench_size = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) usage(argv[0]);
+    int num_producers = atoi(argv[optind]);
+    int num_consumers = atoi(argv[optind + 1]);
+    if (bench_count > 0 && (num_producers < 1 || num_consumers < 1)) usage(argv[0]);
+
+    // 容量按记录对齐; SysV 方式下空位以 REC_ALIGN 字节为单位记在信号量里, 不能超过信号量的上限
+    capacity &= ~(long)(REC_ALIGN - 1);
+    if (capacity < 4 * REC_ALIGN || (transport == TRANSPORT_SYSV && capacity / REC_ALIGN > SHRT_MAX)) {
+        fprintf(stderr, "缓冲区容量须在 %d 到 %d 字节之间\n", 4 * REC_ALIGN,
+                transport == TRANSPORT_SYSV ? SHRT_MAX * REC_ALIGN : INT_MAX);
+        exit(1);
+    }
+    if (bench_count > 0 && (bench_size < (long)sizeof(unsigned long) ||
+                            record_size(bench_size) > reserve_limit(capacity))) {
+        fprintf(stderr, "记录须在 %zu 到 %zu 字节之间\n", sizeof(unsigned long),
+                reserve_limit(capacity) - sizeof(struct RecordHeader));
         exit(1);
     }
-    int num_producers = atoi(argv[1]);
-    int num_consumers = atoi(argv[2]);
 
     // 1. 创建临时的生产者输入文件
-    for (int i = 0; i < num_producers; ++i) {
+    for (int i = 0; i < num_producers && bench_count == 0; ++i) {
         char filename[32];
         snprintf(filename, sizeof(filename), "producer%d.txt", i);
         FILE *fp = fopen(filename, "w");
@@ -167,24 +799,51 @@ int main(int argc, char *argv[]) {
         fclose(fp);
     }
 
-    // 2. 初始化IPC资源
-    int shmid = shmget(IPC_KEY, sizeof(struct BufferPool), 0666 | IPC_CREAT);
+    // 2. 初始化IPC资源。共享内存的大小随容量变化, 用 IPC_PRIVATE 新建, 不会撞上以前运行
+    // 残留的同键大小不同的段; 子进程由 fork 继承 shmid
+    int shmid = shmget(IPC_PRIVATE, sizeof(struct BufferPool) + capacity, 0666 | IPC_CREAT);
+    if (shmid == -1) {
+        perror("shmget failed");
+        exit(1);
+    }
     struct BufferPool *pool = (struct BufferPool *)shmat(shmid, NULL, 0);
-    pool->write_pos = 0;
-    pool->read_pos = 0;
+    memset(pool, 0, sizeof(struct BufferPool) + capacity);
+    pool->capacity = capacity;
+    pool->producers_left = num_producers;
+    pool->closed = num_producers == 0;
     shmdt(pool);
 
+    // 基准测试的统计段在 fork 之前挂接, 子进程直接继承
+    int statid = -1;
+    struct BenchStats *stats = NULL;
+    if (bench_count > 0) {
+        statid = shmget(IPC_PRIVATE, num_consumers * sizeof(struct BenchStats), 0666 | IPC_CREAT);
+        if (statid == -1) {
+            perror("shmget failed");
+            exit(1);
+        }
+        stats = (struct BenchStats *)shmat(statid, NULL, 0);
+        memset(stats, 0, num_consumers * sizeof(struct BenchStats));
+    }
+
     int semid = semget(IPC_KEY, 3, 0666 | IPC_CREAT);
     union semun su;
     su.val = 1; semctl(semid, SEM_MUTEX, SETVAL, su);
-    su.val = BUFFER_SIZE; semctl(semid, SEM_EMPTY, SETVAL, su);
+    su.val = capacity / REC_ALIGN; semctl(semid, SEM_EMPTY, SETVAL, su);
     su.val = 0; semctl(semid, SEM_FULL, SETVAL, su);
-    printf("主进程: IPC资源已初始化\n");
+    printf("主进程: IPC资源已初始化, 传输方式: %s, 缓冲区 %ld 字节\n",
+           transport == TRANSPORT_RING ? "无锁环" : "SysV 信号量", capacity);
 
     // 3. fork创建子进程
+    fflush(stdout); // 否则子进程会把缓冲区中尚未输出的内容再输出一遍
+    unsigned long start_ns = now_ns();
     for (int i = 0; i < num_producers + num_consumers; i++) {
         if (fork() == 0) {
-            if (i < num_producers) {
+            if (bench_count > 0 && i < num_producers) {
+                bench_producer(shmid, semid, bench_count, bench_size);
+            } else if (bench_count > 0) {
+                bench_consumer(shmid, semid, &stats[i - num_producers]);
+            } else if (i < num_producers) {
                 run_producer(i, shmid, semid);
             } else {
                 run_consumer(i - num_producers, shmid, semid);
@@ -195,8 +854,17 @@ int main(int argc, char *argv[]) {
 
     // 4. 父进程等待所有子进程结束
     printf("主进程: 所有子进程已创建，等待它们结束...\n");
+    int failed = 0;
     for (int i = 0; i < num_producers + num_consumers; i++) {
-        wait(NULL);
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+    }
+
+    if (bench_count > 0) {
+        print_bench_report(stats, num_consumers, start_ns, bench_count * num_producers, bench_size, capacity);
+        shmdt(stats);
+        shmctl(statid, IPC_RMID, NULL);
     }
 
     // 5. 清理IPC资源
@@ -205,5 +873,5 @@ int main(int argc, char *argv[]) {
     semctl(semid, 0, IPC_RMID, NULL);
     printf("主进程: 清理完成\n");
 
-    return 0;
+    return failed;
 }
\ No newline at end of file
@@ -2,16 +2,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include "protocol.h"
 
 #define BUFFER_SIZE 1024
+#define OUT_FRAMES 16           // 发送缓冲区能攒下的最大帧数, 攒满或本次输入处理完就发出
 
 pid_t child_pid;
 
+// 发送缓冲区: 一次从标准输入读到的多行各编码成一帧, 合并成一次 send
+char out_buf[OUT_FRAMES * CHAT_MAX_FRAME];
+size_t out_len = 0;
+
 void handle_shutdown(int sig) {
     if (child_pid > 0) {
         kill(child_pid, SIGKILL);
@@ -20,6 +28,96 @@ void handle_shutdown(int sig) {
     exit(0);
 }
 
+int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+void flush_frames(int sock_fd) {
+    if (out_len > 0 && send_all(sock_fd, out_buf, out_len) < 0) {
+        perror("send 失败");
+        handle_shutdown(SIGINT);
+    }
+    out_len = 0;
+}
+
+void queue_frame(int sock_fd, int type, const char *payload, size_t len) {
+    if (out_len + CHAT_HEADER_SIZE + len > sizeof(out_buf)) flush_frames(sock_fd);
+    out_len += chat_encode(out_buf + out_len, type, 0, payload, len);
+}
+
+// 处理输入的一行 (不含换行): exit 离开聊天室, /ping 测量到服务器的往返时间, 其余作为文本发送。
+// 返回 1 表示用户要退出
+int queue_line(int sock_fd, const char *line, size_t len) {
+    if (len > 0 && line[len - 1] == '\r') len--;
+    if (len == 4 && memcmp(line, "exit", 4) == 0) {
+        queue_frame(sock_fd, CHAT_EXIT, NULL, 0);
+        return 1;
+    }
+    if (len == 5 && memcmp(line, "/ping", 5) == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        queue_frame(sock_fd, CHAT_PING, (const char *)&ts, sizeof(ts));
+        return 0;
+    }
+    // 超过一帧上限的长行拆成多条消息
+    while (len > 0) {
+        size_t part = len > CHAT_MAX_PAYLOAD ? CHAT_MAX_PAYLOAD : len;
+        queue_frame(sock_fd, CHAT_TEXT, line, part);
+        line += part;
+        len -= part;
+    }
+    return 0;
+}
+
+// 子进程: 按帧接收并显示消息
+void receive_loop(int sock_fd) {
+    struct chat_decoder dec;
+    chat_decoder_init(&dec);
+    while (1) {
+        size_t avail;
+        char *space = chat_decoder_space(&dec, &avail);
+        ssize_t n = recv(sock_fd, space, avail, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            printf("服务器已断开连接。\n");
+            break;
+        }
+        chat_decoder_commit(&dec, n);
+
+        struct chat_frame f;
+        int r;
+        while ((r = chat_decoder_next(&dec, &f)) > 0) {
+            if (f.type == CHAT_TEXT) {
+                if (f.sender == 0) printf("服务器: %.*s\n", f.len, f.payload);
+                else printf("客户端 %u: %.*s\n", f.sender, f.len, f.payload);
+            } else if (f.type == CHAT_PONG && f.len == sizeof(struct timespec)) {
+                struct timespec sent, now;
+                memcpy(&sent, f.payload, sizeof(sent));
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                double ms = (now.tv_sec - sent.tv_sec) * 1e3 + (now.tv_nsec - sent.tv_nsec) / 1e6;
+                printf("往返时间 %.3f ms\n", ms);
+            } else if (f.type == CHAT_EXIT) {
+                printf("服务器已关闭。\n");
+                r = -2;
+                break;
+            }
+        }
+        fflush(stdout);
+        if (r == -1) printf("收到无法解析的数据。\n");
+        if (r < 0) break;
+    }
+    kill(getppid(), SIGINT); // 通知父进程退出
+}
+
 int main(int argc, char* argv[]) {
     // 命令行要求有服务器地址，服务器端口号
     if (argc != 3) {
@@ -56,40 +154,54 @@ int main(int argc, char* argv[]) {
     }
 
     printf("成功连接到服务器 %s:%d。可以开始聊天了。\n", server_ip, port);
-    
+    fflush(stdout);
+
     signal(SIGINT, handle_shutdown);
 
     child_pid = fork();
-    
+
     if (child_pid < 0) {
         perror("fork 失败");
         exit(1);
     }
 
     if (child_pid == 0) { // 子进程: 接收并显示消息
-        ssize_t n;
-        while ((n = recv(sock_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            buffer[n] = '\0';
-            printf("服务器: %s", buffer);
-        }
-        if (n == 0) {
-            printf("服务器已断开连接。\n");
-            kill(getppid(), SIGINT); // 通知父进程退出
-        }
+        receive_loop(sock_fd);
     } else { // 父进程: 从标准输入读取并发送
-        while (1) {
-            fgets(buffer, BUFFER_SIZE, stdin);
-            send(sock_fd, buffer, strlen(buffer), 0);
-            
-            // 客户方通过输入exit文本结束与服务器的通信并退出程序
-            if (strncmp(buffer, "exit", 4) == 0) {
-                kill(child_pid, SIGKILL); // 结束子进程
+        size_t len = 0;
+        int done = 0;
+        while (!done) {
+            ssize_t n = read(STDIN_FILENO, buffer + len, sizeof(buffer) - len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // 标准输入结束: 发出没有换行的最后一行, 然后离开
+                if (len > 0) queue_line(sock_fd, buffer, len);
+                queue_frame(sock_fd, CHAT_EXIT, NULL, 0);
                 break;
             }
+            len += n;
+
+            // 本次读到的完整行各编码成一帧, 合并后一次发出
+            size_t start = 0;
+            for (size_t i = len - n; i < len && !done; i++) {
+                if (buffer[i] != '\n') continue;
+                done = queue_line(sock_fd, buffer + start, i - start);
+                start = i + 1;
+            }
+            if (!done && start == 0 && len == sizeof(buffer)) {
+                queue_line(sock_fd, buffer, len);
+                start = len;
+            }
+            memmove(buffer, buffer + start, len - start);
+            len -= start;
+            flush_frames(sock_fd);
         }
+        // 客户方输入 exit 或输入结束时通知服务器后退出
+        flush_frames(sock_fd);
+        kill(child_pid, SIGKILL); // 结束子进程
         wait(NULL);
     }
 
     close(sock_fd);
     return 0;
-}
\ No newline at end of file
+}
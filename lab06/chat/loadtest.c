@@ -0,0 +1,359 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "protocol.h"
+
+// 聊天服务器压测工具: 在本机起 N 个模拟客户端, 每个按固定速率发送带发送时间戳的消息,
+// 统计广播送达延迟的分位数、每秒送达和丢弃的消息数以及服务器的内存占用, 结果以 JSON 输出,
+// 方便对比服务器改动前后的表现。发送时间用 CLOCK_MONOTONIC, 所以只能和服务器在同一台机器上用。
+
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_RATE 10
+#define DEFAULT_DURATION 10
+#define DEFAULT_PAYLOAD 64
+#define DRAIN_MS 1000           // 停止发送后继续接收的时间, 让路上的消息送达
+#define RSS_SAMPLE_MS 100
+#define MAX_EVENTS 256
+// 负载开头是发送时间和本次运行的标记, 各 8 字节; 标记不符的消息 (例如服务器回放的
+// 历史消息, 或其他客户端发的消息) 不计入送达
+#define PAYLOAD_TAG (2 * sizeof(uint64_t))
+// 延迟直方图: 以微秒为单位, 每个 2 的幂区间再分成 16 格, 相对误差约 6%
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct sim_client {
+    int fd;
+    int connected;
+    uint64_t next_send_ns;
+    struct chat_decoder dec;
+};
+
+struct sim_client *sims;
+int num_clients = DEFAULT_CLIENTS;
+int rate = DEFAULT_RATE;
+int duration = DEFAULT_DURATION;
+int payload_size = DEFAULT_PAYLOAD;
+pid_t server_pid = 0;
+uint64_t run_nonce;
+
+unsigned long sent = 0, send_blocked = 0, delivered = 0;
+unsigned long drop_notices = 0, dropped_reported = 0, disconnected = 0, foreign = 0;
+uint64_t hist[HIST_BUCKETS];
+uint64_t lat_min_us = UINT64_MAX, lat_max_us = 0, lat_sum_us = 0;
+long rss_start = -1, rss_max = -1, rss_end = -1;
+
+void error_die(const char *msg) { perror(msg); exit(1); }
+void usage(const char *prog);
+uint64_t now_ns(void);
+void raise_fd_limit(void);
+int connect_client(const struct sockaddr_in *addr);
+void send_message(struct sim_client *s, uint64_t now);
+void receive(struct sim_client *s);
+void record_latency(uint64_t us);
+int hist_index(uint64_t us);
+uint64_t hist_value(int idx);
+uint64_t percentile(double p);
+long read_rss_kb(pid_t pid);
+void sample_rss(void);
+void print_report(double elapsed_s);
+
+void usage(const char *prog) {
+    fprintf(stderr, "用法: %s [-c 客户端数] [-r 速率] [-d 秒] [-s 字节] [-p 服务器进程号] <服务器IP> <端口号>\n", prog);
+    fprintf(stderr, "  -c  模拟客户端数, 默认 %d\n", DEFAULT_CLIENTS);
+    fprintf(stderr, "  -r  每个客户端每秒发送的消息数, 默认 %d\n", DEFAULT_RATE);
+    fprintf(stderr, "  -d  发送持续时间, 默认 %d 秒\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -s  每条消息的负载字节数 (至少 %zu, 存放发送时间和本次运行的标记), 默认 %d\n",
+            PAYLOAD_TAG, DEFAULT_PAYLOAD);
+    fprintf(stderr, "只统计本次运行发出的消息, 服务器回放的历史消息等记为 foreign\n");
+    fprintf(stderr, "  -p  服务器进程号, 给出时从 /proc 采样服务器的常驻内存\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "c:r:d:s:p:")) != -1) {
+        switch (opt_ch) {
+            case 'c':
+                num_clients = atoi(optarg);
+                if (num_clients < 2) usage(argv[0]);
+                break;
+            case 'r':
+                rate = atoi(optarg);
+                if (rate <= 0) usage(argv[0]);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                if (duration <= 0) usage(argv[0]);
+                break;
+            case 's':
+                payload_size = atoi(optarg);
+                if (payload_size < (int)PAYLOAD_TAG || payload_size > CHAT_MAX_PAYLOAD) usage(argv[0]);
+                break;
+            case 'p':
+                server_pid = atoi(optarg);
+                if (server_pid <= 0) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) usage(argv[0]);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[optind + 1]));
+    if (inet_pton(AF_INET, argv[optind], &addr.sin_addr) <= 0) {
+        fprintf(stderr, "无效的服务器地址: %s\n", argv[optind]);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) error_die("epoll_create1 失败");
+    sims = calloc(num_clients, sizeof(*sims));
+    if (!sims) error_die("calloc 失败");
+
+    // 1. 所有客户端都连上之后才开始发送, 保证每条消息的预期接收人数都是 N-1
+    sample_rss();
+    rss_start = rss_end;
+    uint64_t start = now_ns();
+    run_nonce = start ^ (uint64_t)getpid() << 32;
+    uint64_t interval = 1000000000ULL / rate;
+    for (int i = 0; i < num_clients; i++) {
+        struct sim_client *s = &sims[i];
+        s->fd = connect_client(&addr);
+        s->connected = 1;
+        chat_decoder_init(&s->dec);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd, &ev) < 0) error_die("epoll_ctl 失败");
+    }
+    // 2. 各客户端的第一次发送在一个发送间隔内均匀错开, 避免所有消息挤在同一时刻
+    start = now_ns();
+    for (int i = 0; i < num_clients; i++) sims[i].next_send_ns = start + interval * i / num_clients;
+
+    uint64_t send_end = start + (uint64_t)duration * 1000000000ULL;
+    uint64_t drain_end = send_end + DRAIN_MS * 1000000ULL;
+    uint64_t next_rss = start;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= drain_end) break;
+        if (now < send_end) {
+            for (int i = 0; i < num_clients; i++) {
+                struct sim_client *s = &sims[i];
+                while (s->connected && s->next_send_ns <= now && s->next_send_ns < send_end) {
+                    send_message(s, now);
+                    s->next_send_ns += interval;
+                }
+            }
+        }
+        if (now >= next_rss) {
+            sample_rss();
+            next_rss = now + RSS_SAMPLE_MS * 1000000ULL;
+        }
+        // 3. 等待到下一次要发送的时刻 (最多 1 毫秒), 期间处理收到的消息
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1);
+        if (n < 0 && errno != EINTR) error_die("epoll_wait 失败");
+        for (int i = 0; i < n; i++) receive(events[i].data.ptr);
+    }
+    sample_rss();
+    print_report((double)duration);
+    return 0;
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// 阻塞地建立连接, 之后改成非阻塞; 关掉 Nagle, 让每条消息立刻发出, 测到的是服务器的延迟
+int connect_client(const struct sockaddr_in *addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) error_die("socket 创建失败");
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0) error_die("connect 连接失败");
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+// 发送一条消息: 负载开头是发送时间和 run_nonce, 其余填充到指定大小。
+// 套接字写不进去时不排队, 记为发送受阻, 这样发送方的积压不会算进服务器的延迟
+void send_message(struct sim_client *s, uint64_t now) {
+    char frame[CHAT_MAX_FRAME];
+    char payload[CHAT_MAX_PAYLOAD];
+    memcpy(payload, &now, sizeof(now));
+    memcpy(payload + sizeof(now), &run_nonce, sizeof(run_nonce));
+    memset(payload + PAYLOAD_TAG, 'x', payload_size - PAYLOAD_TAG);
+    size_t len = chat_encode(frame, CHAT_TEXT, 0, payload, payload_size);
+    ssize_t n = send(s->fd, frame, len, MSG_NOSIGNAL);
+    if (n == (ssize_t)len) {
+        sent++;
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        send_blocked++;
+        return;
+    }
+    // 只写出半帧会让后面的数据全部错位, 这个连接只能放弃; close 同时把它移出 epoll
+    s->connected = 0;
+    disconnected++;
+    close(s->fd);
+}
+
+void receive(struct sim_client *s) {
+    while (s->connected) {
+        size_t avail;
+        char *space = chat_decoder_space(&s->dec, &avail);
+        ssize_t n = recv(s->fd, space, avail, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        }
+        if (n <= 0) {
+            // 服务器因为读得慢而断开了这个客户端, 或者服务器已经退出
+            s->connected = 0;
+            disconnected++;
+            close(s->fd);
+            return;
+        }
+        chat_decoder_commit(&s->dec, n);
+
+        uint64_t now = now_ns();
+        struct chat_frame f;
+        while (chat_decoder_next(&s->dec, &f) > 0) {
+            if (f.type == CHAT_TEXT && f.sender != 0) {
+                uint64_t t, nonce;
+                if (f.len < PAYLOAD_TAG) {
+                    foreign++;
+                    continue;
+                }
+                memcpy(&t, f.payload, sizeof(t));
+                memcpy(&nonce, f.payload + sizeof(t), sizeof(nonce));
+                if (nonce != run_nonce) {
+                    foreign++;
+                    continue;
+                }
+                delivered++;
+                record_latency(now > t ? (now - t) / 1000 : 0);
+            } else if (f.type == CHAT_TEXT && f.sender == 0) {
+                // 服务器的丢弃通知: "接收过慢，丢弃了 N 条消息"
+                const char *p = memmem(f.payload, f.len, "丢弃了 ", strlen("丢弃了 "));
+                if (p) {
+                    drop_notices++;
+                    dropped_reported += strtoul(p + strlen("丢弃了 "), NULL, 10);
+                }
+            }
+        }
+    }
+}
+
+int hist_index(uint64_t us) {
+    if (us < HIST_SUB) return us;
+    int msb = 63 - __builtin_clzll(us);
+    int sub = (us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+// 直方图格子代表的值, 取格子的中点
+uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t low = ((uint64_t)HIST_SUB | (idx % HIST_SUB)) << (msb - HIST_SUB_BITS);
+    return low + ((1ULL << (msb - HIST_SUB_BITS)) >> 1);
+}
+
+void record_latency(uint64_t us) {
+    hist[hist_index(us)]++;
+    lat_sum_us += us;
+    if (us < lat_min_us) lat_min_us = us;
+    if (us > lat_max_us) lat_max_us = us;
+}
+
+uint64_t percentile(double p) {
+    if (delivered == 0) return 0;
+    uint64_t rank = (uint64_t)(p * delivered);
+    if (rank >= delivered) rank = delivered - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            uint64_t v = hist_value(i);
+            return v > lat_max_us ? lat_max_us : v;
+        }
+    }
+    return lat_max_us;
+}
+
+long read_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+void sample_rss(void) {
+    if (server_pid <= 0) return;
+    rss_end = read_rss_kb(server_pid);
+    if (rss_end > rss_max) rss_max = rss_end;
+}
+
+// 每条成功发出的消息应当送到另外 N-1 个客户端, 没送到的都算作丢弃
+// (包括服务器主动丢弃的和随被断开的客户端一起丢失的)
+void print_report(double elapsed_s) {
+    unsigned long expected = sent * (unsigned long)(num_clients - 1);
+    unsigned long dropped = expected > delivered ? expected - delivered : 0;
+    printf("{\"clients\": %d, \"rate_per_client\": %d, \"duration_s\": %d, \"payload_bytes\": %d,\n",
+           num_clients, rate, duration, payload_size);
+    printf(" \"sent\": %lu, \"send_blocked\": %lu, \"expected\": %lu, \"delivered\": %lu, \"dropped\": %lu,\n",
+           sent, send_blocked, expected, delivered, dropped);
+    printf(" \"drop_notices\": %lu, \"dropped_reported\": %lu, \"disconnected\": %lu, \"foreign\": %lu,\n",
+           drop_notices, dropped_reported, disconnected, foreign);
+    printf(" \"sent_per_sec\": %.1f, \"delivered_per_sec\": %.1f, \"dropped_per_sec\": %.1f,\n",
+           sent / elapsed_s, delivered / elapsed_s, dropped / elapsed_s);
+    printf(" \"latency_us\": {\"min\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu},\n",
+           delivered ? (unsigned long)lat_min_us : 0, delivered ? (double)lat_sum_us / delivered : 0.0,
+           (unsigned long)percentile(0.50), (unsigned long)percentile(0.90), (unsigned long)percentile(0.99),
+           (unsigned long)percentile(0.999), (unsigned long)lat_max_us);
+    if (server_pid > 0) {
+        printf(" \"server_rss_kb\": {\"start\": %ld, \"max\": %ld, \"end\": %ld}}\n", rss_start, rss_max, rss_end);
+    } else {
+        printf(" \"server_rss_kb\": null}\n");
+    }
+}
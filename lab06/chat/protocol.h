@@ -0,0 +1,102 @@
+// 聊天协议的帧格式与流式解码器, server.c 和 client.c 共用。
+//
+// 每条消息是一个帧: 8 字节帧头 + 负载。帧头各字段均为网络字节序:
+//   0-1  负载长度 (不含帧头), 最大 CHAT_MAX_PAYLOAD
+//   2    消息类型, 见 enum chat_type
+//   3    保留, 填 0
+//   4-7  发送者编号, 由服务器转发时填写, 0 表示服务器自己; 客户端发出的帧填 0, 服务器不采信
+//
+// TCP 是字节流, 一次 recv 可能只有半个帧, 也可能包含好几个帧, 所以接收方必须
+// 按帧头给出的长度切分, 而不能把一次 recv 当成一条消息。
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CHAT_HEADER_SIZE 8
+#define CHAT_MAX_PAYLOAD 1024
+#define CHAT_MAX_FRAME (CHAT_HEADER_SIZE + CHAT_MAX_PAYLOAD)
+// 解码缓冲区放得下两个最大的帧: 把读到一半的帧挪到开头之后, 后面总还有一整帧的空间
+#define CHAT_DECODER_SIZE (2 * CHAT_MAX_FRAME)
+
+enum chat_type {
+    CHAT_TEXT = 1,      // 文本消息, 负载为 UTF-8 文本, 不含换行
+    CHAT_EXIT = 2,      // 客户端要离开, 或服务器要关闭
+    CHAT_PING = 3,      // 心跳, 对方用负载相同的 CHAT_PONG 回复
+    CHAT_PONG = 4,
+};
+
+struct chat_frame {
+    int type;
+    uint32_t sender;
+    uint16_t len;
+    const char *payload;    // 指向解码缓冲区内部, 下一次 chat_decoder_space 之前有效
+};
+
+// 流式解码器: 数据直接 recv 进 buf, 解出的帧负载就地引用, 不为每条消息分配内存
+struct chat_decoder {
+    size_t start;           // 下一个未解析帧的起始位置
+    size_t end;             // 已读入数据的末尾
+    char buf[CHAT_DECODER_SIZE];
+};
+
+static inline void chat_decoder_init(struct chat_decoder *d) {
+    d->start = d->end = 0;
+}
+
+// 返回可以读入新数据的位置和空间大小; 先把未解析完的数据挪到缓冲区开头
+static inline char *chat_decoder_space(struct chat_decoder *d, size_t *avail) {
+    if (d->start > 0) {
+        memmove(d->buf, d->buf + d->start, d->end - d->start);
+        d->end -= d->start;
+        d->start = 0;
+    }
+    *avail = sizeof(d->buf) - d->end;
+    return d->buf + d->end;
+}
+
+static inline void chat_decoder_commit(struct chat_decoder *d, size_t n) {
+    d->end += n;
+}
+
+// 取出下一个完整的帧: 成功返回 1 并填好 f; 数据还不够一帧返回 0;
+// 长度超限或类型未知返回 -1, 此时连接上的数据已无法再对齐, 只能断开
+static inline int chat_decoder_next(struct chat_decoder *d, struct chat_frame *f) {
+    size_t have = d->end - d->start;
+    if (have < CHAT_HEADER_SIZE) return 0;
+    const unsigned char *p = (const unsigned char *)d->buf + d->start;
+    size_t len = (size_t)p[0] << 8 | p[1];
+    if (len > CHAT_MAX_PAYLOAD || p[2] < CHAT_TEXT || p[2] > CHAT_PONG) return -1;
+    if (have < CHAT_HEADER_SIZE + len) return 0;
+    f->type = p[2];
+    f->sender = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+    f->len = len;
+    f->payload = (const char *)p + CHAT_HEADER_SIZE;
+    d->start += CHAT_HEADER_SIZE + len;
+    return 1;
+}
+
+// 已知 p 处是一个完整的合法帧时, 返回它的总长度 (帧头 + 负载)
+static inline size_t chat_frame_size(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return CHAT_HEADER_SIZE + ((size_t)u[0] << 8 | u[1]);
+}
+
+// 把一个帧编码到 out, out 至少要有 CHAT_HEADER_SIZE + len 字节; 返回帧的总长度。
+// len 由调用者保证不超过 CHAT_MAX_PAYLOAD
+static inline size_t chat_encode(char *out, int type, uint32_t sender, const void *payload, size_t len) {
+    unsigned char *p = (unsigned char *)out;
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    p[2] = type;
+    p[3] = 0;
+    p[4] = sender >> 24;
+    p[5] = sender >> 16;
+    p[6] = sender >> 8;
+    p[7] = sender;
+    if (len > 0) memcpy(out + CHAT_HEADER_SIZE, payload, len);
+    return CHAT_HEADER_SIZE + len;
+}
+
+#endif
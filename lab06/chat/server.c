@@ -1,112 +1,930 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
-#include <sys/wait.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "protocol.h"
 
-#define BUFFER_SIZE 1024
+#define MAX_EVENTS 256
+#define QUEUE_SLOTS 128             // 每个客户端发送队列最多排队的消息数
+#define FLUSH_IOV 64                // 一次 writev 最多合并的消息数
+#define DEFAULT_HIGH_WATER_KB 256
+#define DEFAULT_SLOW_GRACE 10
+#define DEFAULT_REPLAY 50
+#define DEFAULT_SEGMENT_KB (16 * 1024)
+#define HISTORY_BATCH (64 * 1024)   // 组提交缓冲区, 本批事件结束或缓冲区满时一次 write 写出
+#define HISTORY_INDEX_EVERY 64      // 稀疏索引每隔多少条消息记一个偏移
+#define HISTORY_SYNC_MS 1000        // 同步线程调用 fdatasync 的间隔, 也是崩溃时最多丢失的时间窗口
+#define HISTORY_RETIRED_MAX 16
 
-pid_t child_pid;
+// 历史日志的一个段文件 chat-<编号>.log, 内容就是一个接一个编码好的帧, 和发给客户端的字节完全相同。
+// 最新的两个段映射在内存中; 回放时直接把映射中连续的一段帧放进客户端的发送队列, 不复制也不重新编码
+struct history_segment {
+    int refs;                   // 历史模块持有一个, 每个引用它的回放消息各一个
+    unsigned long id;
+    char *map;
+    size_t map_size;
+    size_t len;                 // 已写入文件的字节数
+    unsigned long count;        // 已写入文件的消息数
+    size_t *index;              // 稀疏索引: index[k] 是第 k * HISTORY_INDEX_EVERY 条消息的偏移
+    size_t index_len;
+    size_t index_cap;
+};
+
+// 一条待发送的消息, data 指向编码好的帧。广播时只分配一次, 每个接收者的发送队列
+// 各持有一个引用, 最后一个接收者发送完毕时释放。回放历史的消息 data 指向日志段的映射,
+// 并持有该段的引用, 保证发送完之前映射不会被解除
+struct message {
+    int refs;
+    size_t len;
+    char *data;
+    struct history_segment *seg;
+    char buf[];
+};
+
+// 一个客户端连接。收到的数据由 dec 切分成帧, 每个文本帧换上服务器分配的发送者编号后广播。
+// 发给它的消息先进入 queue 环形队列, 本批事件处理完后用 writev 一次写出;
+// 写不完时关注 EPOLLOUT, 等可写再继续。
+struct client {
+    int fd;
+    int id;
+    int dead;                   // 已决定断开, 本批事件处理完后统一移除
+    int dirty;                  // 已在 dirty_fds 中, 等待本批结束时发送
+    int want_write;             // 套接字写满, 已在 epoll 中关注 EPOLLOUT
+    struct sockaddr_in addr;
+    struct chat_decoder dec;
+    struct message *queue[QUEUE_SLOTS];
+    unsigned q_head;
+    unsigned q_count;
+    size_t head_off;            // 队首消息已发送的字节数
+    size_t queued_bytes;        // 队列中尚未发送的字节数
+    long dropped;               // 本次积压期间丢弃的消息数, 恢复后合并成一条通知
+    time_t lag_since;           // 本次积压期间第一次丢弃消息的时间
+};
+
+// 各种处理动作的计数, 收到 SIGUSR1 或退出时打印
+struct chat_stats {
+    unsigned long msgs_in;          // 收到并广播的消息
+    unsigned long deliveries;       // 放入发送队列的消息 (每个接收者算一次)
+    unsigned long bytes_out;
+    unsigned long writev_calls;
+    unsigned long dropped;          // 因接收者积压超过高水位而丢弃的消息
+    unsigned long drop_notices;     // 积压恢复后发出的合并丢弃通知
+    unsigned long slow_disconnects; // 积压持续超过宽限时间而被断开的客户端
+    unsigned long history_bytes;    // 写入历史日志的字节数
+    unsigned long history_writes;   // 历史日志的 write 调用次数 (组提交后远少于消息数)
+    unsigned long replays;          // 给新客户端回放历史的次数
+};
+
+// 紧凑的连接表: clients[0..num_clients) 连续存放, 广播时顺序扫描;
+// fd_slot 把描述符映射到表中的位置, 删除时用最后一个元素填补空位
+struct client *clients = NULL;
+int num_clients = 0;
+int max_clients = 0;
+int *fd_slot = NULL;
+int fd_limit = 0;
+int epoll_fd = -1;
+int next_id = 1;
+int num_dead = 0;
+// 本批事件中有新消息入队的客户端, 批末统一发送, 让同一批的多条消息合并到一次 writev
+int *dirty_fds = NULL;
+int num_dirty = 0;
+size_t high_water = (size_t)DEFAULT_HIGH_WATER_KB << 10;
+int slow_grace = DEFAULT_SLOW_GRACE;
+time_t now_sec;
+struct chat_stats stats;
+
+// 历史日志。事件循环只做 write (进页缓存, 很快), fdatasync 交给同步线程定期做,
+// 写日志不会给消息转发增加延迟
+const char *history_dir = NULL;
+int replay_count = DEFAULT_REPLAY;
+size_t segment_size = (size_t)DEFAULT_SEGMENT_KB << 10;
+struct history_segment *history_cur = NULL;
+struct history_segment *history_prev = NULL;
+int history_fd = -1;
+char history_batch[HISTORY_BATCH];
+size_t history_batch_len = 0;
+unsigned long history_batch_msgs = 0;
+// 与同步线程共享的状态, 由 sync_lock 保护
+pthread_t sync_thread;
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t retired_cond = PTHREAD_COND_INITIALIZER; // 同步线程取走 sync_retired 时通知
+int sync_fd = -1;                   // 当前段, 有新写入时需要同步
+int sync_dirty = 0;
+int sync_retired[HISTORY_RETIRED_MAX]; // 轮换下来的旧段, 同步后由同步线程关闭
+int num_sync_retired = 0;
+int sync_stop = 0;
+unsigned long history_syncs = 0;
+
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t stats_requested = 0;
 
 void handle_shutdown(int sig) {
-    if (child_pid > 0) {
-        kill(child_pid, SIGKILL);
+    stop_requested = 1;
+}
+
+void handle_stats(int sig) {
+    stats_requested = 1;
+}
+
+void error_die(const char *msg) { perror(msg); exit(1); }
+int set_nonblocking(int fd);
+void raise_fd_limit(void);
+int create_listen_socket(int port);
+void accept_clients(int listen_fd);
+void client_read(struct client *c);
+void handle_frame(struct client *c, const struct chat_frame *f);
+struct message *message_new(size_t len);
+void message_unref(struct message *m);
+void client_enqueue(struct client *c, struct message *m);
+void client_send(struct client *c, int type, const char *payload, size_t len);
+void client_flush(struct client *c);
+void flush_dirty(void);
+void broadcast(struct message *m, const struct client *except);
+void broadcast_text(uint32_t sender, const char *text, size_t len, const struct client *except);
+void client_kill(struct client *c);
+void reap_dead(void);
+void read_stdin(void);
+void print_stats(void);
+void history_open(void);
+struct history_segment *segment_open(unsigned long id, int writable, int *fd_out);
+void segment_unref(struct history_segment *seg);
+size_t segment_offset(const struct history_segment *seg, unsigned long seq);
+void history_append(const char *frame, size_t len);
+void history_flush(void);
+void history_rotate(void);
+void history_replay(struct client *c);
+void history_close(void);
+void *history_sync_loop(void *arg);
+
+void usage(const char *prog) {
+    fprintf(stderr, "用法: %s [-w KB] [-g 秒] [-H 目录 [-n 条数] [-S KB]] <端口号>\n", prog);
+    fprintf(stderr, "  -w  每个客户端发送队列的高水位, 超过后发给它的新消息被丢弃, 默认 %d KB\n",
+            DEFAULT_HIGH_WATER_KB);
+    fprintf(stderr, "  -g  积压持续超过高水位多久后断开该客户端, 默认 %d 秒\n", DEFAULT_SLOW_GRACE);
+    fprintf(stderr, "  -H  把聊天消息追加到该目录下的历史日志, 新客户端连入时回放最近的消息\n");
+    fprintf(stderr, "  -n  新客户端连入时回放的消息条数, 默认 %d\n", DEFAULT_REPLAY);
+    fprintf(stderr, "  -S  历史日志每个段文件的大小上限, 超过后换新段, 默认 %d KB\n", DEFAULT_SEGMENT_KB);
+    fprintf(stderr, "  运行中收到 SIGUSR1 时打印转发统计\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "w:g:H:n:S:")) != -1) {
+        switch (opt_ch) {
+            case 'w':
+                if (atoi(optarg) <= 0) usage(argv[0]);
+                high_water = (size_t)atoi(optarg) << 10;
+                break;
+            case 'g':
+                slow_grace = atoi(optarg);
+                if (slow_grace < 0) usage(argv[0]);
+                break;
+            case 'H':
+                history_dir = optarg;
+                break;
+            case 'n':
+                replay_count = atoi(optarg);
+                if (replay_count < 0) usage(argv[0]);
+                break;
+            case 'S':
+                if (atoi(optarg) <= 0) usage(argv[0]);
+                segment_size = (size_t)atoi(optarg) << 10;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    int port = atoi(argv[optind]);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_shutdown;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_stats;
+    sigaction(SIGUSR1, &sa, NULL);
+    // 对端已关闭时 send 返回 EPIPE, 不应杀死整个服务器
+    signal(SIGPIPE, SIG_IGN);
+
+    raise_fd_limit();
+    fd_slot = malloc(sizeof(int) * fd_limit);
+    dirty_fds = malloc(sizeof(int) * fd_limit);
+    if (!fd_slot || !dirty_fds) error_die("malloc 失败");
+    for (int i = 0; i < fd_limit; i++) fd_slot[i] = -1;
+
+    if (history_dir) history_open();
+    int listen_fd = create_listen_socket(port);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) error_die("epoll_create1 失败");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) error_die("epoll_ctl 失败");
+    // 服务器端输入的内容也广播给所有客户端; 标准输入是普通文件或 /dev/null 时 epoll 不支持, 忽略即可
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+
+    printf("服务器已启动，正在监听端口 %d...\n", port);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) error_die("epoll_wait 失败");
+            n = 0;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now_sec = ts.tv_sec;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_clients(listen_fd);
+                continue;
+            }
+            if (fd == STDIN_FILENO) {
+                read_stdin();
+                continue;
+            }
+            if (fd_slot[fd] < 0) continue;
+            struct client *c = &clients[fd_slot[fd]];
+            if (c->dead) continue;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                client_kill(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) client_flush(c);
+            if ((events[i].events & EPOLLIN) && !c->dead) client_read(c);
+        }
+        history_flush();
+        flush_dirty();
+        reap_dead();
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
     }
+
     printf("\n服务器正在关闭...\n");
-    exit(0);
+    // 尽量通知每个客户端服务器要关闭了, 积压着发不出去的就算了
+    struct message *bye = message_new(CHAT_HEADER_SIZE);
+    chat_encode(bye->data, CHAT_EXIT, 0, NULL, 0);
+    broadcast(bye, NULL);
+    flush_dirty();
+    history_close();
+    print_stats();
+    for (int i = 0; i < num_clients; i++) close(clients[i].fd);
+    close(listen_fd);
+    return 0;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "用法: %s <端口号>\n", argv[0]);
-        exit(1);
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 每个客户端占一个描述符, 把软上限提到硬上限, 连接表的索引数组也按它分配
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+    getrlimit(RLIMIT_NOFILE, &rl);
+    fd_limit = rl.rlim_cur > 1 << 20 ? 1 << 20 : rl.rlim_cur;
+}
 
-    int port = atoi(argv[1]);
-    int listen_fd, conn_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[BUFFER_SIZE];
+int create_listen_socket(int port) {
+    struct sockaddr_in server_addr;
 
     // 1. 创建套接字
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) {
-        perror("socket 创建失败");
-        exit(1);
-    }
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) error_die("socket 创建失败");
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
 
     // 2. 绑定地址和端口
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) error_die("bind 失败");
 
-    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind 失败");
-        exit(1);
-    }
+    // 3. 监听端口; 大量客户端同时连入时, 过小的 backlog 会让连接在握手阶段被丢弃
+    if (listen(listen_fd, SOMAXCONN) < 0) error_die("listen 失败");
+    if (set_nonblocking(listen_fd) < 0) error_die("fcntl 失败");
+    return listen_fd;
+}
 
-    // 3. 监听端口
-    if (listen(listen_fd, 5) < 0) {
-        perror("listen 失败");
-        exit(1);
+// 4. 接受所有已完成握手的连接, 加入连接表。加入和离开只记在服务器日志里, 只给新客户端
+// 发一条欢迎消息: 向所有人广播上下线通知的流量随人数平方增长, 几千人同时连入时会把所有人的积压撑爆
+void accept_clients(int listen_fd) {
+    while (1) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int fd = accept4(listen_fd, (struct sockaddr *)&addr, &len, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept 失败");
+            return;
+        }
+        if (fd >= fd_limit) {
+            close(fd);
+            continue;
+        }
+        // 发送已经按批合并成 writev, 再让 Nagle 等对方的 ACK 只会平添几十毫秒的延迟
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        if (num_clients == max_clients) {
+            int cap = max_clients ? max_clients * 2 : 64;
+            struct client *p = realloc(clients, sizeof(*clients) * cap);
+            if (!p) {
+                close(fd);
+                continue;
+            }
+            clients = p;
+            max_clients = cap;
+        }
+        struct client *c = &clients[num_clients];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->id = next_id++;
+        c->addr = addr;
+        chat_decoder_init(&c->dec);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            continue;
+        }
+        fd_slot[fd] = num_clients++;
+        history_replay(c);
+
+        printf("客户端 %d (%s:%d) 加入，当前在线 %d 人\n", c->id,
+               inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), num_clients);
+        char msg[96];
+        int n = snprintf(msg, sizeof(msg), "你是客户端 %d，当前在线 %d 人", c->id, num_clients);
+        client_send(c, CHAT_TEXT, msg, n);
     }
+}
 
-    printf("服务器已启动，正在监听端口 %d...\n", port);
+// 读出所有可读数据, 数据直接读进解码缓冲区, 每解出一个完整的帧就处理一个
+void client_read(struct client *c) {
+    while (!c->dead) {
+        size_t avail;
+        char *space = chat_decoder_space(&c->dec, &avail);
+        ssize_t n = recv(c->fd, space, avail, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) client_kill(c);
+            return;
+        }
+        if (n == 0) {
+            client_kill(c);
+            return;
+        }
+        chat_decoder_commit(&c->dec, n);
 
-    // 4. 接受客户端连接
-    conn_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len);
-    if (conn_fd < 0) {
-        perror("accept 失败");
-        exit(1);
+        struct chat_frame f;
+        int r = 0;
+        while (!c->dead && (r = chat_decoder_next(&c->dec, &f)) > 0) handle_frame(c, &f);
+        if (r < 0) {
+            printf("客户端 %d 发来无法解析的帧，断开\n", c->id);
+            client_kill(c);
+            return;
+        }
     }
-    close(listen_fd); // 关闭监听套接字，只处理一个客户端
-    printf("客户端 %s:%d 已连接。\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+}
 
-    // 设置信号处理，用于父进程退出
-    signal(SIGINT, handle_shutdown); 
+void handle_frame(struct client *c, const struct chat_frame *f) {
+    switch (f->type) {
+        case CHAT_TEXT:
+            broadcast_text(c->id, f->payload, f->len, c);
+            break;
+        case CHAT_EXIT:
+            // 客户端主动离开, 服务器只断开这一个连接
+            client_kill(c);
+            break;
+        case CHAT_PING:
+            client_send(c, CHAT_PONG, f->payload, f->len);
+            break;
+        default:
+            break;
+    }
+}
 
-    child_pid = fork();
+struct message *message_new(size_t len) {
+    struct message *m = malloc(sizeof(*m) + len);
+    if (!m) error_die("malloc 失败");
+    m->refs = 0;
+    m->len = len;
+    m->data = m->buf;
+    m->seg = NULL;
+    return m;
+}
 
-    if (child_pid < 0) {
-        perror("fork 失败");
-        exit(1);
+void message_unref(struct message *m) {
+    if (--m->refs > 0) return;
+    if (m->seg) segment_unref(m->seg);
+    free(m);
+}
+
+// 把消息放进客户端的发送队列, 本批事件结束时统一发送。
+// 队列满了但套接字还能写时先发一次; 仍然超过高水位 (或队列已满) 说明对方确实读得慢,
+// 丢弃这条消息, 只记个数, 等积压恢复后合并成一条通知;
+// 积压持续超过宽限时间的客户端被断开, 一个读得慢的客户端不会让服务器无限缓冲
+void client_enqueue(struct client *c, struct message *m) {
+    if (c->dead) return;
+    if ((c->queued_bytes + m->len > high_water || c->q_count == QUEUE_SLOTS) && !c->want_write) {
+        client_flush(c);
+        if (c->dead) return;
     }
+    if (c->queued_bytes + m->len > high_water || c->q_count == QUEUE_SLOTS) {
+        stats.dropped++;
+        if (c->dropped++ == 0) {
+            c->lag_since = now_sec;
+        } else if (now_sec - c->lag_since >= slow_grace) {
+            stats.slow_disconnects++;
+            printf("客户端 %d 接收过慢，已丢弃 %ld 条消息，断开\n", c->id, c->dropped);
+            client_kill(c);
+        }
+        return;
+    }
+    m->refs++;
+    c->queue[(c->q_head + c->q_count) % QUEUE_SLOTS] = m;
+    c->q_count++;
+    c->queued_bytes += m->len;
+    stats.deliveries++;
+    if (!c->dirty && !c->want_write) {
+        c->dirty = 1;
+        dirty_fds[num_dirty++] = c->fd;
+    }
+}
+
+// 服务器只发给一个客户端的帧 (欢迎、丢弃通知、心跳回复等)
+void client_send(struct client *c, int type, const char *payload, size_t len) {
+    struct message *m = message_new(CHAT_HEADER_SIZE + len);
+    chat_encode(m->data, type, 0, payload, len);
+    client_enqueue(c, m);
+    if (m->refs == 0) free(m);
+}
 
-    if (child_pid == 0) { // 子进程: 从标准输入读取并发送
-        while (1) {
-            fgets(buffer, BUFFER_SIZE, stdin);
-            send(conn_fd, buffer, strlen(buffer), 0);
-            if (strncmp(buffer, "exit", 4) == 0) {
-                // 如果服务器端输入exit，也通知客户端并关闭
-                kill(getppid(), SIGINT); // 通知父进程关闭
+// 用 writev 把队列中的消息尽量一次写出。写满时关注 EPOLLOUT 等可写再继续,
+// 队列清空后不再关注, 避免水平触发下空转
+void client_flush(struct client *c) {
+    while (c->q_count > 0) {
+        struct iovec iov[FLUSH_IOV];
+        int n = 0;
+        while (n < FLUSH_IOV && (unsigned)n < c->q_count) {
+            struct message *m = c->queue[(c->q_head + n) % QUEUE_SLOTS];
+            size_t off = n == 0 ? c->head_off : 0;
+            iov[n].iov_base = m->data + off;
+            iov[n].iov_len = m->len - off;
+            n++;
+        }
+        ssize_t written = writev(c->fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                client_kill(c);
+                return;
+            }
+            if (!c->want_write) {
+                struct epoll_event ev;
+                ev.events = EPOLLIN | EPOLLOUT;
+                ev.data.fd = c->fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->want_write = 1;
+            }
+            return;
+        }
+        stats.writev_calls++;
+        stats.bytes_out += written;
+        c->queued_bytes -= written;
+        size_t left = written;
+        while (left > 0) {
+            struct message *m = c->queue[c->q_head];
+            size_t rest = m->len - c->head_off;
+            if (left < rest) {
+                c->head_off += left;
                 break;
             }
+            left -= rest;
+            c->head_off = 0;
+            c->q_head = (c->q_head + 1) % QUEUE_SLOTS;
+            c->q_count--;
+            message_unref(m);
         }
-    } else { // 父进程: 接收并显示消息
-        ssize_t n;
-        while ((n = recv(conn_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-            buffer[n] = '\0';
-            printf("客户端: %s", buffer);
+        // 积压降到高水位 (和队列容量) 的一半以下才视为恢复, 只是偶尔腾出一点空间不算;
+        // 恢复后把这段时间丢弃的消息合并成一条通知
+        if (c->dropped > 0 && c->queued_bytes <= high_water / 2 && c->q_count <= QUEUE_SLOTS / 2) {
+            char msg[96];
+            int len = snprintf(msg, sizeof(msg), "接收过慢，丢弃了 %ld 条消息", c->dropped);
+            c->dropped = 0;
+            stats.drop_notices++;
+            client_send(c, CHAT_TEXT, msg, len);
+        }
+    }
+    if (c->want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = c->fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = 0;
+    }
+}
 
-            // 服务器如果收到客户方的exit文本，则退出服务器程序
-            if (strncmp(buffer, "exit", 4) == 0) {
-                printf("收到客户端的退出指令，服务器关闭。\n");
-                kill(child_pid, SIGKILL); // 结束子进程
-                break;
+// 发送本批事件中有新消息入队的客户端; 已在等 EPOLLOUT 的不在这里发
+void flush_dirty(void) {
+    for (int i = 0; i < num_dirty; i++) {
+        int fd = dirty_fds[i];
+        if (fd_slot[fd] < 0) continue;
+        struct client *c = &clients[fd_slot[fd]];
+        if (!c->dead && !c->want_write) client_flush(c);
+        c->dirty = 0;
+    }
+    num_dirty = 0;
+}
+
+// 消息只存一份, 每个接收者的队列各持有一个引用; 没有任何人收下时直接释放
+void broadcast(struct message *m, const struct client *except) {
+    for (int i = 0; i < num_clients; i++) {
+        if (&clients[i] != except) client_enqueue(&clients[i], m);
+    }
+    if (m->refs == 0) free(m);
+}
+
+void broadcast_text(uint32_t sender, const char *text, size_t len, const struct client *except) {
+    struct message *m = message_new(CHAT_HEADER_SIZE + len);
+    chat_encode(m->data, CHAT_TEXT, sender, text, len);
+    stats.msgs_in++;
+    if (history_cur) history_append(m->data, m->len);
+    broadcast(m, except);
+}
+
+// 只做标记: 广播过程中连接表不能变动, 真正的移除在 reap_dead 中进行
+void client_kill(struct client *c) {
+    if (c->dead) return;
+    c->dead = 1;
+    num_dead++;
+}
+
+// 移除本批事件中断开的客户端: 用表尾元素填补空位, 保持连接表紧凑
+void reap_dead(void) {
+    if (num_dead == 0) return;
+    for (int i = 0; i < num_clients; ) {
+        struct client *c = &clients[i];
+        if (!c->dead) {
+            i++;
+            continue;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        fd_slot[c->fd] = -1;
+        while (c->q_count > 0) {
+            message_unref(c->queue[c->q_head]);
+            c->q_head = (c->q_head + 1) % QUEUE_SLOTS;
+            c->q_count--;
+        }
+        printf("客户端 %d 离开，当前在线 %d 人\n", c->id, num_clients - 1);
+        num_dead--;
+        if (i != num_clients - 1) {
+            *c = clients[num_clients - 1];
+            fd_slot[c->fd] = i;
+        }
+        num_clients--;
+    }
+    fflush(stdout);
+}
+
+// 服务器端输入的每一行作为服务器的消息广播给所有客户端, 输入 exit 关闭服务器
+void read_stdin(void) {
+    char buffer[CHAT_MAX_PAYLOAD];
+    ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n <= 0) {
+        // 标准输入已关闭 (例如在后台运行), 不再关注它
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        return;
+    }
+    char *line = buffer, *end = buffer + n;
+    while (line < end) {
+        char *nl = memchr(line, '\n', end - line);
+        size_t len = (nl ? nl : end) - line;
+        if (len > 0 && line[len - 1] == '\r') len--;
+        if (len == 4 && memcmp(line, "exit", 4) == 0) {
+            stop_requested = 1;
+            return;
+        }
+        if (len > 0) broadcast_text(0, line, len, NULL);
+        line += (nl ? nl + 1 : end) - line;
+    }
+}
+
+void print_stats(void) {
+    printf("统计: 在线 %d, 收到消息 %lu, 入队 %lu, 发送 %lu 字节 / %lu 次 writev, "
+           "丢弃 %lu, 丢弃通知 %lu, 因过慢断开 %lu\n",
+           num_clients, stats.msgs_in, stats.deliveries, stats.bytes_out, stats.writev_calls,
+           stats.dropped, stats.drop_notices, stats.slow_disconnects);
+    if (history_cur) {
+        pthread_mutex_lock(&sync_lock);
+        unsigned long syncs = history_syncs;
+        pthread_mutex_unlock(&sync_lock);
+        printf("历史日志: 当前段 %lu, 写入 %lu 字节 / %lu 次 write, fdatasync %lu 次, 回放 %lu 次\n",
+               history_cur->id, stats.history_bytes, stats.history_writes, syncs, stats.replays);
+    }
+    fflush(stdout);
+}
+
+// 打开历史日志目录: 最新的段继续追加, 它前面的一段只读映射, 供回放时往前补足; 再启动同步线程
+void history_open(void) {
+    if (mkdir(history_dir, 0755) < 0 && errno != EEXIST) error_die("创建历史日志目录失败");
+    DIR *dir = opendir(history_dir);
+    if (!dir) error_die("打开历史日志目录失败");
+    unsigned long last = 0, before_last = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        unsigned long id;
+        char tail;
+        if (sscanf(de->d_name, "chat-%lu.lo%c", &id, &tail) != 2 || tail != 'g') continue;
+        if (id > last) {
+            before_last = last;
+            last = id;
+        } else if (id > before_last) {
+            before_last = id;
+        }
+    }
+    closedir(dir);
+
+    if (last == 0) last = 1;
+    history_cur = segment_open(last, 1, &history_fd);
+    if (before_last > 0) history_prev = segment_open(before_last, 0, NULL);
+    sync_fd = history_fd;
+    if (pthread_create(&sync_thread, NULL, history_sync_loop, NULL) != 0) error_die("创建同步线程失败");
+    printf("历史日志: %s/chat-%lu.log, 已有 %lu 条消息\n", history_dir, history_cur->id, history_cur->count);
+}
+
+// 映射一个段并扫描其中的帧, 建立稀疏索引。当前段以追加方式打开; 上次崩溃时写了一半的帧
+// 从文件尾截掉, 否则新追加的帧会和它错位。映射按段大小上限预留, 之后追加的内容不必重新映射
+struct history_segment *segment_open(unsigned long id, int writable, int *fd_out) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/chat-%lu.log", history_dir, id);
+    int fd = open(path, writable ? O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0644);
+    if (fd < 0) error_die("打开历史日志失败");
+    struct stat st;
+    if (fstat(fd, &st) < 0) error_die("fstat 失败");
+
+    struct history_segment *seg = calloc(1, sizeof(*seg));
+    if (!seg) error_die("calloc 失败");
+    seg->refs = 1;
+    seg->id = id;
+    seg->map_size = (size_t)st.st_size > segment_size ? (size_t)st.st_size : segment_size;
+    seg->map = mmap(NULL, seg->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (seg->map == MAP_FAILED) error_die("mmap 历史日志失败");
+
+    size_t off = 0;
+    while (off + CHAT_HEADER_SIZE <= (size_t)st.st_size) {
+        const unsigned char *p = (const unsigned char *)seg->map + off;
+        size_t size = chat_frame_size(seg->map + off);
+        if (p[2] < CHAT_TEXT || p[2] > CHAT_PONG || off + size > (size_t)st.st_size) break;
+        if (seg->count % HISTORY_INDEX_EVERY == 0) {
+            if (seg->index_len == seg->index_cap) {
+                seg->index_cap = seg->index_cap ? seg->index_cap * 2 : 64;
+                seg->index = realloc(seg->index, sizeof(size_t) * seg->index_cap);
+                if (!seg->index) error_die("realloc 失败");
             }
+            seg->index[seg->index_len++] = off;
         }
-        if (n == 0) {
-            printf("客户端已断开连接。\n");
-            kill(child_pid, SIGKILL);
+        off += size;
+        seg->count++;
+    }
+    seg->len = off;
+    if (off < (size_t)st.st_size) {
+        fprintf(stderr, "%s: 末尾 %zu 字节不是完整的帧, 已%s\n", path, (size_t)st.st_size - off,
+                writable ? "截掉" : "忽略");
+        if (writable && ftruncate(fd, off) < 0) error_die("ftruncate 失败");
+    }
+    if (fd_out) *fd_out = fd;
+    else close(fd);
+    return seg;
+}
+
+void segment_unref(struct history_segment *seg) {
+    if (--seg->refs > 0) return;
+    munmap(seg->map, seg->map_size);
+    free(seg->index);
+    free(seg);
+}
+
+// 第 seq 条消息在段内的偏移: 先查稀疏索引, 再沿帧头往后跳不到 HISTORY_INDEX_EVERY 步
+size_t segment_offset(const struct history_segment *seg, unsigned long seq) {
+    size_t off = seg->index[seq / HISTORY_INDEX_EVERY];
+    for (unsigned long i = seq / HISTORY_INDEX_EVERY * HISTORY_INDEX_EVERY; i < seq; i++) {
+        off += chat_frame_size(seg->map + off);
+    }
+    return off;
+}
+
+// 把一个帧追加到组提交缓冲区。索引按帧将来在文件中的位置登记, 写出之前不会被用到:
+// 回放之前总会先 history_flush
+void history_append(const char *frame, size_t len) {
+    struct history_segment *seg = history_cur;
+    if (seg->len + history_batch_len + len > segment_size && seg->len + history_batch_len > 0) {
+        history_flush();
+        history_rotate();
+        seg = history_cur;
+    }
+    if (history_batch_len + len > sizeof(history_batch)) history_flush();
+
+    unsigned long seq = seg->count + history_batch_msgs;
+    if (seq % HISTORY_INDEX_EVERY == 0) {
+        if (seg->index_len == seg->index_cap) {
+            seg->index_cap = seg->index_cap ? seg->index_cap * 2 : 64;
+            seg->index = realloc(seg->index, sizeof(size_t) * seg->index_cap);
+            if (!seg->index) error_die("realloc 失败");
         }
-        wait(NULL); // 等待子进程结束
+        seg->index[seg->index_len++] = seg->len + history_batch_len;
     }
+    memcpy(history_batch + history_batch_len, frame, len);
+    history_batch_len += len;
+    history_batch_msgs++;
+}
 
-    close(conn_fd);
-    return 0;
-}
\ No newline at end of file
+// 组提交: 本批事件中的所有消息一次 write 写进当前段, 标记同步线程下次需要 fdatasync
+void history_flush(void) {
+    if (history_batch_len == 0) return;
+    size_t done = 0;
+    while (done < history_batch_len) {
+        ssize_t n = write(history_fd, history_batch + done, history_batch_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // 磁盘写满等错误不应中断聊天: 丢掉这一批, 已建的索引项随之作废。
+            // 已经写进去的半批要截掉, 否则段里留下残缺的帧, 后面追加的消息也跟着错位
+            perror("写历史日志失败");
+            if (done > 0 && ftruncate(history_fd, history_cur->len) < 0) perror("截断历史日志失败");
+            while (history_cur->index_len > 0 &&
+                   history_cur->index[history_cur->index_len - 1] >= history_cur->len) {
+                history_cur->index_len--;
+            }
+            history_batch_len = history_batch_msgs = 0;
+            return;
+        }
+        done += n;
+        stats.history_writes++;
+    }
+    history_cur->len += history_batch_len;
+    history_cur->count += history_batch_msgs;
+    stats.history_bytes += history_batch_len;
+    history_batch_len = history_batch_msgs = 0;
+
+    pthread_mutex_lock(&sync_lock);
+    sync_dirty = 1;
+    pthread_mutex_unlock(&sync_lock);
+}
+
+// 当前段写满, 换一个新段。旧段的描述符交给同步线程, 同步完由它关闭;
+// 旧段仍保持映射, 成为回放时往前补足用的上一段。
+// 旧段的描述符只能由同步线程关闭: 它可能正拿着这个描述符的副本 (sync_fd) 在锁外同步,
+// 这里关掉的话编号会被下一个 segment_open 复用, 它同步的就成了别的文件
+void history_rotate(void) {
+    int fd;
+    struct history_segment *seg = segment_open(history_cur->id + 1, 1, &fd);
+    int old_fd = history_fd;
+
+    pthread_mutex_lock(&sync_lock);
+    // 同步线程积压了太多旧段 (磁盘极慢): 等它取走一批, 这也给写入加上了背压
+    while (num_sync_retired == HISTORY_RETIRED_MAX) {
+        pthread_cond_signal(&sync_cond);
+        pthread_cond_wait(&retired_cond, &sync_lock);
+    }
+    sync_retired[num_sync_retired++] = old_fd;
+    sync_fd = fd;
+    sync_dirty = 0;
+    pthread_cond_signal(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+
+    if (history_prev) segment_unref(history_prev);
+    history_prev = history_cur;
+    history_cur = seg;
+    history_fd = fd;
+}
+
+// 回放最近 replay_count 条消息: 先从当前段往前取, 不够再用上一段补。每个段中要回放的帧
+// 在映射中是连续的一段, 直接作为一条消息放进发送队列。回放总量不超过高水位,
+// 否则新客户端一连上就会被当成读得慢的客户端
+void history_replay(struct client *c) {
+    if (!history_cur || replay_count == 0) return;
+    history_flush();
+    struct history_segment *segs[2] = { history_prev, history_cur };
+    size_t start[2] = { 0, 0 }, end[2] = { 0, 0 };
+    unsigned long want = replay_count;
+    size_t budget = high_water;
+    for (int i = 1; i >= 0 && want > 0; i--) {
+        struct history_segment *seg = segs[i];
+        if (!seg || seg->count == 0) continue;
+        unsigned long take = want < seg->count ? want : seg->count;
+        size_t off = segment_offset(seg, seg->count - take);
+        want -= take;
+        if (seg->len - off > budget) {
+            while (seg->len - off > budget) off += chat_frame_size(seg->map + off);
+            want = 0;
+        }
+        start[i] = off;
+        end[i] = seg->len;
+        budget -= seg->len - off;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (end[i] <= start[i]) continue;
+        struct message *m = malloc(sizeof(*m));
+        if (!m) error_die("malloc 失败");
+        m->refs = 0;
+        m->len = end[i] - start[i];
+        m->data = segs[i]->map + start[i];
+        m->seg = segs[i];
+        segs[i]->refs++;
+        client_enqueue(c, m);
+        if (m->refs == 0) {
+            segment_unref(m->seg);
+            free(m);
+        }
+    }
+    stats.replays++;
+}
+
+// 关闭前写出剩余的消息, 让同步线程做最后一次 fdatasync 后退出
+void history_close(void) {
+    if (!history_cur) return;
+    history_flush();
+    pthread_mutex_lock(&sync_lock);
+    sync_stop = 1;
+    pthread_cond_signal(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+    pthread_join(sync_thread, NULL);
+    close(history_fd);
+}
+
+// 同步线程: 每隔 HISTORY_SYNC_MS 对有新写入的当前段做一次 fdatasync, 并同步、关闭轮换下来的旧段。
+// fdatasync 可能耗时几十毫秒, 放在事件循环之外做
+void *history_sync_loop(void *arg) {
+    pthread_mutex_lock(&sync_lock);
+    while (1) {
+        if (!sync_stop && num_sync_retired == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += HISTORY_SYNC_MS / 1000;
+            deadline.tv_nsec += (long)(HISTORY_SYNC_MS % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&sync_cond, &sync_lock, &deadline);
+        }
+        int fd = sync_dirty ? sync_fd : -1;
+        int retired[HISTORY_RETIRED_MAX];
+        int num_retired = num_sync_retired;
+        memcpy(retired, sync_retired, sizeof(int) * num_retired);
+        num_sync_retired = 0;
+        pthread_cond_signal(&retired_cond);
+        sync_dirty = 0;
+        int stop = sync_stop;
+        pthread_mutex_unlock(&sync_lock);
+
+        int synced = 0;
+        for (int i = 0; i < num_retired; i++) {
+            fdatasync(retired[i]);
+            close(retired[i]);
+            synced++;
+        }
+        if (fd >= 0) {
+            fdatasync(fd);
+            synced++;
+        }
+
+        pthread_mutex_lock(&sync_lock);
+        history_syncs += synced;
+        if (stop) break;
+    }
+    pthread_mutex_unlock(&sync_lock);
+    return NULL;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <strings.h>
+#include <time.h>
+#include <stdint.h>
+
+#define BUFFER_SIZE 65536
+#define MAX_URLS 64
+#define MAX_EVENTS 1024
+#define DEFAULT_CONNS 32
+#define DEFAULT_DURATION 10
+#define DEFAULT_SEED 1
+
+// 配合 server.c 使用的压测工具: 单进程 epoll 驱动 N 个并发连接, 每个连接同一时刻只有一个
+// 请求在途 (闭环), 按种子决定的顺序从 URL 列表中挑选请求目标。
+// 结束后以 JSON 输出请求速率、吞吐量和延迟分位数, 便于在不同服务模式之间对比。
+
+// 客户端连接状态: 正在建立连接 -> 发送请求 -> 读取响应头 -> 读取正文
+enum client_state { CL_CONNECTING, CL_SEND, CL_READ_HEADER, CL_READ_BODY };
+
+struct client {
+    int fd;
+    enum client_state state;
+    unsigned int rng;           // 每个连接一个独立的随机数状态, 种子相同时请求序列相同
+    char req[512];
+    size_t req_len, req_off;
+    char hdr[4096];             // 响应头, 正文不保存
+    size_t hdr_len;
+    long long body_left;        // -1 表示没有 Content-Length, 读到对端关闭为止
+    int server_close;           // 响应带 Connection: close
+    uint64_t start_ns;
+};
+
+// 延迟直方图: 按 1 微秒到约 1 小时分成对数-线性桶, 每 2 的幂分 64 档, 相对误差 < 1.6%
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (32 * HIST_SUB)
+
+struct stats {
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long connects;
+    unsigned long long issued;      // 已经发出 (或正在发出) 的请求数
+    unsigned long long status[6];   // 按状态码首位 1xx..5xx 计数, [0] 为其他
+    unsigned long long hist[HIST_BUCKETS];
+    uint64_t max_us;
+};
+
+struct sockaddr_in server_addr;
+const char *host = "127.0.0.1";
+char *urls[MAX_URLS];
+int num_urls = 0;
+int keep_alive = 1;
+unsigned int seed = DEFAULT_SEED;
+unsigned long long max_requests = 0;    // 非 0 时完成这么多请求后结束
+int epfd;
+struct stats st;
+int live_conns = 0;             // 当前持有套接字 (正在建立或已建立) 的连接位置数
+double live_conn_ns = 0;        // live_conns 对时间的积分, 除以总时长得到实际的平均并发数
+volatile sig_atomic_t stop_requested = 0;
+
+void error_die(const char *msg) { perror(msg); exit(1); }
+void client_start(struct client *c);
+void client_close(struct client *c, int failed);
+
+void stop_handler(int sig) {
+    stop_requested = 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "用法: %s [-c 连接数] [-d 秒] [-n 请求数] [-s 种子] [-K] [-h 地址] <端口号> [URL...]\n", prog);
+    fprintf(stderr, "  -c  并发连接数, 默认 %d\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -d  压测时长, 默认 %d 秒\n", DEFAULT_DURATION);
+    fprintf(stderr, "  -n  完成指定数量的请求后提前结束\n");
+    fprintf(stderr, "  -s  随机数种子, 决定各连接挑选 URL 的顺序, 默认 %d\n", DEFAULT_SEED);
+    fprintf(stderr, "  -K  关闭长连接, 每个请求新建一个连接\n");
+    fprintf(stderr, "  -h  服务器地址, 默认 127.0.0.1\n");
+    fprintf(stderr, "  URL 为请求路径, 可给多个, 默认 /\n");
+    exit(1);
+}
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// 延迟 (微秒) 到直方图桶的映射: 小于 HIST_SUB 的值每个一桶, 更大的值按最高位分组后取次高的 6 位
+int hist_bucket(uint64_t us) {
+    if (us < HIST_SUB) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 桶的上界, 报告分位数时取上界, 保证不低估
+uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB) return idx;
+    int group = idx / HIST_SUB - 1;
+    uint64_t sub = idx % HIST_SUB;
+    return ((HIST_SUB + sub + 1) << group) - 1;
+}
+
+uint64_t hist_percentile(double p) {
+    if (st.requests == 0) return 0;
+    unsigned long long want = (unsigned long long)(p * st.requests + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += st.hist[i];
+        if (seen >= want) return hist_value(i) < st.max_us ? hist_value(i) : st.max_us;
+    }
+    return st.max_us;
+}
+
+// 指定了 -n 时, 发出的请求数到达上限后不再发新请求, 保证结果中恰好有这么多请求
+int limit_reached(void) {
+    return max_requests && st.issued >= max_requests;
+}
+
+// 构造下一个请求; URL 由连接自己的随机数序列决定
+void client_prepare(struct client *c) {
+    st.issued++;
+    const char *url = urls[rand_r(&c->rng) % num_urls];
+    int n = snprintf(c->req, sizeof(c->req), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                     url, host, keep_alive ? "" : "Connection: close\r\n");
+    c->req_len = n < (int)sizeof(c->req) ? (size_t)n : sizeof(c->req) - 1;
+    c->req_off = 0;
+    c->hdr_len = 0;
+    c->body_left = -1;
+    c->server_close = !keep_alive;
+    c->state = CL_SEND;
+    c->start_ns = now_ns();
+}
+
+void client_start(struct client *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) error_die("socket 创建失败");
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    st.connects++;
+    client_prepare(c);
+    if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            // 回环上 ECONNREFUSED 往往同步返回, 这个位置没有注册到 epoll, 由主循环重试
+            st.errors++;
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        c->state = CL_CONNECTING;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) error_die("epoll_ctl 失败");
+    live_conns++;
+}
+
+// 关闭连接; failed 表示当前请求没有得到完整响应, 记为错误
+void client_close(struct client *c, int failed) {
+    if (failed) st.errors++;
+    close(c->fd);
+    c->fd = -1;
+    live_conns--;
+}
+
+// 一个完整响应已到达, 记录延迟, 决定复用连接还是重新建立
+void client_complete(struct client *c) {
+    uint64_t us = (now_ns() - c->start_ns) / 1000;
+    st.requests++;
+    st.hist[hist_bucket(us)]++;
+    if (us > st.max_us) st.max_us = us;
+
+    int code = 0;
+    if (sscanf(c->hdr, "HTTP/%*s %d", &code) == 1 && code >= 100 && code < 600) st.status[code / 100]++;
+    else st.status[0]++;
+
+    if (c->server_close || limit_reached()) {
+        client_close(c, 0);
+    } else {
+        client_prepare(c);
+    }
+}
+
+// 在响应头中查找 name 字段 (不区分大小写), 返回值的起始位置
+const char *header_value(const char *hdr, const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = strchr(hdr, '\n'); p; p = strchr(p, '\n')) {
+        p++;
+        if (strncasecmp(p, name, len) == 0 && p[len] == ':') {
+            p += len + 1;
+            while (*p == ' ' || *p == '\t') p++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// 响应头完整后解析 Content-Length 和 Connection, 返回响应头之后多读进来的正文字节数
+long header_done(struct client *c, char *end) {
+    char *body = strstr(c->hdr, "\r\n\r\n") == end ? end + 4 : end + 2;
+    long extra = (long)(c->hdr + c->hdr_len - body);
+    *end = '\0';
+
+    const char *v = header_value(c->hdr, "Content-Length");
+    c->body_left = v ? atoll(v) : -1;
+    v = header_value(c->hdr, "Connection");
+    if (v && strncasecmp(v, "close", 5) == 0) c->server_close = 1;
+    return extra;
+}
+
+// 推进一个连接, 直到套接字暂时不可读写; 连接关闭或失败时直接返回
+void client_drive(struct client *c) {
+    char buf[BUFFER_SIZE];
+    while (c->fd >= 0) {
+        switch (c->state) {
+            case CL_CONNECTING: {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err == EINPROGRESS) return;
+                if (err != 0) {
+                    client_close(c, 1);
+                    return;
+                }
+                c->state = CL_SEND;
+                break;
+            }
+            case CL_SEND: {
+                ssize_t n = send(c->fd, c->req + c->req_off, c->req_len - c->req_off, MSG_NOSIGNAL);
+                if (n < 0 && errno == EAGAIN) return;
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    client_close(c, 1);
+                    return;
+                }
+                c->req_off += n;
+                if (c->req_off == c->req_len) c->state = CL_READ_HEADER;
+                break;
+            }
+            case CL_READ_HEADER: {
+                size_t room = sizeof(c->hdr) - 1 - c->hdr_len;
+                if (room == 0) {
+                    // 响应头过大
+                    client_close(c, 1);
+                    return;
+                }
+                ssize_t n = recv(c->fd, c->hdr + c->hdr_len, room, 0);
+                if (n < 0 && errno == EAGAIN) return;
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    client_close(c, 1);
+                    return;
+                }
+                st.bytes += n;
+                c->hdr_len += n;
+                c->hdr[c->hdr_len] = '\0';
+                char *end = strstr(c->hdr, "\r\n\r\n");
+                if (!end) end = strstr(c->hdr, "\n\n");
+                if (!end) break;
+                long extra = header_done(c, end);
+                // 服务器每次只回应一个请求, 多读进来的字节只能属于当前正文
+                if (c->body_left >= 0) {
+                    c->body_left -= extra;
+                    if (c->body_left <= 0) {
+                        client_complete(c);
+                        break;
+                    }
+                }
+                c->state = CL_READ_BODY;
+                break;
+            }
+            case CL_READ_BODY: {
+                size_t want = sizeof(buf);
+                if (c->body_left >= 0 && (long long)want > c->body_left) want = c->body_left;
+                ssize_t n = recv(c->fd, buf, want, 0);
+                if (n < 0 && errno == EAGAIN) return;
+                if (n < 0 && errno == EINTR) continue;
+                if (n == 0 && c->body_left < 0) {
+                    // 没有 Content-Length 的响应以连接关闭结束
+                    c->server_close = 1;
+                    client_complete(c);
+                    return;
+                }
+                if (n <= 0) {
+                    client_close(c, 1);
+                    return;
+                }
+                st.bytes += n;
+                if (c->body_left >= 0) {
+                    c->body_left -= n;
+                    if (c->body_left == 0) client_complete(c);
+                }
+                break;
+            }
+        }
+    }
+}
+
+void print_json(int conns, double elapsed) {
+    printf("{\n");
+    printf("  \"target\": \"%s:%d\",\n", host, ntohs(server_addr.sin_port));
+    printf("  \"urls\": [");
+    for (int i = 0; i < num_urls; i++) {
+        printf("%s\"", i ? ", " : "");
+        for (const char *p = urls[i]; *p; p++) {
+            if (*p == '"' || *p == '\\') putchar('\\');
+            putchar(*p);
+        }
+        putchar('"');
+    }
+    printf("],\n");
+    printf("  \"connections\": %d,\n", conns);
+    printf("  \"effective_connections\": %.1f,\n", elapsed > 0 ? live_conn_ns / (elapsed * 1e9) : 0.0);
+    printf("  \"keep_alive\": %s,\n", keep_alive ? "true" : "false");
+    printf("  \"seed\": %u,\n", seed);
+    printf("  \"duration_s\": %.3f,\n", elapsed);
+    printf("  \"requests\": %llu,\n", st.requests);
+    printf("  \"errors\": %llu,\n", st.errors);
+    printf("  \"connects\": %llu,\n", st.connects);
+    printf("  \"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu},\n",
+           st.status[1], st.status[2], st.status[3], st.status[4], st.status[5], st.status[0]);
+    printf("  \"requests_per_sec\": %.1f,\n", elapsed > 0 ? st.requests / elapsed : 0.0);
+    printf("  \"bytes\": %llu,\n", st.bytes);
+    printf("  \"throughput_mbps\": %.2f,\n", elapsed > 0 ? st.bytes * 8 / elapsed / 1e6 : 0.0);
+    printf("  \"latency_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}\n",
+           (unsigned long long)hist_percentile(0.50), (unsigned long long)hist_percentile(0.90),
+           (unsigned long long)hist_percentile(0.99), (unsigned long long)hist_percentile(0.999),
+           (unsigned long long)st.max_us);
+    printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+    int conns = DEFAULT_CONNS, duration = DEFAULT_DURATION;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "c:d:n:s:Kh:")) != -1) {
+        switch (opt_ch) {
+            case 'c':
+                conns = atoi(optarg);
+                if (conns <= 0) usage(argv[0]);
+                break;
+            case 'd':
+                duration = atoi(optarg);
+                if (duration <= 0) usage(argv[0]);
+                break;
+            case 'n':
+                max_requests = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'K':
+                keep_alive = 0;
+                break;
+            case 'h':
+                host = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+    int port = atoi(argv[optind++]);
+    for (; optind < argc && num_urls < MAX_URLS; optind++) urls[num_urls++] = argv[optind];
+    if (num_urls == 0) urls[num_urls++] = "/";
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "无效的服务器地址: %s\n", host);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    raise_fd_limit();
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) error_die("epoll_create1 失败");
+
+    struct client *clients = calloc(conns, sizeof(*clients));
+    if (!clients) error_die("calloc 失败");
+    for (int i = 0; i < conns; i++) {
+        // 种子相同则每个连接的 URL 序列相同
+        clients[i].rng = seed * 2654435761u + i;
+        client_start(&clients[i]);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t start = now_ns(), deadline = start + (uint64_t)duration * 1000000000ull;
+    uint64_t last = start;
+    while (!stop_requested) {
+        uint64_t now = now_ns();
+        live_conn_ns += (double)live_conns * (now - last);
+        last = now;
+        if (now >= deadline) break;
+        if (max_requests && st.requests + st.errors >= max_requests) break;
+        int timeout = (int)((deadline - now) / 1000000) + 1;
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout < 100 ? timeout : 100);
+        if (nfds < 0) {
+            if (errno == EINTR) continue;
+            error_die("epoll_wait 失败");
+        }
+        for (int i = 0; i < nfds; i++) {
+            struct client *c = events[i].data.ptr;
+            client_drive(c);
+            // 连接关闭后 (非长连接或出错) 立即补上一个新连接, 保持并发数不变
+            if (c->fd < 0 && !stop_requested && !limit_reached()) client_start(c);
+        }
+        // 建立连接时立即失败的位置不会再有事件, 每轮在这里重试, 否则实际并发数会悄悄低于 -c
+        for (int i = 0; i < conns && !stop_requested && !limit_reached(); i++) {
+            if (clients[i].fd < 0) client_start(&clients[i]);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // 超时结束时仍在途的请求不计入结果
+    for (int i = 0; i < conns; i++) {
+        if (clients[i].fd >= 0) close(clients[i].fd);
+    }
+    free(clients);
+    close(epfd);
+
+    print_json(conns, elapsed);
+    return st.errors > 0 && st.requests == 0 ? 1 : 0;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# 为网站目录下的文本类静态文件离线生成 .gz 旁路文件。服务器对接受 gzip 的客户端直接发送旁路文件,
+# 请求路径上不做任何压缩。扩展名列表与 server.c 中 compressible 的类型一致。
+#
+# 用法: ./precompress.sh [目录]    默认为 ./webroot
+#
+# 只在原文件比旁路文件新时重新生成; 压缩后没有变小的文件不保留旁路文件。
+# 旁路文件的修改时间设为与原文件相同, 服务器据此判断它没有过期。
+
+root=${1:-./webroot}
+if [ ! -d "$root" ]; then
+    echo "目录不存在: $root" >&2
+    exit 1
+fi
+
+find "$root" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.css' -o -name '*.js' -o -name '*.mjs' \
+    -o -name '*.json' -o -name '*.map' -o -name '*.svg' -o -name '*.xml' -o -name '*.txt' -o -name '*.wasm' \) |
+while IFS= read -r file; do
+    gz="$file.gz"
+    if [ -f "$gz" ] && [ ! "$file" -nt "$gz" ]; then
+        continue
+    fi
+    # 先写临时文件再改名, 正在运行的服务器不会读到写了一半的旁路文件
+    if ! gzip -9 -n -c "$file" > "$gz.tmp"; then
+        rm -f "$gz.tmp"
+        continue
+    fi
+    orig_size=$(wc -c < "$file")
+    gz_size=$(wc -c < "$gz.tmp")
+    if [ "$gz_size" -lt "$orig_size" ]; then
+        touch -r "$file" "$gz.tmp"
+        mv -f "$gz.tmp" "$gz"
+        echo "$file: $orig_size -> $gz_size 字节"
+    else
+        rm -f "$gz.tmp" "$gz"
+        echo "$file: 压缩后没有变小, 跳过"
+    fi
+done
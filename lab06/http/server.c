@@ -1,50 +1,509 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/time.h>
+#include <stddef.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define BUFFER_SIZE 4096
 #define WEB_ROOT "./webroot"
+#define HEADER_SIZE 1024
+#define MAX_EVENTS 1024
+#define DEFAULT_KEEPALIVE_TIMEOUT 5 // 长连接空闲超时时间（秒）
+#define DEFAULT_HEADER_TIMEOUT 10   // 读完一个请求头的期限（秒）
+#define DEFAULT_SEND_TIMEOUT 30     // 发送响应时无进展的期限（秒）
+#define DEFAULT_QUEUE_DEPTH 128     // 达到连接上限后监听队列中允许等待的连接数
+#define DEFAULT_RETRY_AFTER 1       // 503 响应建议客户端重试的间隔（秒）
+#define TIMER_TICK_MS 100           // 时间轮的精度
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4              // 每层 64 格, 100ms 精度下最长可表示约 19 天
+#define MAX_IOV 8
+#define MAX_RANGES 16               // 单个请求最多接受的字节范围数
+#define MAX_SEGMENTS (2 * MAX_RANGES + 4)
+#define DEFAULT_CACHE_MB 64         // 文件缓存默认内存上限（MB）
+#define CACHE_MAX_FILE (1 << 20)    // 超过该大小的文件不进缓存, 直接 sendfile
+#define CACHE_BUCKETS 1024
+#define MAX_WATCHES 256
+#define MAX_HEAD_SIZE (BUFFER_SIZE - 1) // 请求行加全部请求头的字节上限, 受 in_buf 大小约束
+#define MAX_HEADERS 32              // 单个请求最多接受的请求头个数
+#define MAX_PATH_LEN 1024
+#define MAX_STATUS 600
+#define HIST_SUB_BITS 2             // 延迟直方图每个 2 的幂区间再分 4 档, 相对误差 < 25%
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB) // 以纳秒计, 覆盖到约 2^40 ns (18 分钟)
+#define METRICS_MIN_SHIFT 6         // /metrics 输出的直方图边界从 2^6 ns 到 2^35 ns
+#define METRICS_MAX_SHIFT 35
+#define PHASE_SAMPLE_MASK 7         // 每 8 个请求记录 1 个的阶段耗时, 计数器不抽样
+#define LOG_RING_SLOTS 4096         // 每个工作进程的访问日志环的记录数 (2 的幂)
+#define LOG_PATH_LEN 192
+#define LOG_BATCH 256               // 写盘进程一次 writev 的最多行数
+#define LOG_LINE_SIZE 640
+#define GZIP_KEY_SUFFIX "\ngzip"   // 压缩变体的缓存键: 原文件路径加上请求路径中不可能出现的后缀
+#define MIME_SLOTS 64               // 扩展名散列表的槽数 (2 的幂, 不少于类型数的两倍)
+#define NOT_FOUND_BODY "<html><body><h1>404 Not Found</h1></body></html>"
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384          // 不放宽 SETTINGS_MAX_FRAME_SIZE, 收到的帧都不超过默认值
+#define H2_IN_SIZE (H2_FRAME_HEADER + H2_MAX_FRAME)
+#define H2_OUT_SIZE (64 * 1024)
+#define H2_OUT_RESERVE 1024         // 输出缓冲区剩余空间少于此值时先发送, 再处理后续帧
+#define H2_MAX_STREAMS 100          // SETTINGS_MAX_CONCURRENT_STREAMS
+#define H2_HEADER_BLOCK 16384       // 一个头部块 (HEADERS 加 CONTINUATION) 的字节上限
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7fffffff
+#define HPACK_TABLE_SIZE 4096       // 动态表大小上限, 即 SETTINGS_HEADER_TABLE_SIZE 的默认值
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+#define HPACK_STATIC_ENTRIES 61
+
+// 服务模式: fork 为每个连接创建子进程, epoll 为单进程事件循环,
+// workers 为多个各自持有 SO_REUSEPORT 监听套接字的 epoll 工作进程
+enum server_mode { MODE_FORK, MODE_EPOLL, MODE_WORKERS };
+
+// 连接状态机: 读取请求 -> 发送响应 (响应头与正文片段) -> (长连接) 回到读取请求。
+// 切换到 HTTP/2 的连接在 CONN_H2 (读帧、处理帧) 和 CONN_WRITE_RESPONSE (写出累积的帧) 之间往返
+enum conn_state { CONN_READ_REQUEST, CONN_WRITE_RESPONSE, CONN_H2, CONN_DONE };
+
+// 请求路径映射的结果
+enum route { ROUTE_NOT_FOUND = -1, ROUTE_FILE, ROUTE_METRICS };
+
+// 响应由若干片段组成: mem 非空时是内存中的数据 (响应头、缓存的正文、multipart 分隔头),
+// 否则是 file_fd 中从 off 开始的 len 个字节, 用 sendfile 发送
+struct segment {
+    const char *mem;
+    off_t off;
+    size_t len;
+};
+
+// 扩展名到 MIME 类型的映射; compressible 的类型可以有预压缩的 .gz 旁路文件
+struct mime_type {
+    const char *ext;
+    const char *type;
+    int compressible;
+};
+
+// 由 stat 信息得到的校验器, 用于条件请求和 Range 请求
+struct file_info {
+    const char *mime_type;
+    const char *encoding;       // 发送的是 .gz 旁路文件时为 "gzip", 否则为 NULL
+    int vary;                   // 响应随 Accept-Encoding 变化, 要带 Vary 头
+    off_t size;
+    time_t mtime;
+    char etag[48];
+    char last_modified[40];
+};
+
+// 闭区间 [start, end]
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+// 字符串视图: 指向连接缓冲区内部, 不以 '\0' 结尾, 只在当前请求处理完之前有效
+struct strview {
+    const char *p;
+    size_t len;
+};
+
+struct http_header {
+    struct strview name;
+    struct strview value;
+};
+
+// 解析得到的请求, 所有字段都是 in_buf 中的视图, 解析过程不拷贝也不分配内存。
+// 没有版本号的请求 (形如 "GET /path") 按 HTTP/0.9 处理, version 为空。
+struct http_request {
+    struct strview method;
+    struct strview target;
+    struct strview version;
+    struct http_header headers[MAX_HEADERS];
+    int num_headers;
+    size_t head_len;            // 请求行加请求头 (含结尾空行) 的字节数
+};
+
+// 增量解析器: pos 是已解析完整行的结束位置, scan 是已确认没有换行符的位置。
+// 新数据到达后从断点继续, 已经看过的字节不会再扫描一遍。
+enum parse_state { PARSE_REQUEST_LINE, PARSE_HEADERS };
+enum parse_result { PARSE_INCOMPLETE, PARSE_DONE, PARSE_ERROR };
+
+struct http_parser {
+    enum parse_state state;
+    size_t pos;
+    size_t scan;
+    int error;                  // PARSE_ERROR 时应答的状态码
+};
+
+// 一个请求经历的三个阶段: 解析请求头, 查缓存/打开文件并生成响应头, 发送响应
+enum req_phase { PHASE_PARSE, PHASE_OPEN, PHASE_SEND, NUM_PHASES };
+
+// 一条访问日志记录, 由工作进程填写原始字段, 格式化留给写盘进程。
+// seq 是有界队列的槽序号: 等于写入位置时槽空闲, 等于写入位置 + 1 时记录可读。
+struct access_record {
+    unsigned long seq;
+    long long time_ms;          // CLOCK_REALTIME, 毫秒
+    struct in_addr addr;
+    unsigned short port;
+    unsigned short status;
+    unsigned int duration_us;
+    int worker;
+    unsigned long bytes;
+    char method[8];
+    char path[LOG_PATH_LEN];
+};
+
+// 访问日志环, 放在所有进程共享的匿名映射中。工作进程模式下每个工作进程一个, 只有一个生产者;
+// fork 模式下所有子进程共用一个, 生产者用 CAS 抢占写入位置。消费者始终只有写盘进程。
+// 环满时丢弃记录并计数, 请求处理永远不会等待写盘。
+struct log_ring {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    unsigned long dropped __attribute__((aligned(64)));
+    unsigned long written;
+    struct access_record slots[LOG_RING_SLOTS];
+};
+
+// conn_drive 的返回值, 告诉调用者连接接下来在等什么
+enum drive_result { DRIVE_WANT_READ, DRIVE_WANT_WRITE, DRIVE_CLOSE };
+
+// 连接当前受哪个期限约束, 由 conn_deadline 根据状态判断
+enum timer_kind { TIMER_HEADER, TIMER_SEND, TIMER_IDLE, NUM_TIMERS };
+
+// 时间轮上的定时器, 嵌在被定时的对象里, 不需要单独分配
+struct timer_node {
+    struct timer_node *next;
+    struct timer_node **pprev;  // 指向前一个节点的 next (或槽头), NULL 表示不在时间轮上
+    uint64_t expires;           // 到期的时间刻度
+};
+
+// 分层时间轮: 第 k 层每格跨 64^k 个刻度。插入和删除都是 O(1);
+// 低层转完一圈时, 上一层当前格中的定时器整体下放一层, 每个定时器最多下放 WHEEL_LEVELS-1 次。
+struct timer_wheel {
+    uint64_t now;               // 已经处理到的刻度
+    size_t count;
+    struct timer_node *slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+// HTTP/2 帧类型、标志和错误码 (RFC 7540 第 6、7 节)
+enum h2_frame_type {
+    H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+enum h2_flag { H2_FLAG_END_STREAM = 0x1, H2_FLAG_ACK = 0x1, H2_FLAG_END_HEADERS = 0x4,
+               H2_FLAG_PADDED = 0x8, H2_FLAG_PRIORITY = 0x20 };
+enum h2_error {
+    H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR, H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM, H2_CANCEL, H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR, H2_ENHANCE_YOUR_CALM
+};
+
+// 响应中用到的头部在 HPACK 静态表中的下标, 编码时直接引用名字
+enum hpack_name {
+    HPACK_ACCEPT_RANGES = 18, HPACK_ALLOW = 22, HPACK_CACHE_CONTROL = 24, HPACK_CONTENT_ENCODING = 26,
+    HPACK_CONTENT_LENGTH = 28, HPACK_CONTENT_RANGE = 30, HPACK_CONTENT_TYPE = 31, HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44, HPACK_VARY = 59
+};
+
+struct hpack_field {
+    const char *name;
+    const char *value;
+};
+
+// 动态表条目, 名字和值在同一次分配中
+struct hpack_entry {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+};
+
+// HPACK 动态表: 环形数组, first 是最新条目的位置, 下标 62 对应最新条目
+struct hpack_table {
+    struct hpack_entry ents[HPACK_MAX_ENTRIES];
+    int first;
+    int count;
+    size_t size;                // 按 RFC 7541 4.1 计算: 每个条目是名字 + 值 + 32 字节
+    size_t max_size;
+};
+
+// HTTP/2 的一个流。正文来自缓存条目、打开的文件或内存 (/metrics 和错误页),
+// 按流量控制窗口分成 DATA 帧轮转发送
+struct h2_stream {
+    uint32_t id;                // 0 表示空闲槽
+    int32_t send_window;
+    int remote_closed;          // 客户端已发送 END_STREAM
+    int status;
+    const char *mem;
+    char *owned;                // 需要释放的正文
+    struct cache_entry *entry;
+    int file_fd;
+    off_t off;
+    off_t remaining;
+    unsigned long bytes;
+    uint64_t t_request;
+    char method[8];
+    char path[LOG_PATH_LEN];
+};
+
+// h2c 连接的全部状态, 只在连接切换到 HTTP/2 后分配。
+// 收到的帧在 in 中凑齐一整帧再处理; 要发送的帧依次追加到 out, 由原有的发送路径整块写出。
+struct h2_conn {
+    int preface_pending;        // 还没收到客户端的连接前言
+    int closing;                // 已决定关闭 (发出 GOAWAY 或对端 GOAWAY 后流已处理完), out 发完即关闭
+    int peer_goaway;
+    uint32_t last_stream_id;
+    uint32_t peer_max_frame;
+    int32_t peer_initial_window;
+    int32_t send_window;        // 连接级发送窗口
+    int num_streams;
+    int rr;                     // 轮转发送 DATA 的起点
+    struct h2_stream streams[H2_MAX_STREAMS];
+    uint32_t hdr_stream;        // 正在接收头部块的流, 0 表示没有
+    int hdr_end_stream;
+    size_t hdr_len;
+    struct hpack_table dec;
+    struct hpack_table enc;
+    int enc_resize;             // 下一个头部块开头要通知对端动态表的新大小
+    size_t in_len;
+    size_t out_len;
+    char in[H2_IN_SIZE];
+    char hdr_block[H2_HEADER_BLOCK];
+    char out[H2_OUT_SIZE];
+};
+
+// 每个连接的上下文, 两种模式共用同一套状态机
+struct conn {
+    int fd;
+    enum conn_state state;
+    char in_buf[BUFFER_SIZE];   // 可能同时含有多个流水线请求
+    size_t in_len;
+    size_t req_len;             // 当前请求在 in_buf 中占用的字节数
+    struct http_parser parser;
+    struct http_request req;
+    int keep_alive;
+    int status;                 // 当前响应的状态码, 响应发送完毕时计入统计
+    int timed;                  // 当前请求被抽中记录阶段耗时
+    uint64_t t_send;            // 响应准备好、开始发送的时刻 (cycles_now)
+    uint64_t t_request;         // 请求头解析完毕的时刻, 只在记录访问日志时读取
+    unsigned long resp_bytes;   // 当前响应已发送的字节数
+    struct sockaddr_in peer;    // 客户端地址, 只在记录访问日志时填写
+    char out_buf[HEADER_SIZE];  // 生成的响应头
+    size_t out_len;
+    char *parts_buf;            // multipart/byteranges 各部分的分隔头, 仅多范围请求时分配
+    // 待发送的片段; 相邻的内存片段合并成一次 writev, 文件片段用 sendfile 发送, 不经过用户态
+    struct segment segs[MAX_SEGMENTS];
+    int seg_cnt;
+    int seg_idx;
+    struct cache_entry *entry;  // 正在从缓存发送的条目, 持有其引用
+    int file_fd;
+    // 超时: 状态 (读请求头/发送/空闲) 或发送进度变化时重新计时, 读请求头期间收到数据不延期
+    int timer_kind;
+    unsigned long timer_mark;   // 计时起点对应的已完成响应数, 发送阶段为累计发送字节数
+    unsigned long responses;
+    unsigned long sent_total;
+    uint64_t phase_start;       // 当前期限的计时起点 (毫秒)
+    struct timer_node timer;    // 事件循环模式下挂在时间轮上
+    struct h2_conn *h2;         // 切换到 HTTP/2 后的连接状态, HTTP/1 连接为 NULL
+};
+
+// 文件缓存条目: 文件内容、预先生成的响应头 (不含 Connection 行)、MIME 类型、大小和校验器。
+// 条目同时挂在哈希桶和 LRU 链表上; 被淘汰或失效后若仍有连接在发送, 等引用归零再释放。
+struct cache_entry {
+    char *path;
+    unsigned int hash;
+    char *data;
+    struct file_info info;
+    char header[384];
+    size_t header_len;
+    int refcount;
+    int linked;
+    int no_gzip;                // 已确认没有可用的 .gz 旁路文件, 旁路文件有变化时由 inotify 清除
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev, *lru_next;
+};
+
+// 每个工作进程一份统计, 放在父子进程共享的匿名映射中。
+// 按缓存行对齐, 各进程只写自己的一份, 互不产生伪共享。
+// 各阶段耗时按对数-线性分桶 (HDR 直方图的做法), 桶内只计数, 记录一次只是一次加法。
+struct worker_stats {
+    pid_t pid;
+    unsigned long requests;
+    unsigned long bytes_sent;
+    unsigned long status[MAX_STATUS];
+    unsigned long phase_hist[NUM_PHASES][HIST_BUCKETS];
+    unsigned long phase_sum_ns[NUM_PHASES];
+    unsigned long timeouts[NUM_TIMERS];
+    unsigned long shed;             // 过载时直接回复 503 的连接数
+    unsigned long accept_pauses;    // 因达到连接上限暂停 accept 的次数
+} __attribute__((aligned(64)));
+
+int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+int header_timeout = DEFAULT_HEADER_TIMEOUT;
+int send_timeout = DEFAULT_SEND_TIMEOUT;
+// 准入控制 (-C): 同时服务的连接数 (fork 模式下为子进程数) 达到上限后暂停 accept,
+// 监听队列中超过 queue_depth 的连接立即用预先生成的 503 拒绝
+int max_conns = 0;              // 0 表示不限制
+int queue_depth = DEFAULT_QUEUE_DEPTH;
+int retry_after = DEFAULT_RETRY_AFTER;
+int active_conns = 0;
+volatile sig_atomic_t num_children = 0;
+char shed_response[256];
+size_t shed_response_len;
+int use_uring = 0;              // 事件循环使用 io_uring 后端 (-m uring)
+struct worker_stats local_stats;
+struct worker_stats *my_stats = &local_stats;
+// /metrics 汇总的范围: 工作进程模式下是共享映射中的全部工作进程, 否则只有本进程
+struct worker_stats *all_stats = &local_stats;
+int num_stats = 1;
+uint64_t cycles_to_ns_mult = 1ULL << 32;    // 纳秒 = 周期数 * mult >> 32, 启动时校准
+
+// 访问日志 (-l): 各进程往自己的环里追加记录, 由单独的写盘进程批量写入文件
+const char *access_log_path = NULL;
+int access_log_fd = -1;
+struct log_ring *log_rings = NULL;
+int num_log_rings = 0;
+struct log_ring *my_log_ring = NULL;
+int my_worker_index = 0;
+pid_t log_writer_pid = -1;
+volatile sig_atomic_t stop_requested = 0;
+volatile sig_atomic_t timer_signalled = 0;   // fork 模式下的每秒时钟信号, 打断阻塞的收发去检查期限
+
+// 每个事件循环进程一份缓存, 由该进程内的所有连接共享; fork 模式下不启用
+int cache_enabled = 0;
+size_t cache_capacity = (size_t)DEFAULT_CACHE_MB << 20;
+size_t cache_used = 0;
+struct cache_entry *cache_buckets[CACHE_BUCKETS];
+struct cache_entry *lru_head = NULL, *lru_tail = NULL;
+int inotify_fd = -1;
+// inotify 监视描述符到目录路径的映射, 用于还原事件中文件的完整路径
+struct watch { int wd; char dir[256]; } watches[MAX_WATCHES];
+int num_watches = 0;
 
 void error_die(const char *msg) { perror(msg); exit(1); }
 const char* get_mime_type(const char* filename);
-void send_404(int client_sock);
-void send_file_response(int client_sock, const char* local_path);
-void handle_client(int client_sock);
+int find_header(const struct http_request *req, const char *name, char *value, size_t value_size);
+void send_404(struct conn *c);
+void send_file_response(struct conn *c, const char* local_path, const struct http_request *req);
+void handle_client(int client_sock, const struct sockaddr_in *peer);
+void parser_reset(struct http_parser *p);
+void conn_init(struct conn *c, int fd);
+void conn_close(struct conn *c);
+enum drive_result conn_drive(struct conn *c);
+void run_event_loop(int server_sock);
+int run_uring_loop(int server_sock);
+void run_fork_server(int server_sock);
+void run_workers(int port, int num_workers, int pin_cpu);
+void run_parser_bench(long iterations);
+void calibrate_cycles(void);
+void stats_merge(struct worker_stats *dst, const struct worker_stats *src);
+void stat_add(unsigned long *counter, unsigned long n);
+uint64_t monotonic_ms(void);
+void render_shed_response(void);
+void shed_backlog(int server_sock);
+uint64_t conn_deadline(struct conn *c, uint64_t now);
+void conn_timed_out(struct conn *c, int abortive);
+void start_log_writer(int num_rings);
+void access_log_add(const struct sockaddr_in *peer, struct strview method, struct strview path, int status,
+                    unsigned long bytes, uint64_t t_start);
+int sv_eq(struct strview s, const char *lit);
+char *render_metrics(size_t *out_len);
+void add_mem_segment(struct conn *c, const char *mem, size_t len);
+int map_request_path(struct strview target, char *local_path, size_t size);
+int open_entity(const char *local_path, const struct http_request *req, struct cache_entry **entry, int *file_fd,
+                struct file_info *fi);
+int select_entity(const struct http_request *req, const struct file_info *fi, struct byte_range *ranges,
+                  int *num_ranges);
+void cache_entry_put(struct cache_entry *e);
+void hpack_huff_init(void);
+void mime_init(void);
+unsigned int hash_path(const char *path);
+int h2_process(struct conn *c);
+void h2_output_done(struct conn *c);
+int h2_start(struct conn *c);
+int h2_upgrade(struct conn *c);
+void h2_free(struct h2_conn *h2);
 
 // SIGCHLD 信号处理函数，用于回收僵尸进程
 void sigchld_handler(int sig) {
     // 即使没有子进程退出，也会立即返回，防止阻塞
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    pid_t pid;
+    int saved_errno = errno;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        if (pid != log_writer_pid) num_children--;
+    }
+    errno = saved_errno;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "用法: %s <端口号>\n", argv[0]);
-        exit(1);
-    }
+void stop_handler(int sig) {
+    stop_requested = 1;
+}
 
-    int port = atoi(argv[1]);
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+void timer_signal_handler(int sig) {
+    timer_signalled = 1;
+}
 
-    // 注册 SIGCHLD 信号处理函数
-    signal(SIGCHLD, sigchld_handler);
+void usage(const char *prog) {
+    fprintf(stderr, "用法: %s [-m fork|epoll|uring] [-w 进程数 [-a]] [-k 秒] [-t 秒] [-T 秒] [-C 连接数 [-Q 队列] [-R 秒]] [-c MB] [-l 日志文件] <端口号>\n", prog);
+    fprintf(stderr, "      %s -b 次数\n", prog);
+    fprintf(stderr, "  -m  服务模式, fork 为每个连接创建子进程, epoll 为单进程事件循环 (默认),\n"
+                    "      uring 为基于 io_uring 的事件循环, 内核不支持时退回 epoll\n");
+    fprintf(stderr, "  -w  启动多个 epoll 工作进程, 各自用 SO_REUSEPORT 监听同一端口\n");
+    fprintf(stderr, "  -a  把第 i 个工作进程绑定到第 i 个 CPU\n");
+    fprintf(stderr, "  -k  长连接空闲超时, 默认 %d 秒\n", DEFAULT_KEEPALIVE_TIMEOUT);
+    fprintf(stderr, "  -t  从连接建立或上一个响应结束起读完请求头的期限, 默认 %d 秒\n", DEFAULT_HEADER_TIMEOUT);
+    fprintf(stderr, "  -T  发送响应时持续没有进展的期限, 默认 %d 秒\n", DEFAULT_SEND_TIMEOUT);
+    fprintf(stderr, "  -C  每个事件循环同时服务的连接数上限 (fork 模式下为子进程数上限), 达到后暂停 accept\n");
+    fprintf(stderr, "  -Q  达到上限后监听队列中最多等待的连接数, 超出的立即回复 503, 默认 %d\n", DEFAULT_QUEUE_DEPTH);
+    fprintf(stderr, "  -R  503 响应中的 Retry-After 秒数, 默认 %d\n", DEFAULT_RETRY_AFTER);
+    fprintf(stderr, "  -c  事件循环模式下文件缓存的内存上限, 默认 %d MB, 0 表示关闭缓存\n", DEFAULT_CACHE_MB);
+    fprintf(stderr, "  -l  把访问日志 (每行一个 JSON 对象) 异步写入该文件, - 表示标准输出\n");
+    fprintf(stderr, "  -b  不启动服务器, 把每个样例请求解析指定次数, 报告请求解析器的速度\n");
+    exit(1);
+}
 
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+// 创建监听套接字; 多个工作进程各自创建时打开 SO_REUSEPORT, 由内核在它们之间分发新连接
+int create_listen_socket(int port, int reuseport) {
+    struct sockaddr_in server_addr;
+    int server_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sock < 0) error_die("socket 创建失败");
 
     // 允许地址重用
     int opt = 1;
     setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        error_die("SO_REUSEPORT 设置失败");
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -55,96 +514,3748 @@ int main(int argc, char* argv[]) {
         error_die("bind 失败");
     }
 
-    if (listen(server_sock, 10) < 0) {
+    // 大量并发连接时, 过小的 backlog 会让新连接在握手阶段就被丢弃
+    if (listen(server_sock, SOMAXCONN) < 0) {
         error_die("listen 失败");
     }
+    return server_sock;
+}
+
+int main(int argc, char* argv[]) {
+    enum server_mode mode = MODE_EPOLL;
+    int num_workers = 0, pin_cpu = 0;
+    long bench_iterations = 0;
+    int opt_ch;
+    while ((opt_ch = getopt(argc, argv, "m:w:ak:t:T:C:Q:R:c:b:l:")) != -1) {
+        switch (opt_ch) {
+            case 'm':
+                if (strcmp(optarg, "fork") == 0) mode = MODE_FORK;
+                else if (strcmp(optarg, "epoll") == 0) mode = MODE_EPOLL;
+                else if (strcmp(optarg, "uring") == 0) mode = MODE_EPOLL, use_uring = 1;
+                else usage(argv[0]);
+                break;
+            case 'w':
+                num_workers = atoi(optarg);
+                if (num_workers <= 0) usage(argv[0]);
+                break;
+            case 'a':
+                pin_cpu = 1;
+                break;
+            case 'k':
+                keepalive_timeout = atoi(optarg);
+                if (keepalive_timeout <= 0) usage(argv[0]);
+                break;
+            case 't':
+                header_timeout = atoi(optarg);
+                if (header_timeout <= 0) usage(argv[0]);
+                break;
+            case 'T':
+                send_timeout = atoi(optarg);
+                if (send_timeout <= 0) usage(argv[0]);
+                break;
+            case 'C':
+                max_conns = atoi(optarg);
+                if (max_conns < 0) usage(argv[0]);
+                break;
+            case 'Q':
+                queue_depth = atoi(optarg);
+                if (queue_depth < 0) usage(argv[0]);
+                break;
+            case 'R':
+                retry_after = atoi(optarg);
+                if (retry_after < 0) usage(argv[0]);
+                break;
+            case 'c':
+                if (atoi(optarg) < 0) usage(argv[0]);
+                cache_capacity = (size_t)atoi(optarg) << 20;
+                break;
+            case 'l':
+                access_log_path = optarg;
+                break;
+            case 'b':
+                bench_iterations = atol(optarg);
+                if (bench_iterations <= 0) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (bench_iterations > 0) {
+        run_parser_bench(bench_iterations);
+        return 0;
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    if (num_workers > 0) {
+        // 工作进程模式基于事件循环, 不能与 fork 模式同时使用
+        if (mode == MODE_FORK) usage(argv[0]);
+        mode = MODE_WORKERS;
+    }
+
+    int port = atoi(argv[optind]);
+
+    // 对端提前关闭时 send 不应杀死进程
+    signal(SIGPIPE, SIG_IGN);
+    calibrate_cycles();
+    render_shed_response();
+    hpack_huff_init();
+    mime_init();
+
+    if (access_log_path) {
+        if (strcmp(access_log_path, "-") == 0) {
+            access_log_fd = STDOUT_FILENO;
+        } else {
+            access_log_fd = open(access_log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (access_log_fd < 0) error_die("打开访问日志失败");
+        }
+        // 写盘进程要在工作进程之前创建, 它们共享日志环所在的映射
+        start_log_writer(mode == MODE_WORKERS ? num_workers : 1);
+    }
+
+    if (mode == MODE_WORKERS) {
+        printf("Web服务器已启动 (%d 个工作进程)，正在监听端口 %d...\n", num_workers, port);
+        fflush(stdout);
+        run_workers(port, num_workers, pin_cpu);
+        return 0;
+    }
+
+    int server_sock = create_listen_socket(port, 0);
+    printf("Web服务器已启动 (%s 模式)，正在监听端口 %d...\n",
+           mode == MODE_FORK ? "fork" : use_uring ? "uring" : "epoll", port);
+    // 先刷新缓冲区, 否则 fork 出的子进程退出时会把未输出的内容再打印一遍
+    fflush(stdout);
+
+    if (mode == MODE_EPOLL) {
+        run_event_loop(server_sock);
+    } else {
+        run_fork_server(server_sock);
+    }
+
+    close(server_sock);
+    return 0;
+}
 
-    printf("Web服务器已启动，正在监听端口 %d...\n", port);
+void run_fork_server(int server_sock) {
+    int client_sock;
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+
+    // 注册 SIGCHLD 信号处理函数
+    signal(SIGCHLD, sigchld_handler);
+    sigset_t chld_mask, old_mask;
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+
+    // 子进程各自在 local_stats 中计数, 退出前一次性原子地累加到共享的这一份里
+    all_stats = mmap(NULL, sizeof(*all_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (all_stats == MAP_FAILED) error_die("mmap 失败");
+    memset(all_stats, 0, sizeof(*all_stats));
+    // 父进程只在共享的这一份中记录拒绝和暂停的次数
+    my_stats = all_stats;
 
     while (1) {
+        if (max_conns && num_children >= max_conns) {
+            // 子进程数已达上限, 不再 accept; 每个刻度 (或有子进程退出时) 醒来一次,
+            // 把超出排队上限的连接用 503 拒绝
+            stat_add(&my_stats->accept_pauses, 1);
+            while (num_children >= max_conns) {
+                shed_backlog(server_sock);
+                struct timespec pause = { 0, TIMER_TICK_MS * 1000000 };
+                nanosleep(&pause, NULL);
+            }
+        }
         client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
         if (client_sock < 0) {
             perror("accept 失败");
             continue;
         }
 
-        // 创建子进程来处理连接
+        // 从 fork 到父进程计数完成期间屏蔽 SIGCHLD: num_children++ 是读-改-写, 中途进入
+        // sigchld_handler 做的减一会被覆盖, 计数只增不减, 在 -C 下最终再也不 accept。
+        // 被屏蔽期间退出的子进程在解除屏蔽后立即由处理函数回收
+        sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
         pid_t pid = fork();
         if (pid < 0) {
             perror("fork 失败");
         } else if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
             // 子进程不需要监听套接字
-            close(server_sock); 
+            close(server_sock);
+            my_stats = &local_stats;
             // 处理请求
-            handle_client(client_sock);
+            handle_client(client_sock, &client_addr);
+            stats_merge(all_stats, &local_stats);
             // 处理完毕，子进程退出
             exit(0);
         } else {
             // 父进程不需要连接套接字
-            close(client_sock); 
+            close(client_sock);
+            num_children++;
             // 继续循环，等待下一个连接
         }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
     }
+}
 
-    close(server_sock);
+void print_worker_stats(struct worker_stats *stats, int num_workers) {
+    unsigned long total = 0;
+    for (int i = 0; i < num_workers; i++) {
+        total += __atomic_load_n(&stats[i].requests, __ATOMIC_RELAXED);
+    }
+    printf("--- 工作进程请求统计 (共 %lu) ---\n", total);
+    for (int i = 0; i < num_workers; i++) {
+        unsigned long requests = __atomic_load_n(&stats[i].requests, __ATOMIC_RELAXED);
+        printf("工作进程 %d (PID %d): %lu 请求 (%.1f%%)\n", i, stats[i].pid, requests,
+               total ? 100.0 * requests / total : 0.0);
+    }
+    fflush(stdout);
+}
+
+// 预先 fork 出 num_workers 个工作进程, 每个进程自己创建 SO_REUSEPORT 监听套接字并运行事件循环,
+// 没有单一的 accept 瓶颈。父进程只负责定期汇报各进程的请求数, 以及在退出时回收它们。
+void run_workers(int port, int num_workers, int pin_cpu) {
+    struct worker_stats *stats = mmap(NULL, sizeof(*stats) * num_workers, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) error_die("mmap 失败");
+    memset(stats, 0, sizeof(*stats) * num_workers);
+    all_stats = stats;
+    num_stats = num_workers;
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < num_workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) error_die("fork 失败");
+        if (pid == 0) {
+            if (pin_cpu && num_cpus > 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(i % num_cpus, &set);
+                if (sched_setaffinity(0, sizeof(set), &set) < 0) perror("sched_setaffinity 失败");
+            }
+            my_stats = &stats[i];
+            my_worker_index = i;
+            if (log_rings) my_log_ring = &log_rings[i];
+            run_event_loop(create_listen_socket(port, 1));
+            exit(0);
+        }
+        stats[i].pid = pid;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // 每 10 秒汇报一次, 请求数没有变化时不重复打印
+    unsigned long last_total = 0;
+    while (!stop_requested) {
+        sleep(10);
+        if (stop_requested) break;
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            fprintf(stderr, "工作进程 PID %d 意外退出\n", pid);
+        }
+        unsigned long total = 0;
+        for (int i = 0; i < num_workers; i++) {
+            total += __atomic_load_n(&stats[i].requests, __ATOMIC_RELAXED);
+        }
+        if (total != last_total) {
+            print_worker_stats(stats, num_workers);
+            last_total = total;
+        }
+    }
+
+    for (int i = 0; i < num_workers; i++) kill(stats[i].pid, SIGTERM);
+    for (int i = 0; i < num_workers; i++) waitpid(stats[i].pid, NULL, 0);
+    // 工作进程都退出后再让写盘进程写完剩余记录
+    if (log_writer_pid > 0) {
+        kill(log_writer_pid, SIGTERM);
+        waitpid(log_writer_pid, NULL, 0);
+    }
+    print_worker_stats(stats, num_workers);
+    munmap(stats, sizeof(*stats) * num_workers);
+}
+
+// 读取时间戳计数器, 比 clock_gettime 便宜得多, 每个请求要取好几次
+uint64_t cycles_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// 用 CLOCK_MONOTONIC 测出时间戳计数器的频率, 换算成定点乘数
+void calibrate_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec t0, t1, pause = { 0, 20 * 1000 * 1000 };
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t c0 = cycles_now();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t c1 = cycles_now();
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if (c1 > c0) cycles_to_ns_mult = (uint64_t)(ns / (c1 - c0) * 4294967296.0);
+#endif
+}
+
+// 每个计数器只有所属进程写入, 普通的读-加-写就够了, 不需要带 lock 前缀的原子指令;
+// relaxed 存储保证其他进程汇总时读到的是完整的 64 位值
+void stat_add(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// 纳秒到直方图桶: 小于 HIST_SUB 的值每个一桶, 更大的值按最高位分组, 组内再按次高的几位分档
+int hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB + (int)((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 桶 idx 中的值都小于该上界
+uint64_t hist_bucket_limit(int idx) {
+    if (idx < HIST_SUB) return idx + 1;
+    int group = idx / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + idx % HIST_SUB + 1) << group;
+}
+
+void record_phase(enum req_phase phase, uint64_t start, uint64_t end) {
+    uint64_t ns = (unsigned __int128)(end - start) * cycles_to_ns_mult >> 32;
+    stat_add(&my_stats->phase_hist[phase][hist_bucket(ns)], 1);
+    stat_add(&my_stats->phase_sum_ns[phase], ns);
+}
+
+// fork 模式的子进程退出前把自己的统计累加到共享的一份中, 此时可能有其他子进程同时在加
+void stats_merge(struct worker_stats *dst, const struct worker_stats *src) {
+    __atomic_fetch_add(&dst->requests, src->requests, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->bytes_sent, src->bytes_sent, __ATOMIC_RELAXED);
+    for (int i = 0; i < MAX_STATUS; i++) {
+        if (src->status[i]) __atomic_fetch_add(&dst->status[i], src->status[i], __ATOMIC_RELAXED);
+    }
+    for (int k = 0; k < NUM_TIMERS; k++) {
+        __atomic_fetch_add(&dst->timeouts[k], src->timeouts[k], __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&dst->shed, src->shed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->accept_pauses, src->accept_pauses, __ATOMIC_RELAXED);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        __atomic_fetch_add(&dst->phase_sum_ns[p], src->phase_sum_ns[p], __ATOMIC_RELAXED);
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            if (src->phase_hist[p][i]) {
+                __atomic_fetch_add(&dst->phase_hist[p][i], src->phase_hist[p][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// 追加到动态增长的文本缓冲区; 生成 /metrics 的输出用
+void text_append(char **buf, size_t *len, size_t *cap, const char *fmt, ...) {
+    va_list ap;
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (*len + n < *cap) {
+            *len += n;
+            return;
+        }
+        char *bigger = realloc(*buf, *cap * 2 + n);
+        if (!bigger) return;
+        *buf = bigger;
+        *cap = *cap * 2 + n;
+    }
+}
+
+// 汇总所有工作进程的统计, 生成 Prometheus 文本格式 (version 0.0.4)。
+// 读取时不加锁: 各计数器单调递增, 不同计数器之间可能相差正在处理的几个请求。
+char *render_metrics(size_t *out_len) {
+    static struct worker_stats sum;
+    size_t len = 0, cap = 32768;
+    char *buf = malloc(cap);
+    if (!buf) return NULL;
+
+    memset(&sum, 0, sizeof(sum));
+    for (int i = 0; i < num_stats; i++) stats_merge(&sum, &all_stats[i]);
+    // fork 模式下本进程的计数还没有合并进共享的那一份
+    if (my_stats == &local_stats && all_stats != &local_stats) stats_merge(&sum, &local_stats);
+
+    text_append(&buf, &len, &cap,
+                "# HELP http_requests_total 已解析的 HTTP 请求数\n"
+                "# TYPE http_requests_total counter\n"
+                "http_requests_total %lu\n"
+                "# HELP http_sent_bytes_total 发送的响应字节数 (响应头加正文)\n"
+                "# TYPE http_sent_bytes_total counter\n"
+                "http_sent_bytes_total %lu\n"
+                "# HELP http_responses_total 按状态码统计的已发送完毕的响应数\n"
+                "# TYPE http_responses_total counter\n",
+                sum.requests, sum.bytes_sent);
+    for (int code = 100; code < MAX_STATUS; code++) {
+        if (sum.status[code]) {
+            text_append(&buf, &len, &cap, "http_responses_total{code=\"%d\"} %lu\n", code, sum.status[code]);
+        }
+    }
+
+    static const char *timer_names[NUM_TIMERS] = { "header", "send", "idle" };
+    text_append(&buf, &len, &cap,
+                "# HELP http_connection_timeouts_total 因超时被关闭的连接数, 按超时时所处的阶段分类\n"
+                "# TYPE http_connection_timeouts_total counter\n");
+    for (int k = 0; k < NUM_TIMERS; k++) {
+        text_append(&buf, &len, &cap, "http_connection_timeouts_total{phase=\"%s\"} %lu\n",
+                    timer_names[k], sum.timeouts[k]);
+    }
+
+    text_append(&buf, &len, &cap,
+                "# HELP http_shed_connections_total 过载时不经处理直接回复 503 的连接数\n"
+                "# TYPE http_shed_connections_total counter\n"
+                "http_shed_connections_total %lu\n"
+                "# HELP http_accept_pauses_total 因达到连接上限而暂停 accept 的次数\n"
+                "# TYPE http_accept_pauses_total counter\n"
+                "http_accept_pauses_total %lu\n",
+                sum.shed, sum.accept_pauses);
+
+    if (num_stats > 1) {
+        text_append(&buf, &len, &cap,
+                    "# HELP http_worker_requests_total 各工作进程处理的请求数\n"
+                    "# TYPE http_worker_requests_total counter\n");
+        for (int i = 0; i < num_stats; i++) {
+            text_append(&buf, &len, &cap, "http_worker_requests_total{worker=\"%d\",pid=\"%d\"} %lu\n",
+                        i, all_stats[i].pid, __atomic_load_n(&all_stats[i].requests, __ATOMIC_RELAXED));
+        }
+    }
+
+    if (log_rings) {
+        unsigned long written = 0, dropped = 0;
+        for (int i = 0; i < num_log_rings; i++) {
+            written += __atomic_load_n(&log_rings[i].written, __ATOMIC_RELAXED);
+            dropped += __atomic_load_n(&log_rings[i].dropped, __ATOMIC_RELAXED);
+        }
+        text_append(&buf, &len, &cap,
+                    "# HELP http_access_log_written_total 写盘进程已写出的访问日志记录数\n"
+                    "# TYPE http_access_log_written_total counter\n"
+                    "http_access_log_written_total %lu\n"
+                    "# HELP http_access_log_dropped_total 日志环已满而丢弃的访问日志记录数\n"
+                    "# TYPE http_access_log_dropped_total counter\n"
+                    "http_access_log_dropped_total %lu\n",
+                    written, dropped);
+    }
+
+    static const char *phase_names[NUM_PHASES] = { "parse", "open", "send" };
+    text_append(&buf, &len, &cap,
+                "# HELP http_request_phase_seconds 请求各阶段耗时 (每 %d 个请求抽样 1 个): "
+                "解析请求头, 打开文件并生成响应头, 发送响应\n"
+                "# TYPE http_request_phase_seconds histogram\n", PHASE_SAMPLE_MASK + 1);
+    for (int p = 0; p < NUM_PHASES; p++) {
+        unsigned long count = 0;
+        int idx = 0;
+        for (int shift = METRICS_MIN_SHIFT; shift <= METRICS_MAX_SHIFT; shift++) {
+            // 每个 2 的幂区间输出 HIST_SUB 个边界, 与内部分桶一一对应
+            for (int sub = 0; sub < HIST_SUB; sub++) {
+                uint64_t limit = (uint64_t)(HIST_SUB + sub) << (shift - HIST_SUB_BITS);
+                while (idx < HIST_BUCKETS && hist_bucket_limit(idx) <= limit) count += sum.phase_hist[p][idx++];
+                text_append(&buf, &len, &cap, "http_request_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n",
+                            phase_names[p], limit / 1e9, count);
+            }
+        }
+        while (idx < HIST_BUCKETS) count += sum.phase_hist[p][idx++];
+        text_append(&buf, &len, &cap,
+                    "http_request_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n"
+                    "http_request_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+                    "http_request_phase_seconds_count{phase=\"%s\"} %lu\n",
+                    phase_names[p], count, phase_names[p], sum.phase_sum_ns[p] / 1e9, phase_names[p], count);
+    }
+    *out_len = len;
+    return buf;
+}
+
+// 把一条记录放进环里; 环满时返回 -1, 由调用者计为丢弃
+int log_ring_push(struct log_ring *r, const struct access_record *rec) {
+    unsigned long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    struct access_record *slot;
+    while (1) {
+        slot = &r->slots[pos & (LOG_RING_SLOTS - 1)];
+        unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            return -1;  // 写盘进程还没取走一圈之前的记录
+        } else {
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy((char *)slot + sizeof(slot->seq), (const char *)rec + sizeof(rec->seq), sizeof(*rec) - sizeof(rec->seq));
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
     return 0;
 }
 
-const char* get_mime_type(const char* filename) {
+// 取出一条记录; 环空时返回 -1。只有写盘进程调用
+int log_ring_pop(struct log_ring *r, struct access_record *rec) {
+    unsigned long pos = r->tail;
+    struct access_record *slot = &r->slots[pos & (LOG_RING_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) return -1;
+    *rec = *slot;
+    __atomic_store_n(&slot->seq, pos + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->tail, pos + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// 响应发送完毕后在请求路径上调用: 只填写定长记录, 不格式化也不做系统调用
+void access_log_add(const struct sockaddr_in *peer, struct strview method, struct strview path, int status,
+                    unsigned long bytes, uint64_t t_start) {
+    struct access_record rec;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec.time_ms = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    rec.addr = peer->sin_addr;
+    rec.port = ntohs(peer->sin_port);
+    rec.status = status;
+    rec.duration_us = (unsigned __int128)(cycles_now() - t_start) * cycles_to_ns_mult >> 32 >> 10;
+    rec.worker = my_worker_index;
+    rec.bytes = bytes;
+    size_t n = method.len < sizeof(rec.method) - 1 ? method.len : sizeof(rec.method) - 1;
+    memcpy(rec.method, method.p, n);
+    rec.method[n] = '\0';
+    n = path.len < sizeof(rec.path) - 1 ? path.len : sizeof(rec.path) - 1;
+    memcpy(rec.path, path.p, n);
+    rec.path[n] = '\0';
+    if (log_ring_push(my_log_ring, &rec) < 0) {
+        __atomic_fetch_add(&my_log_ring->dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void access_log_record(struct conn *c) {
+    struct strview none = { "-", 1 };
+    access_log_add(&c->peer, c->parser.error ? none : c->req.method, c->parser.error ? none : c->req.target,
+                   c->status, c->resp_bytes, c->t_request);
+}
+
+// 按 JSON 字符串的规则转义, 请求路径来自客户端, 可能含有引号和控制字符
+size_t json_escape(char *dst, size_t size, const char *src) {
+    size_t len = 0;
+    for (; *src && len + 7 < size; src++) {
+        unsigned char ch = *src;
+        if (ch == '"' || ch == '\\') {
+            dst[len++] = '\\';
+            dst[len++] = ch;
+        } else if (ch < 0x20 || ch == 0x7f) {
+            len += snprintf(dst + len, size - len, "\\u%04x", ch);
+        } else {
+            dst[len++] = ch;
+        }
+    }
+    dst[len] = '\0';
+    return len;
+}
+
+size_t format_access_record(char *line, size_t size, const struct access_record *rec) {
+    // 同一秒内的记录很多, 日期部分只在秒数变化时重新格式化
+    static time_t when_sec = -1;
+    static char when[32];
+    char method[64], path[LOG_PATH_LEN * 6 + 8], addr[INET_ADDRSTRLEN];
+    time_t sec = rec->time_ms / 1000;
+    if (sec != when_sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        when_sec = sec;
+    }
+    inet_ntop(AF_INET, &rec->addr, addr, sizeof(addr));
+    json_escape(method, sizeof(method), rec->method);
+    json_escape(path, sizeof(path), rec->path);
+    int n = snprintf(line, size,
+                     "{\"time\":\"%s.%03dZ\",\"worker\":%d,\"client\":\"%s:%u\",\"method\":\"%s\","
+                     "\"path\":\"%s\",\"status\":%u,\"bytes\":%lu,\"duration_us\":%u}\n",
+                     when, (int)(rec->time_ms % 1000), rec->worker, addr, rec->port, method, path,
+                     rec->status, rec->bytes, rec->duration_us);
+    return n < (int)size ? (size_t)n : size - 1;
+}
+
+// 把一批日志行整体写出, 处理短写
+void write_log_batch(struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(access_log_fd, iov, cnt > IOV_MAX ? IOV_MAX : cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("写访问日志失败");
+            return;
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// 写盘进程: 轮流从各个环取记录, 格式化后每批一次 writev。
+// 环都空时短暂休眠; 丢弃计数有变化时在日志中写一行说明。
+void log_writer_loop(void) {
+    static char lines[LOG_BATCH][LOG_LINE_SIZE];
+    struct iovec iov[LOG_BATCH];
+    struct access_record rec;
+    unsigned long reported_drops = 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // 主进程退出时写盘进程也要退出, 退出前把环中剩余的记录写完
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    while (1) {
+        int cnt = 0;
+        for (int i = 0; i < num_log_rings; i++) {
+            while (cnt < LOG_BATCH && log_ring_pop(&log_rings[i], &rec) == 0) {
+                iov[cnt].iov_base = lines[cnt];
+                iov[cnt].iov_len = format_access_record(lines[cnt], LOG_LINE_SIZE, &rec);
+                cnt++;
+                log_rings[i].written++;
+            }
+        }
+
+        unsigned long drops = 0;
+        for (int i = 0; i < num_log_rings; i++) drops += __atomic_load_n(&log_rings[i].dropped, __ATOMIC_RELAXED);
+        if (drops != reported_drops && cnt < LOG_BATCH) {
+            iov[cnt].iov_base = lines[cnt];
+            iov[cnt].iov_len = snprintf(lines[cnt], LOG_LINE_SIZE,
+                                        "{\"event\":\"dropped\",\"dropped_total\":%lu}\n", drops);
+            cnt++;
+            reported_drops = drops;
+        }
+
+        if (cnt > 0) {
+            write_log_batch(iov, cnt);
+            continue;
+        }
+        if (stop_requested) break;
+        struct timespec pause = { 0, 5 * 1000 * 1000 };
+        nanosleep(&pause, NULL);
+    }
+}
+
+// 创建日志环和写盘进程。环放在 MAP_SHARED 匿名映射中, 之后 fork 出的进程都能看到
+void start_log_writer(int num_rings) {
+    size_t size = sizeof(struct log_ring) * num_rings;
+    log_rings = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (log_rings == MAP_FAILED) error_die("mmap 失败");
+    for (int i = 0; i < num_rings; i++) {
+        for (unsigned long j = 0; j < LOG_RING_SLOTS; j++) log_rings[i].slots[j].seq = j;
+    }
+    num_log_rings = num_rings;
+    my_log_ring = &log_rings[0];
+
+    pid_t pid = fork();
+    if (pid < 0) error_die("fork 失败");
+    if (pid == 0) {
+        log_writer_loop();
+        exit(0);
+    }
+    log_writer_pid = pid;
+    if (access_log_fd != STDOUT_FILENO) close(access_log_fd);
+}
+
+const struct mime_type mime_types[] = {
+    { "html", "text/html", 1 },
+    { "htm", "text/html", 1 },
+    { "css", "text/css", 1 },
+    { "js", "text/javascript", 1 },
+    { "mjs", "text/javascript", 1 },
+    { "json", "application/json", 1 },
+    { "map", "application/json", 1 },
+    { "svg", "image/svg+xml", 1 },
+    { "xml", "application/xml", 1 },
+    { "txt", "text/plain", 1 },
+    { "wasm", "application/wasm", 1 },
+    { "jpg", "image/jpeg", 0 },
+    { "jpeg", "image/jpeg", 0 },
+    { "png", "image/png", 0 },
+    { "gif", "image/gif", 0 },
+    { "webp", "image/webp", 0 },
+    { "ico", "image/x-icon", 0 },
+    { "woff2", "font/woff2", 0 },
+    { "gz", "application/gzip", 0 },
+};
+const struct mime_type default_mime_type = { "", "application/octet-stream", 0 };
+// 开放寻址散列表, 启动时由 mime_init 填写, 查找只需一次散列和一两次比较
+const struct mime_type *mime_slots[MIME_SLOTS];
+
+void mime_init(void) {
+    for (size_t i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+        unsigned int h = hash_path(mime_types[i].ext);
+        while (mime_slots[h & (MIME_SLOTS - 1)]) h++;
+        mime_slots[h & (MIME_SLOTS - 1)] = &mime_types[i];
+    }
+}
+
+// 按文件名的扩展名 (不区分大小写) 查找类型, 未知扩展名按二进制流处理
+const struct mime_type *lookup_mime_type(const char *filename) {
     const char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename) return "application/octet-stream";
-    if (strcmp(dot, ".html") == 0 || strcmp(dot, ".htm") == 0) return "text/html";
-    if (strcmp(dot, ".jpg") == 0 || strcmp(dot, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(dot, ".png") == 0) return "image/png";
-    return "application/octet-stream";
+    const char *slash = strrchr(filename, '/');
+    char ext[8];
+    size_t len;
+    if (!dot || dot == filename || (slash && dot < slash + 2)) return &default_mime_type;
+    for (len = 0; dot[1 + len]; len++) {
+        if (len == sizeof(ext) - 1) return &default_mime_type;
+        ext[len] = tolower((unsigned char)dot[1 + len]);
+    }
+    ext[len] = '\0';
+    for (unsigned int h = hash_path(ext); mime_slots[h & (MIME_SLOTS - 1)]; h++) {
+        if (strcmp(mime_slots[h & (MIME_SLOTS - 1)]->ext, ext) == 0) return mime_slots[h & (MIME_SLOTS - 1)];
+    }
+    return &default_mime_type;
 }
 
-void send_404(int client_sock) {
-    const char *response = "HTTP/1.1 404 NOT FOUND\r\nContent-Type: text/html\r\n\r\n"
-                           "<html><body><h1>404 Not Found</h1></body></html>";
-    send(client_sock, response, strlen(response), 0);
+const char* get_mime_type(const char* filename) {
+    return lookup_mime_type(filename)->type;
 }
 
-void send_file_response(int client_sock, const char* local_path) {
-    char header_buf[1024];
-    struct stat file_stat;
-    
-    if (stat(local_path, &file_stat) < 0 || S_ISDIR(file_stat.st_mode)) {
-        send_404(client_sock);
-        return;
-    }
-
-    const char *mime_type = get_mime_type(local_path);
-    sprintf(header_buf, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n",
-            mime_type, file_stat.st_size);
-    send(client_sock, header_buf, strlen(header_buf), 0);
-
-    int file_fd = open(local_path, O_RDONLY);
-    if (file_fd < 0) return;
-    
-    char file_buf[BUFFER_SIZE];
-    ssize_t bytes_read;
-    while ((bytes_read = read(file_fd, file_buf, sizeof(file_buf))) > 0) {
-        send(client_sock, file_buf, bytes_read, 0);
-    }
-    close(file_fd);
-}
-
-void handle_client(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    char method[16], path[256];
-    
-    ssize_t bytes_received = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        printf("--- 收到来自 PID %d 的请求 ---\n%s\n", getpid(), buffer);
-        
-        if (sscanf(buffer, "%s %s", method, path) == 2 && strcmp(method, "GET") == 0) {
-            if (strcmp(path, "/") == 0) strcpy(path, "/index.html");
-            char local_path[512];
-            snprintf(local_path, sizeof(local_path), "%s%s", WEB_ROOT, path);
-            send_file_response(client_sock, local_path);
-        }
-    }
-    close(client_sock);
-}
\ No newline at end of file
+// 发送压缩变体或可压缩类型的原文件时附加的响应头
+const char *encoding_lines(const struct file_info *fi) {
+    if (fi->encoding) return "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n";
+    return fi->vary ? "Vary: Accept-Encoding\r\n" : "";
+}
+
+const char *connection_header(struct conn *c) {
+    return c->keep_alive ? "keep-alive" : "close";
+}
+
+// 缓存条目的响应头是预先生成的, 只有结尾的 Connection 行随请求变化
+const char *connection_line(struct conn *c) {
+    return c->keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+unsigned int hash_path(const char *path) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void lru_unlink(struct cache_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+void lru_push_front(struct cache_entry *e) {
+    e->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = e;
+    else lru_tail = e;
+    lru_head = e;
+}
+
+void cache_entry_free(struct cache_entry *e) {
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+void cache_entry_put(struct cache_entry *e) {
+    if (--e->refcount == 0 && !e->linked) cache_entry_free(e);
+}
+
+// 从哈希表和 LRU 链表中摘除条目; 正在发送它的连接仍持有引用, 发送完后才真正释放
+void cache_remove(struct cache_entry *e) {
+    struct cache_entry **pp = &cache_buckets[e->hash & (CACHE_BUCKETS - 1)];
+    while (*pp != e) pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+    lru_unlink(e);
+    cache_used -= e->info.size;
+    e->linked = 0;
+    if (e->refcount == 0) cache_entry_free(e);
+}
+
+struct cache_entry *cache_find(const char *path) {
+    unsigned int h = hash_path(path);
+    for (struct cache_entry *e = cache_buckets[h & (CACHE_BUCKETS - 1)]; e; e = e->hash_next) {
+        if (e->hash == h && strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+void cache_invalidate(const char *path) {
+    struct cache_entry *e = cache_find(path);
+    if (e) cache_remove(e);
+}
+
+void cache_flush(void) {
+    while (lru_head) cache_remove(lru_head);
+}
+
+// 命中时把条目移到 LRU 头部; 整个过程不触碰文件系统
+struct cache_entry *cache_lookup(const char *path) {
+    struct cache_entry *e = cache_find(path);
+    if (e) {
+        lru_unlink(e);
+        lru_push_front(e);
+    }
+    return e;
+}
+
+// 把已打开的文件整个读入内存并加入缓存, 必要时从 LRU 尾部淘汰旧条目
+struct cache_entry *cache_insert(const char *path, int file_fd, const struct file_info *fi) {
+    size_t size = fi->size;
+    if (size > CACHE_MAX_FILE || size > cache_capacity) return NULL;
+
+    struct cache_entry *e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->data = malloc(size ? size : 1);
+    e->path = strdup(path);
+    if (!e->data || !e->path) goto fail;
+
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(file_fd, e->data + got, size - got, got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) goto fail;
+        got += n;
+    }
+
+    while (lru_tail && cache_used + size > cache_capacity) cache_remove(lru_tail);
+
+    e->info = *fi;
+    e->hash = hash_path(path);
+    e->header_len = snprintf(e->header, sizeof(e->header),
+                             "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s"
+                             "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+                             fi->mime_type, size, encoding_lines(fi), fi->etag, fi->last_modified);
+    e->refcount = 0;
+    e->linked = 1;
+    e->hash_next = cache_buckets[e->hash & (CACHE_BUCKETS - 1)];
+    cache_buckets[e->hash & (CACHE_BUCKETS - 1)] = e;
+    lru_push_front(e);
+    cache_used += size;
+    return e;
+
+fail:
+    cache_entry_free(e);
+    return NULL;
+}
+
+// 递归监视 WEB_ROOT 下的所有目录, 文件被修改、删除或移动时使对应条目失效
+void watch_directory(const char *dir) {
+    if (num_watches >= MAX_WATCHES) return;
+    int wd = inotify_add_watch(inotify_fd, dir, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+                               IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+    if (wd < 0) {
+        perror("inotify_add_watch 失败");
+        return;
+    }
+    watches[num_watches].wd = wd;
+    snprintf(watches[num_watches].dir, sizeof(watches[num_watches].dir), "%s", dir);
+    num_watches++;
+
+    DIR *d = opendir(dir);
+    if (!d) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) continue;
+        char sub[512];
+        snprintf(sub, sizeof(sub), "%s/%s", dir, entry->d_name);
+        watch_directory(sub);
+    }
+    closedir(d);
+}
+
+int cache_init(void) {
+    if (cache_capacity == 0) return -1;
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        // 没有 inotify 就无法保证缓存与磁盘一致, 宁可不开缓存
+        perror("inotify_init1 失败, 关闭文件缓存");
+        return -1;
+    }
+    watch_directory(WEB_ROOT);
+    cache_enabled = 1;
+    return inotify_fd;
+}
+
+void cache_handle_inotify(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // 事件队列溢出, 丢失了哪些文件变化已无从得知, 只能清空整个缓存
+                cache_flush();
+                continue;
+            }
+            int i;
+            for (i = 0; i < num_watches && watches[i].wd != ev->wd; i++);
+            if (i == num_watches) continue;
+            if (ev->mask & IN_IGNORED) {
+                watches[i] = watches[--num_watches];
+                continue;
+            }
+            if (ev->len == 0) continue;
+
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", watches[i].dir, ev->name);
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                watch_directory(path);
+            } else if (ev->mask & IN_ISDIR) {
+                // 整个子目录被删除或移走, 其中文件的条目无法逐个定位
+                cache_flush();
+            } else {
+                cache_invalidate(path);
+                // 原文件或 .gz 旁路文件变化时, 协商得到的压缩变体也要失效
+                char key[sizeof(path) + 8];
+                size_t path_len = strlen(path);
+                if (path_len > 3 && strcmp(path + path_len - 3, ".gz") == 0) {
+                    // 旁路文件出现或更新, 原文件条目上 "没有旁路文件" 的结论不再成立
+                    path_len -= 3;
+                    snprintf(key, sizeof(key), "%.*s", (int)path_len, path);
+                    struct cache_entry *plain = cache_find(key);
+                    if (plain) plain->no_gzip = 0;
+                }
+                snprintf(key, sizeof(key), "%.*s" GZIP_KEY_SUFFIX, (int)path_len, path);
+                cache_invalidate(key);
+            }
+        }
+    }
+}
+
+void add_mem_segment(struct conn *c, const char *mem, size_t len) {
+    c->segs[c->seg_cnt].mem = mem;
+    c->segs[c->seg_cnt].len = len;
+    c->seg_cnt++;
+}
+
+// 正文片段: 缓存命中时直接引用缓存中的数据, 否则由 sendfile 从文件发送, 两种情况都不复制正文
+void add_body_segment(struct conn *c, off_t off, size_t len) {
+    if (c->entry) {
+        add_mem_segment(c, c->entry->data + off, len);
+        return;
+    }
+    c->segs[c->seg_cnt].mem = NULL;
+    c->segs[c->seg_cnt].off = off;
+    c->segs[c->seg_cnt].len = len;
+    c->seg_cnt++;
+}
+
+// 只有 out_buf 中一段响应 (没有正文或正文很短) 的情况
+void send_simple_response(struct conn *c) {
+    c->seg_cnt = c->seg_idx = 0;
+    add_mem_segment(c, c->out_buf, c->out_len);
+    c->state = CONN_WRITE_RESPONSE;
+}
+
+// 以下函数只准备响应, 真正的发送由 conn_drive 完成
+// 请求格式错误或超出限制: 应答后关闭连接, 因为无法确定下一个请求从哪里开始
+void send_error(struct conn *c, int status) {
+    const char *reason;
+    switch (status) {
+        case 414: reason = "URI Too Long"; break;
+        case 431: reason = "Request Header Fields Too Large"; break;
+        case 500: reason = "Internal Server Error"; break;
+        case 505: reason = "HTTP Version Not Supported"; break;
+        default: status = 400; reason = "Bad Request"; break;
+    }
+    char body[128];
+    snprintf(body, sizeof(body), "<html><body><h1>%d %s</h1></body></html>", status, reason);
+    c->status = status;
+    c->keep_alive = 0;
+    c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                          "HTTP/1.1 %d %s\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n"
+                          "Connection: close\r\n\r\n%s",
+                          status, reason, strlen(body), body);
+    send_simple_response(c);
+}
+
+void send_metrics(struct conn *c) {
+    size_t len;
+    c->parts_buf = render_metrics(&len);
+    if (!c->parts_buf) {
+        send_error(c, 500);
+        return;
+    }
+    c->status = 200;
+    c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                          "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                          "Content-Length: %zu\r\nCache-Control: no-cache\r\nConnection: %s\r\n\r\n",
+                          len, connection_header(c));
+    c->seg_cnt = c->seg_idx = 0;
+    add_mem_segment(c, c->out_buf, c->out_len);
+    add_mem_segment(c, c->parts_buf, len);
+    c->state = CONN_WRITE_RESPONSE;
+}
+
+void send_404(struct conn *c) {
+    const char *body = NOT_FOUND_BODY;
+    c->status = 404;
+    // 长连接要求每个响应都带 Content-Length, 客户端才能找到下一个响应的起点
+    c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                          "HTTP/1.1 404 NOT FOUND\r\nContent-Type: text/html\r\n"
+                          "Content-Length: %zu\r\nConnection: %s\r\n\r\n%s",
+                          strlen(body), connection_header(c), body);
+    send_simple_response(c);
+}
+
+void format_http_date(time_t t, char *buf, size_t size) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// ETag 由修改时间 (纳秒) 和文件大小组成, 文件内容变化时两者至少有一个会变
+void fill_file_info(struct file_info *fi, const char *path, const struct stat *st) {
+    const struct mime_type *mt = lookup_mime_type(path);
+    fi->mime_type = mt->type;
+    fi->encoding = NULL;
+    fi->vary = mt->compressible;
+    fi->size = st->st_size;
+    fi->mtime = st->st_mtim.tv_sec;
+    snprintf(fi->etag, sizeof(fi->etag), "\"%llx-%llx\"",
+             (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec,
+             (unsigned long long)st->st_size);
+    format_http_date(st->st_mtim.tv_sec, fi->last_modified, sizeof(fi->last_modified));
+}
+
+// If-None-Match 中的 ETag 列表按弱比较匹配 (忽略 W/ 前缀)
+int etag_list_match(const char *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '*') return 1;
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        size_t len = strcspn(p, ",");
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) len--;
+        if (len == etag_len && strncmp(p, etag, len) == 0) return 1;
+        p += strcspn(p, ",");
+    }
+    return 0;
+}
+
+// 客户端缓存的副本仍然有效时返回 1; 有 If-None-Match 时忽略 If-Modified-Since
+int not_modified(const struct http_request *req, const struct file_info *fi) {
+    char value[256];
+    if (find_header(req, "If-None-Match", value, sizeof(value))) {
+        return etag_list_match(value, fi->etag);
+    }
+    if (find_header(req, "If-Modified-Since", value, sizeof(value))) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return fi->mtime <= timegm(&tm);
+    }
+    return 0;
+}
+
+// 解析 "bytes=a-b, c-, -n" 形式的 Range 头。返回可满足的范围个数;
+// 0 表示语法无效或范围过多, 按完整内容响应; -1 表示所有范围都无法满足 (416)。
+int parse_range(const char *value, off_t size, struct byte_range *ranges) {
+    if (strncasecmp(value, "bytes=", 6) != 0) return 0;
+    const char *p = value + 6;
+    int count = 0, specs = 0;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t') p++;
+        char *end;
+        off_t start, last;
+        if (*p == '-') {
+            // 后缀形式: 最后 n 个字节
+            long long n = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || n < 0) return 0;
+            if (n == 0 || size == 0) goto next;
+            start = n >= size ? 0 : size - n;
+            last = size - 1;
+        } else {
+            long long a = strtoll(p, &end, 10);
+            if (end == p || a < 0 || *end != '-') return 0;
+            p = end + 1;
+            if (*p >= '0' && *p <= '9') {
+                long long b = strtoll(p, &end, 10);
+                if (b < a) return 0;
+                last = b;
+            } else {
+                end = (char *)p;
+                last = size - 1;
+            }
+            if (a >= size) goto next;
+            start = a;
+            if (last >= size) last = size - 1;
+        }
+        if (count == MAX_RANGES) return 0;
+        ranges[count].start = start;
+        ranges[count].end = last;
+        count++;
+next:
+        specs++;
+        p = end;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == ',') p++;
+        else if (*p != '\0') return 0;
+    }
+    if (specs == 0) return 0;
+    return count > 0 ? count : -1;
+}
+
+// If-Range 中的校验器与当前文件一致时才按 Range 响应, 否则客户端手里的部分内容已经过期
+int if_range_match(const struct http_request *req, const struct file_info *fi) {
+    char value[128];
+    if (!find_header(req, "If-Range", value, sizeof(value))) return 1;
+    if (value[0] == '"') return strcmp(value, fi->etag) == 0;
+    return strcmp(value, fi->last_modified) == 0;
+}
+
+// 根据条件请求头和 Range 头决定以 304、416、206 还是 200 响应, 206 时范围放在 ranges 中
+int select_entity(const struct http_request *req, const struct file_info *fi, struct byte_range *ranges,
+                  int *num_ranges) {
+    char value[512];
+    *num_ranges = 0;
+    if (not_modified(req, fi)) return 304;
+    if (find_header(req, "Range", value, sizeof(value)) && if_range_match(req, fi)) {
+        *num_ranges = parse_range(value, fi->size, ranges);
+    }
+    if (*num_ranges < 0) return 416;
+    return *num_ranges == 0 ? 200 : 206;
+}
+
+// 正文来自 c->entry (缓存命中) 或 c->file_fd, 由调用者事先设置。
+void send_entity(struct conn *c, const struct http_request *req, const struct file_info *fi) {
+    struct byte_range ranges[MAX_RANGES];
+    int num_ranges;
+
+    c->seg_cnt = c->seg_idx = 0;
+    c->status = select_entity(req, fi, ranges, &num_ranges);
+
+    if (c->status == 304) {
+        c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                              "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s"
+                              "Connection: %s\r\n\r\n",
+                              fi->etag, fi->last_modified, fi->vary ? "Vary: Accept-Encoding\r\n" : "",
+                              connection_header(c));
+        send_simple_response(c);
+        return;
+    }
+
+    if (c->status == 416) {
+        c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                              "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+                              "Content-Length: 0\r\n%sConnection: %s\r\n\r\n",
+                              (long long)fi->size, fi->vary ? "Vary: Accept-Encoding\r\n" : "",
+                              connection_header(c));
+        send_simple_response(c);
+        return;
+    }
+
+    if (num_ranges == 0) {
+        if (c->entry) {
+            // 缓存命中: 预生成的响应头、Connection 行和正文都在内存中, 一次 writev 即可发出
+            const char *line = connection_line(c);
+            add_mem_segment(c, c->entry->header, c->entry->header_len);
+            add_mem_segment(c, line, strlen(line));
+        } else {
+            c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                                  "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %lld\r\n%s"
+                                  "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n"
+                                  "Connection: %s\r\n\r\n",
+                                  fi->mime_type, (long long)fi->size, encoding_lines(fi), fi->etag,
+                                  fi->last_modified, connection_header(c));
+            add_mem_segment(c, c->out_buf, c->out_len);
+        }
+        add_body_segment(c, 0, fi->size);
+    } else if (num_ranges == 1) {
+        off_t len = ranges[0].end - ranges[0].start + 1;
+        c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                              "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+                              "Content-Range: bytes %lld-%lld/%lld\r\nContent-Length: %lld\r\n%s"
+                              "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n"
+                              "Connection: %s\r\n\r\n",
+                              fi->mime_type, (long long)ranges[0].start, (long long)ranges[0].end,
+                              (long long)fi->size, (long long)len, encoding_lines(fi), fi->etag,
+                              fi->last_modified, connection_header(c));
+        add_mem_segment(c, c->out_buf, c->out_len);
+        add_body_segment(c, ranges[0].start, len);
+    } else {
+        // multipart/byteranges: 每个范围前是一段分隔头, 正文片段仍然零拷贝
+        char boundary[32];
+        snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)hash_path(fi->etag) << 32 |
+                 (unsigned long long)(uintptr_t)c >> 4);
+        size_t part_cap = 192;
+        c->parts_buf = malloc(part_cap * (num_ranges + 1));
+        if (!c->parts_buf) {
+            c->keep_alive = 0;
+            c->state = CONN_DONE;
+            return;
+        }
+
+        // 先生成所有分隔头, 才能在响应头里给出准确的 Content-Length
+        off_t total = 0;
+        size_t part_len[MAX_RANGES + 1];
+        for (int i = 0; i < num_ranges; i++) {
+            part_len[i] = snprintf(c->parts_buf + i * part_cap, part_cap,
+                                   "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                   boundary, fi->mime_type, (long long)ranges[i].start,
+                                   (long long)ranges[i].end, (long long)fi->size);
+            total += part_len[i] + (ranges[i].end - ranges[i].start + 1);
+        }
+        part_len[num_ranges] = snprintf(c->parts_buf + num_ranges * part_cap, part_cap,
+                                        "\r\n--%s--\r\n", boundary);
+        total += part_len[num_ranges];
+
+        c->out_len = snprintf(c->out_buf, sizeof(c->out_buf),
+                              "HTTP/1.1 206 Partial Content\r\n"
+                              "Content-Type: multipart/byteranges; boundary=%s\r\nContent-Length: %lld\r\n%s"
+                              "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n"
+                              "Connection: %s\r\n\r\n",
+                              boundary, (long long)total, encoding_lines(fi), fi->etag, fi->last_modified,
+                              connection_header(c));
+        add_mem_segment(c, c->out_buf, c->out_len);
+        for (int i = 0; i < num_ranges; i++) {
+            add_mem_segment(c, c->parts_buf + i * part_cap, part_len[i]);
+            add_body_segment(c, ranges[i].start, ranges[i].end - ranges[i].start + 1);
+        }
+        add_mem_segment(c, c->parts_buf + num_ranges * part_cap, part_len[num_ranges]);
+    }
+    c->state = CONN_WRITE_RESPONSE;
+}
+
+// 客户端接受 gzip 时返回 1: "gzip" 或 "*" 出现在 Accept-Encoding 中且 q 值不为 0, 显式的 gzip 优先于 "*"
+int accepts_gzip(const struct http_request *req) {
+    char value[256];
+    int star = 0;
+    if (!find_header(req, "Accept-Encoding", value, sizeof(value))) return 0;
+    for (char *p = value; *p; ) {
+        p += strspn(p, " \t,");
+        size_t len = strcspn(p, " \t;,");
+        if (len == 0) break;
+        char *params = p + len;
+        size_t params_len = strcspn(params, ",");
+        int q_zero = 0;
+        char *q = strstr(params, "q=");
+        if (q && q < params + params_len) q_zero = strtod(q + 2, NULL) == 0;
+        if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) || (len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            return !q_zero;
+        }
+        if (len == 1 && *p == '*') star = !q_zero;
+        p = params + params_len;
+    }
+    return star;
+}
+
+// 查缓存或打开 path 指向的文件, 缓存键为 key。成功时 *entry (持有引用) 与 *file_fd 恰有一个有效
+int open_cached(const char *key, const char *path, const struct file_info *variant, struct cache_entry **entry,
+                int *file_fd, struct file_info *fi) {
+    struct stat file_stat;
+
+    if (cache_enabled) {
+        struct cache_entry *e = cache_lookup(key);
+        if (e) {
+            e->refcount++;
+            *entry = e;
+            *fi = e->info;
+            return 0;
+        }
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    fill_file_info(fi, path, &file_stat);
+    if (variant) {
+        // 压缩变体沿用原文件的类型; ETag 加上后缀, 与原文件的表示区分开
+        size_t n = strlen(fi->etag);
+        fi->mime_type = variant->mime_type;
+        fi->encoding = "gzip";
+        fi->vary = 1;
+        snprintf(fi->etag + n - 1, sizeof(fi->etag) - n + 1, "-gz\"");
+    }
+
+    if (cache_enabled) {
+        struct cache_entry *e = cache_insert(key, fd, fi);
+        if (e) {
+            close(fd);
+            e->refcount++;
+            *entry = e;
+            *fi = e->info;
+            return 0;
+        }
+    }
+
+    *file_fd = fd;
+    return 0;
+}
+
+// 查缓存或打开请求的文件, 得到正文来源和校验器。可压缩类型且客户端接受 gzip 时,
+// 优先使用不比原文件旧的 .gz 旁路文件 (由 precompress.sh 离线生成), 请求路径上不做任何压缩。
+// 没有可用旁路文件的结论记在原文件的缓存条目上, 之后的请求不再 stat。
+// 文件不存在或不是普通文件时返回 -1
+int open_entity(const char *local_path, const struct http_request *req, struct cache_entry **entry, int *file_fd,
+                struct file_info *fi) {
+    int no_sidecar = 0;
+    if (lookup_mime_type(local_path)->compressible && accepts_gzip(req)) {
+        char key[sizeof(WEB_ROOT) + MAX_PATH_LEN + 8], gz_path[sizeof(WEB_ROOT) + MAX_PATH_LEN + 4];
+        struct stat orig, side;
+        snprintf(key, sizeof(key), "%s" GZIP_KEY_SUFFIX, local_path);
+        snprintf(gz_path, sizeof(gz_path), "%s.gz", local_path);
+        struct cache_entry *e = cache_enabled ? cache_lookup(key) : NULL;
+        if (!e && cache_enabled) {
+            e = cache_lookup(local_path);
+            if (e && !e->no_gzip) e = NULL;
+        }
+        if (e) {
+            e->refcount++;
+            *entry = e;
+            *fi = e->info;
+            return 0;
+        }
+        if (stat(local_path, &orig) == 0 && S_ISREG(orig.st_mode) && stat(gz_path, &side) == 0 &&
+            (side.st_mtim.tv_sec > orig.st_mtim.tv_sec ||
+             (side.st_mtim.tv_sec == orig.st_mtim.tv_sec && side.st_mtim.tv_nsec >= orig.st_mtim.tv_nsec))) {
+            struct file_info variant;
+            variant.mime_type = lookup_mime_type(local_path)->type;
+            if (open_cached(key, gz_path, &variant, entry, file_fd, fi) == 0) return 0;
+        } else {
+            no_sidecar = 1;
+        }
+    }
+    if (open_cached(local_path, local_path, NULL, entry, file_fd, fi) < 0) return -1;
+    if (no_sidecar && *entry) (*entry)->no_gzip = 1;
+    return 0;
+}
+
+void send_file_response(struct conn *c, const char* local_path, const struct http_request *req) {
+    struct file_info fi;
+    if (open_entity(local_path, req, &c->entry, &c->file_fd, &fi) < 0) {
+        send_404(c);
+        return;
+    }
+    send_entity(c, req, &fi);
+}
+
+void conn_init(struct conn *c, int fd) {
+    c->fd = fd;
+    c->state = CONN_READ_REQUEST;
+    c->in_len = 0;
+    c->req_len = 0;
+    parser_reset(&c->parser);
+    c->keep_alive = 0;
+    c->status = 0;
+    c->timed = 0;
+    c->resp_bytes = 0;
+    c->out_len = 0;
+    c->parts_buf = NULL;
+    c->seg_cnt = 0;
+    c->seg_idx = 0;
+    c->entry = NULL;
+    c->file_fd = -1;
+    c->timer_kind = -1;
+    c->timer_mark = 0;
+    c->responses = 0;
+    c->sent_total = 0;
+    c->phase_start = 0;
+    c->timer.next = NULL;
+    c->timer.pprev = NULL;
+    c->h2 = NULL;
+}
+
+void conn_close(struct conn *c) {
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->file_fd = -1;
+    if (c->entry) cache_entry_put(c->entry);
+    c->entry = NULL;
+    free(c->parts_buf);
+    c->parts_buf = NULL;
+    h2_free(c->h2);
+    c->h2 = NULL;
+    close(c->fd);
+}
+
+int sv_eq(struct strview s, const char *lit) {
+    size_t len = strlen(lit);
+    return s.len == len && memcmp(s.p, lit, len) == 0;
+}
+
+// RFC 9110 中 token 允许的字符, 方法名和请求头名称都由它组成
+int is_tchar(unsigned char ch) {
+    if ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')) return 1;
+    return ch != '\0' && strchr("!#$%&'*+-.^_`|~", ch) != NULL;
+}
+
+void parser_reset(struct http_parser *p) {
+    p->state = PARSE_REQUEST_LINE;
+    p->pos = p->scan = 0;
+    p->error = 0;
+}
+
+// 请求行: method SP request-target [SP HTTP-version], 成功返回 0, 否则返回应答的状态码
+int parse_request_line(struct http_request *r, const char *line, size_t len) {
+    size_t i = 0;
+    while (i < len && is_tchar(line[i])) i++;
+    if (i == 0 || i == len || line[i] != ' ') return 400;
+    r->method.p = line;
+    r->method.len = i++;
+
+    size_t start = i;
+    while (i < len && line[i] > ' ' && line[i] != 0x7f) i++;
+    if (i == start) return 400;
+    r->target.p = line + start;
+    r->target.len = i - start;
+    if (r->target.len >= MAX_PATH_LEN) return 414;
+
+    r->version.p = line + len;
+    r->version.len = 0;
+    if (i == len) return 0;
+    if (line[i] != ' ') return 400;
+    i++;
+    r->version.p = line + i;
+    r->version.len = len - i;
+    const char *v = r->version.p;
+    if (r->version.len != 8 || memcmp(v, "HTTP/", 5) != 0 || v[6] != '.' ||
+        v[5] < '0' || v[5] > '9' || v[7] < '0' || v[7] > '9') {
+        return 400;
+    }
+    return v[5] == '1' ? 0 : 505;
+}
+
+// 请求头: field-name ":" OWS field-value OWS
+int parse_header_line(struct http_request *r, const char *line, size_t len) {
+    // 以空白开头的是已废弃的折行写法, 直接拒绝, 避免与前一行拼接时产生歧义
+    if (line[0] == ' ' || line[0] == '\t') return 400;
+    if (r->num_headers == MAX_HEADERS) return 431;
+
+    size_t i = 0;
+    while (i < len && is_tchar(line[i])) i++;
+    if (i == 0 || i == len || line[i] != ':') return 400;
+    struct http_header *h = &r->headers[r->num_headers++];
+    h->name.p = line;
+    h->name.len = i++;
+
+    while (i < len && (line[i] == ' ' || line[i] == '\t')) i++;
+    while (len > i && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+    h->value.p = line + i;
+    h->value.len = len - i;
+    if (memchr(h->value.p, '\0', h->value.len)) return 400;
+    return 0;
+}
+
+// 增量解析 buf 开头的请求。每次调用只处理上次之后新到的完整行, 得到的视图指向 buf 内部。
+// 请求头完整时返回 PARSE_DONE, 需要更多数据时返回 PARSE_INCOMPLETE,
+// 格式错误或超过 MAX_HEAD_SIZE / MAX_HEADERS 时返回 PARSE_ERROR, 状态码在 p->error 中。
+enum parse_result http_parse(struct http_parser *p, struct http_request *r, const char *buf, size_t len) {
+    while (1) {
+        size_t from = p->scan > p->pos ? p->scan : p->pos;
+        const char *nl = memchr(buf + from, '\n', len - from);
+        if (!nl) {
+            p->scan = len;
+            if (len >= MAX_HEAD_SIZE) {
+                p->error = p->state == PARSE_REQUEST_LINE ? 414 : 431;
+                return PARSE_ERROR;
+            }
+            return PARSE_INCOMPLETE;
+        }
+
+        const char *line = buf + p->pos;
+        size_t line_len = nl - line;
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+        p->pos = nl - buf + 1;
+
+        int status;
+        if (p->state == PARSE_REQUEST_LINE) {
+            // 请求之前多余的空行按 RFC 9112 忽略
+            if (line_len == 0) continue;
+            r->num_headers = 0;
+            status = parse_request_line(r, line, line_len);
+            p->state = PARSE_HEADERS;
+        } else if (line_len == 0) {
+            r->head_len = p->pos;
+            return PARSE_DONE;
+        } else {
+            status = parse_header_line(r, line, line_len);
+        }
+        if (status) {
+            p->error = status;
+            return PARSE_ERROR;
+        }
+    }
+}
+
+const struct strview *request_header(const struct http_request *req, const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < req->num_headers; i++) {
+        const struct strview *n = &req->headers[i].name;
+        if (n->len == name_len && strncasecmp(n->p, name, name_len) == 0) return &req->headers[i].value;
+    }
+    return NULL;
+}
+
+// 查找请求头 (名称不区分大小写), 找到时把值拷贝到 value, 过长的值被截断
+int find_header(const struct http_request *req, const char *name, char *value, size_t value_size) {
+    const struct strview *v = request_header(req, name);
+    if (!v) return 0;
+    size_t len = v->len < value_size - 1 ? v->len : value_size - 1;
+    memcpy(value, v->p, len);
+    value[len] = '\0';
+    return 1;
+}
+
+// 解析器微基准: 每个样例请求先整块解析, 再按 TCP 分段的方式分几次喂给解析器,
+// 各重复 iterations 次, 报告每秒解析的请求数和每个请求的耗时
+void run_parser_bench(long iterations) {
+    static const char *samples[][2] = {
+        { "最小请求", "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n" },
+        { "curl", "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent: curl/7.88.1\r\n"
+                  "Accept: */*\r\n\r\n" },
+        { "浏览器", "GET /static/js/app.min.js?v=20240101 HTTP/1.1\r\nHost: www.example.com\r\n"
+                    "Connection: keep-alive\r\nsec-ch-ua: \"Chromium\";v=\"120\", \"Not?A_Brand\";v=\"8\"\r\n"
+                    "sec-ch-ua-mobile: ?0\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+                    "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\nsec-ch-ua-platform: \"Linux\"\r\n"
+                    "Accept: */*\r\nSec-Fetch-Site: same-origin\r\nSec-Fetch-Mode: no-cors\r\n"
+                    "Sec-Fetch-Dest: script\r\nReferer: https://www.example.com/index.html\r\n"
+                    "Accept-Encoding: gzip, deflate, br\r\nAccept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+                    "If-None-Match: \"17a3c0e1f2b4d5c6-1f40\"\r\n"
+                    "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n\r\n" },
+    };
+    struct http_parser p;
+    struct http_request r;
+    size_t checksum = 0;
+
+    printf("请求解析器基准 (每项 %ld 次)\n", iterations);
+    for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); s++) {
+        const char *buf = samples[s][1];
+        size_t len = strlen(buf);
+        for (int split = 0; split < 2; split++) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            for (long i = 0; i < iterations; i++) {
+                parser_reset(&p);
+                enum parse_result res;
+                if (split) {
+                    // 分三段到达, 中间两次返回 PARSE_INCOMPLETE
+                    http_parse(&p, &r, buf, len / 3);
+                    http_parse(&p, &r, buf, len * 2 / 3);
+                }
+                res = http_parse(&p, &r, buf, len);
+                if (res != PARSE_DONE) {
+                    fprintf(stderr, "样例 %s 解析失败\n", samples[s][0]);
+                    exit(1);
+                }
+                checksum += r.num_headers + r.target.len;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            double sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+            printf("  %12.0f 请求/秒 %8.1f ns/请求 %8.1f MB/s  %s, %zu 字节, %d 个头, %s\n",
+                   iterations / sec, sec * 1e9 / iterations, len * (double)iterations / sec / 1e6,
+                   samples[s][0], len, r.num_headers, split ? "分三段到达" : "整块到达");
+        }
+    }
+    // 防止编译器把解析循环整个优化掉
+    if (checksum == 0) printf("\n");
+}
+
+// HTTP/1.1 默认保持连接, HTTP/1.0 默认关闭, Connection 头可以覆盖默认值
+int want_keep_alive(const struct http_request *req) {
+    char value[128];
+    int keep_alive = sv_eq(req->version, "HTTP/1.1");
+    if (find_header(req, "Connection", value, sizeof(value))) {
+        if (strcasestr(value, "close")) keep_alive = 0;
+        else if (strcasestr(value, "keep-alive")) keep_alive = 1;
+    }
+    return keep_alive;
+}
+
+// 规范化请求路径, 使同一个文件只对应一个缓存键: 去掉查询串, 合并重复的 '/',
+// 去掉 "." 段。含有 ".." 段的路径会逃出 WEB_ROOT, 返回 -1 拒绝。
+int normalize_path(char *path) {
+    path[strcspn(path, "?#")] = '\0';
+    if (path[0] != '/') return -1;
+
+    char *src = path, *dst = path;
+    while (*src) {
+        while (*src == '/') src++;
+        size_t seg = strcspn(src, "/");
+        if (seg == 0) break;
+        if (seg == 1 && src[0] == '.') {
+            src += seg;
+            continue;
+        }
+        if (seg == 2 && src[0] == '.' && src[1] == '.') return -1;
+        *dst++ = '/';
+        memmove(dst, src, seg);
+        dst += seg;
+        src += seg;
+    }
+    // 保留末尾的 '/', "/" 本身也由此得到
+    if (dst == path || src[-1] == '/') *dst++ = '/';
+    *dst = '\0';
+    return 0;
+}
+
+// 把请求目标映射为 WEB_ROOT 下的文件路径, /metrics 和无法映射的路径单独返回
+int map_request_path(struct strview target, char *local_path, size_t size) {
+    char path[MAX_PATH_LEN];
+    if (target.len >= sizeof(path)) return ROUTE_NOT_FOUND;
+    memcpy(path, target.p, target.len);
+    path[target.len] = '\0';
+    if (normalize_path(path) < 0) return ROUTE_NOT_FOUND;
+    if (strcmp(path, "/metrics") == 0) return ROUTE_METRICS;
+    if (strcmp(path, "/") == 0) strcpy(path, "/index.html");
+    snprintf(local_path, size, "%s%s", WEB_ROOT, path);
+    return ROUTE_FILE;
+}
+
+// 解析缓冲区开头的请求, 请求头完整到达后准备响应; 返回 0 表示还需要更多数据
+int process_request(struct conn *c) {
+    struct http_request *req = &c->req;
+    // 连接上的第一批字节是 HTTP/2 连接前言 (或其前缀) 时按 h2c prior knowledge 处理
+    if (c->responses == 0 && c->in_len > 0 && c->in_buf[0] == 'P') {
+        size_t n = c->in_len < H2_PREFACE_LEN ? c->in_len : H2_PREFACE_LEN;
+        if (memcmp(c->in_buf, H2_PREFACE, n) == 0) return n == H2_PREFACE_LEN ? h2_start(c) : 0;
+    }
+    // 读时间戳计数器每次约十几纳秒, 每个请求要读四次; 抽样记录阶段耗时, 把开销控制在 1% 以内
+    int timed = (my_stats->requests & PHASE_SAMPLE_MASK) == 0;
+    uint64_t t_parse = timed ? cycles_now() : 0;
+    enum parse_result res = http_parse(&c->parser, req, c->in_buf, c->in_len);
+    if (res == PARSE_INCOMPLETE) return 0;
+    uint64_t t_open = timed ? cycles_now() : 0;
+    stat_add(&my_stats->requests, 1);
+    if (my_log_ring) c->t_request = timed ? t_open : cycles_now();
+    c->timed = timed;
+    if (timed) record_phase(PHASE_PARSE, t_parse, t_open);
+    c->t_send = t_open;
+
+    if (res == PARSE_ERROR) {
+        c->req_len = c->in_len;
+        send_error(c, c->parser.error);
+        return 1;
+    }
+    c->req_len = req->head_len;
+
+    if (sv_eq(req->method, "GET")) {
+        char local_path[sizeof(WEB_ROOT) + MAX_PATH_LEN];
+        c->keep_alive = want_keep_alive(req);
+        if (request_header(req, "HTTP2-Settings") && h2_upgrade(c) == 0) return 1;
+        int route = map_request_path(req->target, local_path, sizeof(local_path));
+        if (route == ROUTE_NOT_FOUND) {
+            send_404(c);
+            return 1;
+        }
+        if (route == ROUTE_METRICS) {
+            send_metrics(c);
+            return 1;
+        }
+        send_file_response(c, local_path, req);
+        if (timed) {
+            c->t_send = cycles_now();
+            record_phase(PHASE_OPEN, t_open, c->t_send);
+        }
+    } else {
+        // 非 GET 请求不作应答, 直接关闭连接
+        c->keep_alive = 0;
+        c->state = CONN_DONE;
+    }
+    return 1;
+}
+
+// 一个响应发送完毕: 丢弃已处理的请求, 长连接则回到读取状态继续处理缓冲区中的后续请求
+void finish_response(struct conn *c) {
+    if (c->timed) record_phase(PHASE_SEND, c->t_send, cycles_now());
+    if (c->status > 0 && c->status < MAX_STATUS) stat_add(&my_stats->status[c->status], 1);
+    if (my_log_ring) access_log_record(c);
+    c->status = 0;
+    c->resp_bytes = 0;
+    c->responses++;
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->file_fd = -1;
+    c->out_len = 0;
+    c->seg_cnt = c->seg_idx = 0;
+    if (c->entry) cache_entry_put(c->entry);
+    c->entry = NULL;
+    free(c->parts_buf);
+    c->parts_buf = NULL;
+
+    c->in_len -= c->req_len;
+    memmove(c->in_buf, c->in_buf + c->req_len, c->in_len);
+    c->req_len = 0;
+    parser_reset(&c->parser);
+    c->state = c->keep_alive ? CONN_READ_REQUEST : CONN_DONE;
+}
+
+// 短写之后跳过已发出的 n 个字节, 下次从断点继续
+void segments_advance(struct conn *c, size_t n) {
+    stat_add(&my_stats->bytes_sent, n);
+    c->resp_bytes += n;
+    c->sent_total += n;
+    while (n > 0 && c->seg_idx < c->seg_cnt) {
+        struct segment *seg = &c->segs[c->seg_idx];
+        if (n < seg->len) {
+            if (seg->mem) seg->mem += n;
+            else seg->off += n;
+            seg->len -= n;
+            return;
+        }
+        n -= seg->len;
+        c->seg_idx++;
+    }
+}
+
+// ---------------- HTTP/2 (h2c) ----------------
+// 明文 HTTP/2: 支持 prior knowledge 和 HTTP/1.1 Upgrade 两种方式进入。一个连接上的多个流共用
+// 与 HTTP/1 相同的文件缓存和条件请求逻辑, 正文按流量控制窗口切成 DATA 帧轮转发送。
+// 不支持服务器推送和优先级调度, 请求正文被丢弃。
+
+// RFC 7541 附录 B 的 Huffman 编码: 每个符号的码字和位数, 第 256 个是 EOS。
+// 码字是规范 Huffman 码 (按位数、再按符号值依次分配), 解码只需每种长度的首个码字
+const uint32_t hpack_huff_code[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+const uint8_t hpack_huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// RFC 7541 附录 A 的静态表, 下标从 1 开始
+const struct hpack_field hpack_static[HPACK_STATIC_ENTRIES + 1] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// 规范 Huffman 码的解码表: 每种码长的首个码字、码字个数和在 huff_sym 中的起点
+uint32_t huff_first[31];
+uint16_t huff_count[31];
+uint16_t huff_offset[31];
+uint16_t huff_sym[257];
+
+void hpack_huff_init(void) {
+    int n = 0;
+    for (int len = 1; len <= 30; len++) {
+        huff_offset[len] = n;
+        huff_count[len] = 0;
+        for (int s = 0; s < 257; s++) {
+            if (hpack_huff_len[s] != len) continue;
+            huff_sym[n++] = s;
+            huff_count[len]++;
+        }
+        huff_first[len] = huff_count[len] ? hpack_huff_code[huff_sym[huff_offset[len]]] : 0;
+    }
+}
+
+// 逐位累积码字, 累积到的码字落在某个长度的码字区间内时即得到一个符号。
+// 末尾不足一个码字的填充必须是不超过 7 位的全 1 (EOS 的前缀), 返回解码出的字节数, 出错返回 -1
+int hpack_huff_decode(const uint8_t *src, size_t len, char *dst, size_t cap) {
+    uint32_t code = 0;
+    int bits = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = code << 1 | ((src[i] >> b) & 1);
+            bits++;
+            if (code - huff_first[bits] < huff_count[bits]) {
+                int sym = huff_sym[huff_offset[bits] + code - huff_first[bits]];
+                if (sym == 256 || out == cap) return -1;
+                dst[out++] = sym;
+                code = 0;
+                bits = 0;
+            } else if (bits == 30) {
+                return -1;
+            }
+        }
+    }
+    if (bits > 7 || code != (1u << bits) - 1) return -1;
+    return out;
+}
+
+// 解码 HPACK 整数 (RFC 7541 5.1), prefix 是第一个字节中的前缀位数; 调用者保证 p < end
+const uint8_t *hpack_decode_int(const uint8_t *p, const uint8_t *end, int prefix, uint32_t *value) {
+    uint32_t max = (1u << prefix) - 1;
+    uint32_t v = *p++ & max;
+    if (v < max) {
+        *value = v;
+        return p;
+    }
+    // 最多接受 4 个续字节, 足以表示任何合法的长度和下标
+    for (int shift = 0; p < end && shift <= 21; shift += 7) {
+        uint8_t b = *p++;
+        v += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+size_t hpack_encode_int(uint8_t *dst, uint32_t v, int prefix, uint8_t flags) {
+    uint32_t max = (1u << prefix) - 1;
+    if (v < max) {
+        dst[0] = flags | v;
+        return 1;
+    }
+    size_t n = 1;
+    dst[0] = flags | max;
+    v -= max;
+    while (v >= 128) {
+        dst[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = v;
+    return n;
+}
+
+// 字符串字面量: Huffman 编码更短时用 Huffman, 否则原样写入
+size_t hpack_encode_string(uint8_t *dst, const char *s, size_t len) {
+    size_t bits = 0;
+    for (size_t i = 0; i < len; i++) bits += hpack_huff_len[(uint8_t)s[i]];
+    size_t huff_len = (bits + 7) / 8;
+    if (huff_len >= len) {
+        size_t n = hpack_encode_int(dst, len, 7, 0);
+        memcpy(dst + n, s, len);
+        return n + len;
+    }
+    size_t n = hpack_encode_int(dst, huff_len, 7, 0x80);
+    uint8_t *q = dst + n;
+    uint64_t acc = 0;
+    int nbits = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t ch = s[i];
+        acc = acc << hpack_huff_len[ch] | hpack_huff_code[ch];
+        nbits += hpack_huff_len[ch];
+        while (nbits >= 8) {
+            nbits -= 8;
+            *q++ = acc >> nbits;
+        }
+    }
+    if (nbits) *q++ = (uint8_t)(acc << (8 - nbits)) | (0xff >> nbits);
+    return n + huff_len;
+}
+
+// 解码一个字符串字面量, 结果追加到 buf (容量 cap, 已用 *used) 中
+const uint8_t *hpack_decode_string(const uint8_t *p, const uint8_t *end, char *buf, size_t cap, size_t *used,
+                                   struct strview *out) {
+    if (p >= end) return NULL;
+    int huffman = *p & 0x80;
+    uint32_t len;
+    p = hpack_decode_int(p, end, 7, &len);
+    if (!p || len > (size_t)(end - p)) return NULL;
+    char *dst = buf + *used;
+    if (huffman) {
+        int n = hpack_huff_decode(p, len, dst, cap - *used);
+        if (n < 0) return NULL;
+        out->len = n;
+    } else {
+        if (len > cap - *used) return NULL;
+        memcpy(dst, p, len);
+        out->len = len;
+    }
+    out->p = dst;
+    *used += out->len;
+    return p + len;
+}
+
+void hpack_table_init(struct hpack_table *t) {
+    t->first = 0;
+    t->count = 0;
+    t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_table_evict(struct hpack_table *t) {
+    struct hpack_entry *e = &t->ents[(t->first + t->count - 1) % HPACK_MAX_ENTRIES];
+    t->size -= e->name_len + e->value_len + 32;
+    free(e->name);
+    t->count--;
+}
+
+void hpack_table_resize(struct hpack_table *t, size_t max_size) {
+    t->max_size = max_size;
+    while (t->count && t->size > t->max_size) hpack_table_evict(t);
+}
+
+void hpack_table_clear(struct hpack_table *t) {
+    while (t->count) hpack_table_evict(t);
+}
+
+// 插入新条目前先淘汰最旧的条目腾出空间; 比整张表还大的条目使表清空且不插入 (RFC 7541 4.4)
+void hpack_table_add(struct hpack_table *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    while (t->count && (t->size + size > t->max_size || t->count == HPACK_MAX_ENTRIES)) hpack_table_evict(t);
+    if (size > t->max_size) return;
+    char *mem = malloc(name_len + value_len + 1);
+    if (!mem) return;
+    memcpy(mem, name, name_len);
+    memcpy(mem + name_len, value, value_len);
+    t->first = (t->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    struct hpack_entry *e = &t->ents[t->first];
+    e->name = mem;
+    e->value = mem + name_len;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    t->count++;
+    t->size += size;
+}
+
+// 按下标取出静态表或动态表中的条目, 下标无效返回 -1
+int hpack_lookup(const struct hpack_table *t, uint32_t index, struct strview *name, struct strview *value) {
+    if (index == 0) return -1;
+    if (index <= HPACK_STATIC_ENTRIES) {
+        name->p = hpack_static[index].name;
+        name->len = strlen(name->p);
+        value->p = hpack_static[index].value;
+        value->len = strlen(value->p);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= (uint32_t)t->count) return -1;
+    const struct hpack_entry *e = &t->ents[(t->first + index) % HPACK_MAX_ENTRIES];
+    name->p = e->name;
+    name->len = e->name_len;
+    value->p = e->value;
+    value->len = e->value_len;
+    return 0;
+}
+
+// 从表里取出的名字和值也拷贝进 buf: 同一个头部块中后面的插入可能淘汰它们所在的条目
+int hpack_copy(struct strview *s, char *buf, size_t cap, size_t *used) {
+    if (s->len > cap - *used) return -1;
+    memcpy(buf + *used, s->p, s->len);
+    s->p = buf + *used;
+    *used += s->len;
+    return 0;
+}
+
+// 一个请求的伪头部, 其余头部放进 struct http_request, 与 HTTP/1 请求共用查找和校验函数
+struct h2_pseudo {
+    struct strview method;
+    struct strview scheme;
+    struct strview path;
+    struct strview authority;
+    int malformed;
+    int too_many;
+};
+
+void h2_add_field(struct http_request *req, struct h2_pseudo *ps, struct strview name, struct strview value) {
+    if (name.len > 0 && name.p[0] == ':') {
+        struct strview *dst = NULL;
+        if (sv_eq(name, ":method")) dst = &ps->method;
+        else if (sv_eq(name, ":scheme")) dst = &ps->scheme;
+        else if (sv_eq(name, ":path")) dst = &ps->path;
+        else if (sv_eq(name, ":authority")) dst = &ps->authority;
+        // 伪头部必须在普通头部之前, 且每个只能出现一次
+        if (!dst || dst->p || req->num_headers > 0) ps->malformed = 1;
+        else *dst = value;
+        return;
+    }
+    if (req->num_headers == MAX_HEADERS) {
+        ps->too_many = 1;
+        return;
+    }
+    req->headers[req->num_headers].name = name;
+    req->headers[req->num_headers].value = value;
+    req->num_headers++;
+}
+
+// 解码一个完整的头部块, 字符串都放在 buf 中。头部过多时仍然解码完整个块, 动态表才能与对端保持同步。
+// 返回 -1 表示压缩错误, 此时动态表状态已不可信, 连接必须关闭
+int hpack_decode_block(struct hpack_table *t, const uint8_t *p, size_t len, struct http_request *req,
+                       struct h2_pseudo *ps, char *buf, size_t cap) {
+    const uint8_t *end = p + len;
+    size_t used = 0;
+    int fields = 0;
+    memset(ps, 0, sizeof(*ps));
+    memset(req, 0, sizeof(*req));
+    while (p < end) {
+        struct strview name, value;
+        uint32_t index;
+        uint8_t b = *p;
+        if (b & 0x80) {
+            // 已索引的头部
+            p = hpack_decode_int(p, end, 7, &index);
+            if (!p || hpack_lookup(t, index, &name, &value) < 0) return -1;
+            if (hpack_copy(&name, buf, cap, &used) < 0 || hpack_copy(&value, buf, cap, &used) < 0) return -1;
+        } else if ((b & 0xe0) == 0x20) {
+            // 动态表大小更新, 只能出现在头部块开头
+            p = hpack_decode_int(p, end, 5, &index);
+            if (!p || index > HPACK_TABLE_SIZE || fields > 0) return -1;
+            hpack_table_resize(t, index);
+            continue;
+        } else {
+            // 字面量: 带增量索引 (01), 不索引 (0000) 或永不索引 (0001)
+            int incremental = b & 0x40;
+            p = hpack_decode_int(p, end, incremental ? 6 : 4, &index);
+            if (!p) return -1;
+            if (index) {
+                struct strview unused;
+                if (hpack_lookup(t, index, &name, &unused) < 0) return -1;
+                if (hpack_copy(&name, buf, cap, &used) < 0) return -1;
+            } else {
+                p = hpack_decode_string(p, end, buf, cap, &used, &name);
+                if (!p) return -1;
+            }
+            p = hpack_decode_string(p, end, buf, cap, &used, &value);
+            if (!p) return -1;
+            if (incremental) hpack_table_add(t, name.p, name.len, value.p, value.len);
+        }
+        fields++;
+        h2_add_field(req, ps, name, value);
+    }
+    return 0;
+}
+
+// 响应头: 名字取自静态表; index 为 1 的值插入动态表, 同一连接上的后续响应只需一个字节
+struct h2_field {
+    int name;
+    const char *value;
+    int index;
+};
+
+size_t hpack_encode_field(struct hpack_table *t, uint8_t *dst, const struct h2_field *f) {
+    const char *name = hpack_static[f->name].name;
+    size_t name_len = strlen(name), value_len = strlen(f->value);
+    for (int k = 0; k < t->count; k++) {
+        const struct hpack_entry *e = &t->ents[(t->first + k) % HPACK_MAX_ENTRIES];
+        if (e->name_len == name_len && e->value_len == value_len && memcmp(e->name, name, name_len) == 0 &&
+            memcmp(e->value, f->value, value_len) == 0) {
+            return hpack_encode_int(dst, HPACK_STATIC_ENTRIES + 1 + k, 7, 0x80);
+        }
+    }
+    size_t n = f->index ? hpack_encode_int(dst, f->name, 6, 0x40) : hpack_encode_int(dst, f->name, 4, 0);
+    n += hpack_encode_string(dst + n, f->value, value_len);
+    if (f->index) hpack_table_add(t, name, name_len, f->value, value_len);
+    return n;
+}
+
+// 常见状态码在静态表中, 一个字节即可表示
+size_t hpack_encode_status(uint8_t *dst, int status) {
+    switch (status) {
+        case 200: return hpack_encode_int(dst, 8, 7, 0x80);
+        case 204: return hpack_encode_int(dst, 9, 7, 0x80);
+        case 206: return hpack_encode_int(dst, 10, 7, 0x80);
+        case 304: return hpack_encode_int(dst, 11, 7, 0x80);
+        case 400: return hpack_encode_int(dst, 12, 7, 0x80);
+        case 404: return hpack_encode_int(dst, 13, 7, 0x80);
+        case 500: return hpack_encode_int(dst, 14, 7, 0x80);
+    }
+    char value[8];
+    snprintf(value, sizeof(value), "%d", status);
+    size_t n = hpack_encode_int(dst, 8, 4, 0);
+    return n + hpack_encode_string(dst + n, value, strlen(value));
+}
+
+uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// 在输出缓冲区末尾写帧头, 返回帧负载的位置; 调用者保证空间足够
+uint8_t *h2_frame(struct h2_conn *h2, size_t len, int type, int flags, uint32_t stream) {
+    uint8_t *f = (uint8_t *)h2->out + h2->out_len;
+    f[0] = len >> 16;
+    f[1] = len >> 8;
+    f[2] = len;
+    f[3] = type;
+    f[4] = flags;
+    put_be32(f + 5, stream);
+    h2->out_len += H2_FRAME_HEADER + len;
+    return f + H2_FRAME_HEADER;
+}
+
+// 服务器的连接前言: 只声明并发流上限, 其余参数用默认值
+void h2_send_settings(struct h2_conn *h2) {
+    uint8_t *p = h2_frame(h2, 6, H2_SETTINGS, 0, 0);
+    p[0] = 0;
+    p[1] = 3;   // SETTINGS_MAX_CONCURRENT_STREAMS
+    put_be32(p + 2, H2_MAX_STREAMS);
+}
+
+void h2_send_rst(struct h2_conn *h2, uint32_t stream, int code) {
+    put_be32(h2_frame(h2, 4, H2_RST_STREAM, 0, stream), code);
+}
+
+void h2_send_window_update(struct h2_conn *h2, uint32_t stream, uint32_t increment) {
+    put_be32(h2_frame(h2, 4, H2_WINDOW_UPDATE, 0, stream), increment);
+}
+
+// 连接错误: 告诉对端处理到了哪个流, 发完 GOAWAY 后关闭连接
+void h2_goaway(struct h2_conn *h2, int code) {
+    uint8_t *p = h2_frame(h2, 8, H2_GOAWAY, 0, 0);
+    put_be32(p, h2->last_stream_id);
+    put_be32(p + 4, code);
+    h2->closing = 1;
+}
+
+struct h2_conn *h2_new(void) {
+    struct h2_conn *h2 = malloc(sizeof(*h2));
+    if (!h2) return NULL;
+    h2->preface_pending = 1;
+    h2->closing = 0;
+    h2->peer_goaway = 0;
+    h2->last_stream_id = 0;
+    h2->peer_max_frame = H2_MAX_FRAME;
+    h2->peer_initial_window = H2_DEFAULT_WINDOW;
+    h2->send_window = H2_DEFAULT_WINDOW;
+    h2->num_streams = 0;
+    h2->rr = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) h2->streams[i].id = 0;
+    h2->hdr_stream = 0;
+    h2->hdr_len = 0;
+    hpack_table_init(&h2->dec);
+    hpack_table_init(&h2->enc);
+    h2->enc_resize = 0;
+    h2->in_len = 0;
+    h2->out_len = 0;
+    return h2;
+}
+
+struct h2_stream *h2_stream_find(struct h2_conn *h2, uint32_t id) {
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id == id) return &h2->streams[i];
+    }
+    return NULL;
+}
+
+struct h2_stream *h2_stream_new(struct h2_conn *h2, uint32_t id) {
+    struct h2_stream *s = h2_stream_find(h2, 0);
+    s->id = id;
+    s->send_window = h2->peer_initial_window;
+    s->remote_closed = 0;
+    s->status = 0;
+    s->mem = NULL;
+    s->owned = NULL;
+    s->entry = NULL;
+    s->file_fd = -1;
+    s->off = 0;
+    s->remaining = 0;
+    s->bytes = 0;
+    s->t_request = 0;
+    strcpy(s->method, "-");
+    strcpy(s->path, "-");
+    h2->num_streams++;
+    return s;
+}
+
+void h2_stream_release(struct h2_conn *h2, struct h2_stream *s) {
+    if (s->entry) cache_entry_put(s->entry);
+    if (s->file_fd >= 0) close(s->file_fd);
+    free(s->owned);
+    s->id = 0;
+    h2->num_streams--;
+}
+
+// 流上的响应已全部发出: 与 finish_response 一样计入统计和访问日志
+void h2_stream_finish(struct conn *c, struct h2_stream *s) {
+    if (s->status > 0 && s->status < MAX_STATUS) stat_add(&my_stats->status[s->status], 1);
+    if (my_log_ring) {
+        struct strview method = { s->method, strlen(s->method) }, path = { s->path, strlen(s->path) };
+        access_log_add(&c->peer, method, path, s->status, s->bytes, s->t_request);
+    }
+    c->responses++;
+    h2_stream_release(c->h2, s);
+}
+
+void h2_free(struct h2_conn *h2) {
+    if (!h2) return;
+    for (int i = 0; i < H2_MAX_STREAMS; i++) {
+        if (h2->streams[i].id) h2_stream_release(h2, &h2->streams[i]);
+    }
+    hpack_table_clear(&h2->dec);
+    hpack_table_clear(&h2->enc);
+    free(h2);
+}
+
+// 写出响应的 HEADERS 帧; 没有正文的响应带 END_STREAM, 流随即结束
+void h2_write_headers(struct conn *c, struct h2_stream *s, int status, const struct h2_field *fields, int n) {
+    struct h2_conn *h2 = c->h2;
+    uint8_t *start = (uint8_t *)h2->out + h2->out_len + H2_FRAME_HEADER;
+    uint8_t *p = start;
+    if (h2->enc_resize) {
+        p += hpack_encode_int(p, h2->enc.max_size, 5, 0x20);
+        h2->enc_resize = 0;
+    }
+    p += hpack_encode_status(p, status);
+    for (int i = 0; i < n; i++) p += hpack_encode_field(&h2->enc, p, &fields[i]);
+    s->status = status;
+    int end_stream = s->remaining == 0;
+    h2_frame(h2, p - start, H2_HEADERS, H2_FLAG_END_HEADERS | (end_stream ? H2_FLAG_END_STREAM : 0), s->id);
+    if (end_stream) h2_stream_finish(c, s);
+}
+
+// 错误页等短响应, body 为 NULL 时没有正文
+void h2_respond_simple(struct conn *c, struct h2_stream *s, int status, const char *body) {
+    char len_buf[24];
+    struct h2_field fields[3];
+    int n = 0;
+    s->mem = body;
+    s->remaining = body ? strlen(body) : 0;
+    snprintf(len_buf, sizeof(len_buf), "%lld", (long long)s->remaining);
+    if (body) fields[n++] = (struct h2_field){ HPACK_CONTENT_TYPE, "text/html", 1 };
+    if (status == 405) fields[n++] = (struct h2_field){ HPACK_ALLOW, "GET", 0 };
+    fields[n++] = (struct h2_field){ HPACK_CONTENT_LENGTH, len_buf, 0 };
+    h2_write_headers(c, s, status, fields, n);
+}
+
+// 与 HTTP/1 相同的路径映射、缓存和条件请求逻辑, 只是响应头用 HPACK 编码, 正文由 h2_pump 分帧发送。
+// 多个范围的请求按完整内容响应, HTTP/2 下没有实现 multipart/byteranges
+void h2_respond(struct conn *c, struct h2_stream *s, const struct http_request *req) {
+    char local_path[sizeof(WEB_ROOT) + MAX_PATH_LEN];
+    if (!sv_eq(req->method, "GET")) {
+        h2_respond_simple(c, s, 405, NULL);
+        return;
+    }
+    int route = map_request_path(req->target, local_path, sizeof(local_path));
+    if (route == ROUTE_NOT_FOUND) {
+        h2_respond_simple(c, s, 404, NOT_FOUND_BODY);
+        return;
+    }
+    if (route == ROUTE_METRICS) {
+        size_t len;
+        s->owned = render_metrics(&len);
+        if (!s->owned) {
+            h2_respond_simple(c, s, 500, NULL);
+            return;
+        }
+        char len_buf[24];
+        snprintf(len_buf, sizeof(len_buf), "%zu", len);
+        struct h2_field fields[] = {
+            { HPACK_CONTENT_TYPE, "text/plain; version=0.0.4; charset=utf-8", 1 },
+            { HPACK_CONTENT_LENGTH, len_buf, 0 },
+            { HPACK_CACHE_CONTROL, "no-cache", 1 },
+        };
+        s->mem = s->owned;
+        s->remaining = len;
+        h2_write_headers(c, s, 200, fields, 3);
+        return;
+    }
+
+    struct file_info fi;
+    if (open_entity(local_path, req, &s->entry, &s->file_fd, &fi) < 0) {
+        h2_respond_simple(c, s, 404, NOT_FOUND_BODY);
+        return;
+    }
+    if (s->entry) s->mem = s->entry->data;
+    struct byte_range ranges[MAX_RANGES];
+    int num_ranges;
+    int status = select_entity(req, &fi, ranges, &num_ranges);
+    char len_buf[24], range_buf[80];
+    struct h2_field fields[8];
+    int n = 0;
+    if (status == 304) {
+        fields[n++] = (struct h2_field){ HPACK_ETAG, fi.etag, 0 };
+        fields[n++] = (struct h2_field){ HPACK_LAST_MODIFIED, fi.last_modified, 0 };
+        if (fi.vary) fields[n++] = (struct h2_field){ HPACK_VARY, "accept-encoding", 1 };
+    } else if (status == 416) {
+        snprintf(range_buf, sizeof(range_buf), "bytes */%lld", (long long)fi.size);
+        fields[n++] = (struct h2_field){ HPACK_CONTENT_RANGE, range_buf, 0 };
+        fields[n++] = (struct h2_field){ HPACK_CONTENT_LENGTH, "0", 1 };
+        if (fi.vary) fields[n++] = (struct h2_field){ HPACK_VARY, "accept-encoding", 1 };
+    } else {
+        if (num_ranges > 1) status = 200;
+        if (status == 206) {
+            s->off = ranges[0].start;
+            s->remaining = ranges[0].end - ranges[0].start + 1;
+            snprintf(range_buf, sizeof(range_buf), "bytes %lld-%lld/%lld", (long long)ranges[0].start,
+                     (long long)ranges[0].end, (long long)fi.size);
+        } else {
+            s->remaining = fi.size;
+        }
+        snprintf(len_buf, sizeof(len_buf), "%lld", (long long)s->remaining);
+        fields[n++] = (struct h2_field){ HPACK_CONTENT_TYPE, fi.mime_type, 1 };
+        fields[n++] = (struct h2_field){ HPACK_CONTENT_LENGTH, len_buf, 0 };
+        if (status == 206) fields[n++] = (struct h2_field){ HPACK_CONTENT_RANGE, range_buf, 0 };
+        if (fi.encoding) fields[n++] = (struct h2_field){ HPACK_CONTENT_ENCODING, fi.encoding, 1 };
+        if (fi.vary) fields[n++] = (struct h2_field){ HPACK_VARY, "accept-encoding", 1 };
+        fields[n++] = (struct h2_field){ HPACK_ETAG, fi.etag, 0 };
+        fields[n++] = (struct h2_field){ HPACK_LAST_MODIFIED, fi.last_modified, 0 };
+        fields[n++] = (struct h2_field){ HPACK_ACCEPT_RANGES, "bytes", 1 };
+    }
+    h2_write_headers(c, s, status, fields, n);
+}
+
+// 新的请求流: 伪头部不完整或格式错误的请求用 RST_STREAM 拒绝 (RFC 7540 8.1.2)
+void h2_start_stream(struct conn *c, struct h2_stream *s, const struct http_request *req, const struct h2_pseudo *ps) {
+    stat_add(&my_stats->requests, 1);
+    if (my_log_ring) {
+        s->t_request = cycles_now();
+        size_t n = ps->method.len < sizeof(s->method) - 1 ? ps->method.len : sizeof(s->method) - 1;
+        memcpy(s->method, ps->method.p, n);
+        s->method[n] = '\0';
+        n = ps->path.len < sizeof(s->path) - 1 ? ps->path.len : sizeof(s->path) - 1;
+        memcpy(s->path, ps->path.p, n);
+        s->path[n] = '\0';
+    }
+    if (ps->malformed || !ps->method.len || !ps->scheme.len || !ps->path.len) {
+        h2_send_rst(c->h2, s->id, H2_PROTOCOL_ERROR);
+        h2_stream_release(c->h2, s);
+        return;
+    }
+    if (ps->too_many) {
+        h2_respond_simple(c, s, 431, NULL);
+        return;
+    }
+    struct http_request r = *req;
+    r.method = ps->method;
+    r.target = ps->path;
+    h2_respond(c, s, &r);
+}
+
+// 头部块接收完整: 解码 (保持动态表同步), 然后开始一个新流或忽略已有流上的尾部头部
+void h2_headers_complete(struct conn *c) {
+    struct h2_conn *h2 = c->h2;
+    static char strings[2 * H2_HEADER_BLOCK];
+    struct http_request req;
+    struct h2_pseudo ps;
+    uint32_t id = h2->hdr_stream;
+    h2->hdr_stream = 0;
+    if (hpack_decode_block(&h2->dec, (const uint8_t *)h2->hdr_block, h2->hdr_len, &req, &ps,
+                           strings, sizeof(strings)) < 0) {
+        h2_goaway(h2, H2_COMPRESSION_ERROR);
+        return;
+    }
+    struct h2_stream *s = h2_stream_find(h2, id);
+    if (s) {
+        if (h2->hdr_end_stream) s->remote_closed = 1;
+        return;
+    }
+    h2->last_stream_id = id;
+    if (h2->num_streams == H2_MAX_STREAMS) {
+        h2_send_rst(h2, id, H2_REFUSED_STREAM);
+        return;
+    }
+    s = h2_stream_new(h2, id);
+    s->remote_closed = h2->hdr_end_stream;
+    h2_start_stream(c, s, &req, &ps);
+}
+
+void h2_append_header_block(struct h2_conn *h2, const uint8_t *p, size_t len) {
+    if (h2->hdr_len + len > sizeof(h2->hdr_block)) {
+        h2_goaway(h2, H2_ENHANCE_YOUR_CALM);
+        return;
+    }
+    memcpy(h2->hdr_block + h2->hdr_len, p, len);
+    h2->hdr_len += len;
+}
+
+// 应用一组 SETTINGS 参数, 返回连接错误码, 0 表示成功
+int h2_apply_settings(struct h2_conn *h2, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        int id = p[i] << 8 | p[i + 1];
+        uint32_t v = get_be32(p + i + 2);
+        switch (id) {
+        case 1: {   // HEADER_TABLE_SIZE: 对端解码器的表大小, 只会把编码器的表调小
+            size_t size = v < HPACK_TABLE_SIZE ? v : HPACK_TABLE_SIZE;
+            if (size != h2->enc.max_size) {
+                hpack_table_resize(&h2->enc, size);
+                h2->enc_resize = 1;
+            }
+            break;
+        }
+        case 2:     // ENABLE_PUSH: 服务器从不推送, 只检查取值
+            if (v > 1) return H2_PROTOCOL_ERROR;
+            break;
+        case 4: {   // INITIAL_WINDOW_SIZE: 差值作用于所有已打开的流
+            if (v > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+            int64_t delta = (int64_t)v - h2->peer_initial_window;
+            for (int k = 0; k < H2_MAX_STREAMS; k++) {
+                struct h2_stream *s = &h2->streams[k];
+                if (!s->id) continue;
+                if (s->send_window + delta > H2_MAX_WINDOW) return H2_FLOW_CONTROL_ERROR;
+                s->send_window += delta;
+            }
+            h2->peer_initial_window = v;
+            break;
+        }
+        case 5:     // MAX_FRAME_SIZE
+            if (v < H2_MAX_FRAME || v > 0xffffff) return H2_PROTOCOL_ERROR;
+            h2->peer_max_frame = v;
+            break;
+        }
+    }
+    return 0;
+}
+
+// 处理一个完整的帧。连接错误发送 GOAWAY, 流错误发送 RST_STREAM; 未知类型的帧忽略
+void h2_handle_frame(struct conn *c, int type, int flags, uint32_t id, const uint8_t *p, size_t len) {
+    struct h2_conn *h2 = c->h2;
+    struct h2_stream *s;
+    if (h2->hdr_stream && (type != H2_CONTINUATION || id != h2->hdr_stream)) {
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+    switch (type) {
+    case H2_DATA: {
+        if (id == 0) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if ((flags & H2_FLAG_PADDED) && (len == 0 || p[0] >= len)) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        // 请求正文直接丢弃, 收到多少就归还多少接收窗口
+        if (len) h2_send_window_update(h2, 0, len);
+        s = h2_stream_find(h2, id);
+        if (!s || s->remote_closed) {
+            if (id > h2->last_stream_id) h2_goaway(h2, H2_PROTOCOL_ERROR);
+            else h2_send_rst(h2, id, H2_STREAM_CLOSED);
+            return;
+        }
+        if (flags & H2_FLAG_END_STREAM) s->remote_closed = 1;
+        else if (len) h2_send_window_update(h2, id, len);
+        return;
+    }
+    case H2_HEADERS: {
+        size_t off = 0, pad = 0;
+        if (id == 0 || !(id & 1)) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & H2_FLAG_PADDED) {
+            if (len == 0) {
+                h2_goaway(h2, H2_PROTOCOL_ERROR);
+                return;
+            }
+            pad = p[0];
+            off = 1;
+        }
+        if (flags & H2_FLAG_PRIORITY) off += 5;
+        if (off + pad > len) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (id <= h2->last_stream_id && !h2_stream_find(h2, id)) {
+            h2_goaway(h2, H2_STREAM_CLOSED);
+            return;
+        }
+        h2->hdr_stream = id;
+        h2->hdr_end_stream = flags & H2_FLAG_END_STREAM;
+        h2->hdr_len = 0;
+        h2_append_header_block(h2, p + off, len - off - pad);
+        if ((flags & H2_FLAG_END_HEADERS) && !h2->closing) h2_headers_complete(c);
+        return;
+    }
+    case H2_CONTINUATION:
+        if (!h2->hdr_stream) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        h2_append_header_block(h2, p, len);
+        if ((flags & H2_FLAG_END_HEADERS) && !h2->closing) h2_headers_complete(c);
+        return;
+    case H2_PRIORITY:
+        // 不按优先级调度, 所有流平等轮转
+        if (id == 0) h2_goaway(h2, H2_PROTOCOL_ERROR);
+        else if (len != 5) h2_send_rst(h2, id, H2_FRAME_SIZE_ERROR);
+        return;
+    case H2_RST_STREAM:
+        if (id == 0) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (len != 4) {
+            h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        s = h2_stream_find(h2, id);
+        if (s) h2_stream_release(h2, s);
+        else if (id > h2->last_stream_id) h2_goaway(h2, H2_PROTOCOL_ERROR);
+        return;
+    case H2_SETTINGS: {
+        if (id != 0) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if ((flags & H2_FLAG_ACK) ? len != 0 : len % 6 != 0) {
+            h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (flags & H2_FLAG_ACK) return;
+        int err = h2_apply_settings(h2, p, len);
+        if (err) {
+            h2_goaway(h2, err);
+            return;
+        }
+        h2_frame(h2, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        return;
+    }
+    case H2_PING:
+        if (id != 0) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (len != 8) {
+            h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!(flags & H2_FLAG_ACK)) memcpy(h2_frame(h2, 8, H2_PING, H2_FLAG_ACK, 0), p, 8);
+        return;
+    case H2_GOAWAY:
+        if (id != 0) {
+            h2_goaway(h2, H2_PROTOCOL_ERROR);
+            return;
+        }
+        h2->peer_goaway = 1;
+        return;
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) {
+            h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        uint32_t inc = get_be32(p) & 0x7fffffff;
+        if (id == 0) {
+            if (inc == 0) h2_goaway(h2, H2_PROTOCOL_ERROR);
+            else if ((int64_t)h2->send_window + inc > H2_MAX_WINDOW) h2_goaway(h2, H2_FLOW_CONTROL_ERROR);
+            else h2->send_window += inc;
+            return;
+        }
+        s = h2_stream_find(h2, id);
+        if (!s) return;
+        if (inc == 0 || (int64_t)s->send_window + inc > H2_MAX_WINDOW) {
+            h2_send_rst(h2, id, inc == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            h2_stream_release(h2, s);
+            return;
+        }
+        s->send_window += inc;
+        return;
+    }
+    case H2_PUSH_PROMISE:
+        h2_goaway(h2, H2_PROTOCOL_ERROR);
+        return;
+    }
+}
+
+// 在连接窗口和各流窗口允许的范围内, 把各流的正文轮流切成 DATA 帧填进输出缓冲区,
+// 一个大文件不会让同一连接上的其他流一直等待
+void h2_pump(struct conn *c) {
+    struct h2_conn *h2 = c->h2;
+    int progress = 1;
+    // Upgrade 之后先等到客户端的连接前言再发正文: 有的客户端在切换协议之前只能缓存很少的数据
+    if (h2->preface_pending) return;
+    while (progress && h2->send_window > 0) {
+        progress = 0;
+        for (int k = 0; k < H2_MAX_STREAMS && h2->send_window > 0; k++) {
+            struct h2_stream *s = &h2->streams[(h2->rr + k) % H2_MAX_STREAMS];
+            if (!s->id || s->remaining == 0 || s->send_window <= 0) continue;
+            size_t room = H2_OUT_SIZE - h2->out_len;
+            if (room <= H2_FRAME_HEADER) return;
+            size_t n = room - H2_FRAME_HEADER;
+            if ((off_t)n > s->remaining) n = s->remaining;
+            if (n > h2->peer_max_frame) n = h2->peer_max_frame;
+            if (n > (size_t)s->send_window) n = s->send_window;
+            if (n > (size_t)h2->send_window) n = h2->send_window;
+            char *payload = h2->out + h2->out_len + H2_FRAME_HEADER;
+            if (s->mem) {
+                memcpy(payload, s->mem + s->off, n);
+            } else {
+                ssize_t got = pread(s->file_fd, payload, n, s->off);
+                if (got <= 0) {
+                    // 文件在发送过程中被截断, 已无法兑现 content-length
+                    h2_send_rst(h2, s->id, H2_INTERNAL_ERROR);
+                    h2_stream_release(h2, s);
+                    continue;
+                }
+                n = got;
+            }
+            s->off += n;
+            s->remaining -= n;
+            s->send_window -= n;
+            s->bytes += n;
+            h2->send_window -= n;
+            h2_frame(h2, n, H2_DATA, s->remaining == 0 ? H2_FLAG_END_STREAM : 0, s->id);
+            if (s->remaining == 0) h2_stream_finish(c, s);
+            progress = 1;
+        }
+        h2->rr = (h2->rr + 1) % H2_MAX_STREAMS;
+    }
+}
+
+// 处理 in 中的完整帧并填充输出。有数据要发送时切换到发送状态返回 1, 需要更多输入时返回 0
+int h2_process(struct conn *c) {
+    struct h2_conn *h2 = c->h2;
+    size_t pos = 0;
+    while (!h2->closing) {
+        size_t avail = h2->in_len - pos;
+        if (h2->preface_pending) {
+            size_t n = avail < H2_PREFACE_LEN ? avail : H2_PREFACE_LEN;
+            if (memcmp(h2->in + pos, H2_PREFACE, n) != 0) {
+                h2_goaway(h2, H2_PROTOCOL_ERROR);
+                break;
+            }
+            if (n < H2_PREFACE_LEN) break;
+            pos += H2_PREFACE_LEN;
+            h2->preface_pending = 0;
+            continue;
+        }
+        if (avail < H2_FRAME_HEADER || H2_OUT_SIZE - h2->out_len < H2_OUT_RESERVE) break;
+        const uint8_t *f = (const uint8_t *)h2->in + pos;
+        size_t len = (size_t)f[0] << 16 | f[1] << 8 | f[2];
+        if (len > H2_MAX_FRAME) {
+            h2_goaway(h2, H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (avail < H2_FRAME_HEADER + len) break;
+        h2_handle_frame(c, f[3], f[4], get_be32(f + 5) & 0x7fffffff, f + H2_FRAME_HEADER, len);
+        pos += H2_FRAME_HEADER + len;
+    }
+    h2->in_len -= pos;
+    memmove(h2->in, h2->in + pos, h2->in_len);
+
+    if (!h2->closing) {
+        h2_pump(c);
+        if (h2->peer_goaway && h2->num_streams == 0) h2->closing = 1;
+    }
+    if (h2->out_len > 0) {
+        c->seg_cnt = c->seg_idx = 0;
+        add_mem_segment(c, h2->out, h2->out_len);
+        c->state = CONN_WRITE_RESPONSE;
+        return 1;
+    }
+    if (h2->closing) {
+        c->state = CONN_DONE;
+        return 1;
+    }
+    return 0;
+}
+
+// 输出缓冲区已全部写出, 回到处理帧的状态
+void h2_output_done(struct conn *c) {
+    c->h2->out_len = 0;
+    c->seg_cnt = c->seg_idx = 0;
+    c->state = CONN_H2;
+}
+
+// 以连接前言开头的连接 (prior knowledge): 已收到的字节全部交给 HTTP/2 处理
+int h2_start(struct conn *c) {
+    struct h2_conn *h2 = h2_new();
+    if (!h2) {
+        c->state = CONN_DONE;
+        return 1;
+    }
+    c->h2 = h2;
+    memcpy(h2->in, c->in_buf, c->in_len);
+    h2->in_len = c->in_len;
+    c->in_len = 0;
+    h2_send_settings(h2);
+    c->state = CONN_H2;
+    return 1;
+}
+
+// HTTP2-Settings 是 base64url 编码的 SETTINGS 负载, 末尾的 '=' 可有可无
+int base64url_decode(const char *s, uint8_t *out, size_t cap) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (; *s && *s != '='; s++) {
+        int v;
+        if (*s >= 'A' && *s <= 'Z') v = *s - 'A';
+        else if (*s >= 'a' && *s <= 'z') v = *s - 'a' + 26;
+        else if (*s >= '0' && *s <= '9') v = *s - '0' + 52;
+        else if (*s == '-' || *s == '+') v = 62;
+        else if (*s == '_' || *s == '/') v = 63;
+        else return -1;
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == cap) return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+// 带 "Upgrade: h2c" 和 HTTP2-Settings 的 GET 请求: 回复 101 后切换到 HTTP/2,
+// 这个请求本身作为流 1 的请求, 用 HTTP/2 响应。HTTP2-Settings 无效时返回 -1, 按 HTTP/1.1 处理
+int h2_upgrade(struct conn *c) {
+    char value[256];
+    uint8_t settings[192];
+    if (!sv_eq(c->req.version, "HTTP/1.1") || !find_header(&c->req, "Upgrade", value, sizeof(value)) ||
+        strcasecmp(value, "h2c") != 0 || !find_header(&c->req, "HTTP2-Settings", value, sizeof(value))) {
+        return -1;
+    }
+    int len = base64url_decode(value, settings, sizeof(settings));
+    if (len < 0 || len % 6 != 0) return -1;
+    struct h2_conn *h2 = h2_new();
+    if (!h2) return -1;
+    if (h2_apply_settings(h2, settings, len) != 0) {
+        h2_free(h2);
+        return -1;
+    }
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    memcpy(h2->out, switching, sizeof(switching) - 1);
+    h2->out_len = sizeof(switching) - 1;
+    h2_send_settings(h2);
+    c->h2 = h2;
+
+    h2->last_stream_id = 1;
+    struct h2_stream *s = h2_stream_new(h2, 1);
+    s->remote_closed = 1;
+    if (my_log_ring) {
+        s->t_request = c->t_request;
+        strcpy(s->method, "GET");
+        size_t n = c->req.target.len < sizeof(s->path) - 1 ? c->req.target.len : sizeof(s->path) - 1;
+        memcpy(s->path, c->req.target.p, n);
+        s->path[n] = '\0';
+    }
+    h2_respond(c, s, &c->req);
+
+    // 客户端可能已经接着发来了连接前言, 剩下的字节交给 HTTP/2 处理
+    h2->in_len = c->in_len - c->req_len;
+    memcpy(h2->in, c->in_buf + c->req_len, h2->in_len);
+    c->in_len = c->req_len = 0;
+    parser_reset(&c->parser);
+    c->state = CONN_H2;
+    return 0;
+}
+
+// 尽可能推进连接状态机, 直到完成或套接字暂时不可读写。
+// 阻塞套接字上会一直运行到响应发送完毕; 非阻塞套接字上遇到 EAGAIN 即返回。
+enum drive_result conn_drive(struct conn *c) {
+    while (1) {
+        switch (c->state) {
+        case CONN_READ_REQUEST: {
+            if (process_request(c)) break;
+            ssize_t n = recv(c->fd, c->in_buf + c->in_len, sizeof(c->in_buf) - 1 - c->in_len, 0);
+            if (n > 0) {
+                c->in_len += n;
+            } else if (n < 0 && errno == EINTR) {
+                if (timer_signalled) return DRIVE_WANT_READ;
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                return DRIVE_WANT_READ;
+            } else {
+                return DRIVE_CLOSE;
+            }
+            break;
+        }
+        case CONN_WRITE_RESPONSE: {
+            while (c->seg_idx < c->seg_cnt && c->segs[c->seg_idx].len == 0) c->seg_idx++;
+            if (c->seg_idx == c->seg_cnt) {
+                if (c->h2) h2_output_done(c);
+                else finish_response(c);
+                break;
+            }
+            struct segment *seg = &c->segs[c->seg_idx];
+            ssize_t n;
+            if (seg->mem) {
+                // 相邻的内存片段合并成一次 writev; 后面还有片段时带上 MSG_MORE,
+                // 让内核把响应头和正文开头合并成同一个报文段
+                struct iovec iov[MAX_IOV];
+                struct msghdr msg;
+                int i, cnt = 0;
+                for (i = c->seg_idx; i < c->seg_cnt && c->segs[i].mem && cnt < MAX_IOV; i++) {
+                    iov[cnt].iov_base = (void *)c->segs[i].mem;
+                    iov[cnt].iov_len = c->segs[i].len;
+                    cnt++;
+                }
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = cnt;
+                n = sendmsg(c->fd, &msg, i < c->seg_cnt ? MSG_MORE : 0);
+            } else {
+                // sendfile 在内核中直接把页缓存送进套接字, 省去 read+send 的两次拷贝
+                off_t off = seg->off;
+                n = sendfile(c->fd, c->file_fd, &off, seg->len);
+                // n == 0 说明文件在发送过程中被截断, 已无法兑现 Content-Length
+                if (n == 0) return DRIVE_CLOSE;
+            }
+            if (n > 0) {
+                segments_advance(c, n);
+            } else if (n < 0 && errno == EINTR) {
+                if (timer_signalled) return DRIVE_WANT_WRITE;
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                return DRIVE_WANT_WRITE;
+            } else {
+                return DRIVE_CLOSE;
+            }
+            break;
+        }
+        case CONN_H2: {
+            if (h2_process(c)) break;
+            struct h2_conn *h2 = c->h2;
+            ssize_t n = recv(c->fd, h2->in + h2->in_len, sizeof(h2->in) - h2->in_len, 0);
+            if (n > 0) {
+                h2->in_len += n;
+            } else if (n < 0 && errno == EINTR) {
+                if (timer_signalled) return DRIVE_WANT_READ;
+                continue;
+            } else if (n < 0 && errno == EAGAIN) {
+                return DRIVE_WANT_READ;
+            } else {
+                return DRIVE_CLOSE;
+            }
+            break;
+        }
+        case CONN_DONE:
+            return DRIVE_CLOSE;
+        }
+    }
+}
+
+// fork 模式下子进程使用阻塞套接字跑同一个状态机。
+// 每秒一次的 SIGALRM (不带 SA_RESTART) 打断阻塞的 recv/send, conn_drive 返回后在这里检查期限,
+// 只发送一两个字节拖住子进程的客户端 (slowloris) 因此也会在期限到达时被断开。
+void handle_client(int client_sock, const struct sockaddr_in *peer) {
+    struct conn c;
+    conn_init(&c, client_sock);
+    c.peer = *peer;
+    conn_deadline(&c, monotonic_ms());
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = timer_signal_handler;
+    sigaction(SIGALRM, &sa, NULL);
+    struct itimerval tick = { { 1, 0 }, { 1, 0 } };
+    setitimer(ITIMER_REAL, &tick, NULL);
+
+    while (conn_drive(&c) != DRIVE_CLOSE) {
+        timer_signalled = 0;
+        uint64_t now = monotonic_ms();
+        if (now >= conn_deadline(&c, now)) {
+            conn_timed_out(&c, 1);
+            break;
+        }
+    }
+    conn_close(&c);
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// 把文件描述符上限提高到硬上限, 单进程才能同时持有数万个连接
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// 503 响应在启动时生成一次, 拒绝连接时只需一次 send
+void render_shed_response(void) {
+    const char *body = "<html><body><h1>503 Service Unavailable</h1></body></html>";
+    shed_response_len = snprintf(shed_response, sizeof(shed_response),
+                                 "HTTP/1.1 503 Service Unavailable\r\nContent-Type: text/html\r\n"
+                                 "Content-Length: %zu\r\nRetry-After: %d\r\nConnection: close\r\n\r\n%s",
+                                 strlen(body), retry_after, body);
+}
+
+// 不读请求, 直接回复 503 并关闭。先 shutdown 发出 FIN, 再丢弃已到达的请求数据,
+// 免得 close 时接收缓冲区非空而发出 RST, 冲掉客户端还没读到的响应
+void shed_connection(int fd) {
+    char discard[BUFFER_SIZE];
+    send(fd, shed_response, shed_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+    close(fd);
+    stat_add(&my_stats->shed, 1);
+}
+
+// 暂停 accept 期间调用: 监听队列长度超过 queue_depth 时, 接受多出的连接并回复 503。
+// 监听套接字的 TCP_INFO 中 tcpi_unacked 是当前全连接队列的长度
+void shed_backlog(int server_sock) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(server_sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return;
+    for (int excess = (int)ti.tcpi_unacked - queue_depth; excess > 0; excess--) {
+        int fd = accept4(server_sock, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0) break;
+        shed_connection(fd);
+    }
+}
+
+int admission_full(void) {
+    return max_conns && active_conns >= max_conns;
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// 连接当前阶段的截止时刻 (毫秒)。进入新阶段、完成一个响应或发送有进展时从 now 重新计时;
+// 读请求头期间收到的数据不会延期, 所以一个请求头无论怎样分批到达, 都必须在期限内读完。
+uint64_t conn_deadline(struct conn *c, uint64_t now) {
+    int kind;
+    unsigned long mark;
+    if (c->state == CONN_WRITE_RESPONSE) {
+        kind = TIMER_SEND;
+        mark = c->sent_total;
+    } else if (c->state == CONN_H2) {
+        // HTTP/2 连接上还有流在等待发送窗口时按发送期限计时, 否则按读帧或空闲计时
+        kind = c->h2->num_streams > 0 ? TIMER_SEND : c->h2->in_len > 0 ? TIMER_HEADER : TIMER_IDLE;
+        mark = kind == TIMER_SEND ? c->sent_total : c->responses;
+    } else {
+        kind = c->in_len == 0 && c->responses > 0 ? TIMER_IDLE : TIMER_HEADER;
+        mark = c->responses;
+    }
+    if (kind != c->timer_kind || mark != c->timer_mark) {
+        c->timer_kind = kind;
+        c->timer_mark = mark;
+        c->phase_start = now;
+    }
+    int secs = kind == TIMER_SEND ? send_timeout : kind == TIMER_IDLE ? keepalive_timeout : header_timeout;
+    return c->phase_start + (uint64_t)secs * 1000;
+}
+
+// 超时关闭前调用。读请求头和发送超时的多半是恶意或失联的客户端, abortive 时设置 SO_LINGER 为 0,
+// close 直接发 RST 并立即释放套接字, 不再等待未发出的数据, 也不进入 TIME_WAIT
+void conn_timed_out(struct conn *c, int abortive) {
+    stat_add(&my_stats->timeouts[c->timer_kind], 1);
+    if (abortive && c->timer_kind != TIMER_IDLE) {
+        struct linger lg = { 1, 0 };
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+}
+
+// 事件循环进程的时间轮和本轮事件的时间 (毫秒), 每次从 epoll_wait / io_uring_enter 返回时更新一次
+struct timer_wheel wheel;
+uint64_t loop_now_ms = 0;
+
+void timer_del(struct timer_wheel *w, struct timer_node *t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    w->count--;
+}
+
+// 按到期刻度与当前刻度之差选层, 层内按到期刻度选格; expires 不能早于 w->now
+void timer_link(struct timer_wheel *w, struct timer_node *t, uint64_t expires) {
+    uint64_t max_delta = (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (expires - w->now > max_delta) expires = w->now + max_delta;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && expires - w->now >= 1ULL << (WHEEL_BITS * (level + 1))) level++;
+    struct timer_node **slot = &w->slots[level][(expires >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+    t->expires = expires;
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    w->count++;
+}
+
+void timer_add(struct timer_wheel *w, struct timer_node *t, uint64_t expires) {
+    // 当前刻度的格已经处理过, 最早只能排在下一个刻度
+    timer_link(w, t, expires > w->now ? expires : w->now + 1);
+}
+
+// 把时间轮推进到刻度 to, 对每个到期的定时器调用 expire (定时器已摘下)
+void timer_advance(struct timer_wheel *w, uint64_t to, void (*expire)(struct timer_node *)) {
+    if (w->count == 0) {
+        if (to > w->now) w->now = to;
+        return;
+    }
+    while (w->now < to) {
+        w->now++;
+        // 第 level-1 层转完一圈, 第 level 层当前格中的定时器都在 64^level 个刻度内到期, 下放
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) break;
+            struct timer_node **slot = &w->slots[level][(w->now >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+            struct timer_node *list = *slot;
+            *slot = NULL;
+            while (list) {
+                struct timer_node *next = list->next;
+                w->count--;
+                timer_link(w, list, list->expires);
+                list = next;
+            }
+        }
+        struct timer_node **slot = &w->slots[0][w->now & (WHEEL_SIZE - 1)];
+        while (*slot) {
+            struct timer_node *t = *slot;
+            timer_del(w, t);
+            expire(t);
+        }
+    }
+}
+
+// 连接被处理之后调用: 期限没变时什么也不做, 变了就在时间轮上挪个位置, 都不需要系统调用
+void conn_timer_update(struct conn *c) {
+    uint64_t expires = (conn_deadline(c, loop_now_ms) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (c->timer.pprev && c->timer.expires == expires) return;
+    timer_del(&wheel, &c->timer);
+    timer_add(&wheel, &c->timer, expires);
+}
+
+struct conn *timer_conn(struct timer_node *t) {
+    return (struct conn *)((char *)t - offsetof(struct conn, timer));
+}
+
+void event_conn_close(struct conn *c) {
+    // close 会自动把套接字从 epoll 中移除
+    timer_del(&wheel, &c->timer);
+    conn_close(c);
+    free(c);
+    active_conns--;
+}
+
+void event_conn_expire(struct timer_node *t) {
+    struct conn *c = timer_conn(t);
+    conn_timed_out(c, 1);
+    event_conn_close(c);
+}
+
+// 单进程边沿触发事件循环。每个连接注册一次 EPOLLIN|EPOLLOUT|EPOLLET,
+// 之后状态切换不需要 epoll_ctl, 只需在事件到来时调用 conn_drive。
+void run_event_loop(int server_sock) {
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    raise_fd_limit();
+    // io_uring 的多发 accept 不受影响; 暂停 accept 期间拒绝连接时不能阻塞
+    set_nonblocking(server_sock);
+    if (use_uring && run_uring_loop(server_sock) == 0) return;
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) error_die("epoll_create1 失败");
+
+    // 监听套接字的 data.ptr 为 NULL, inotify 的为 &inotify_fd, 以此与连接区分
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) error_die("epoll_ctl 失败");
+
+    if (cache_init() >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &inotify_fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0) error_die("epoll_ctl 失败");
+    }
+
+    loop_now_ms = monotonic_ms();
+    wheel.now = loop_now_ms / TIMER_TICK_MS;
+    int accept_paused = 0;
+    while (1) {
+        // 有连接时每个刻度醒来一次推进时间轮
+        int n = epoll_wait(epfd, events, MAX_EVENTS, wheel.count ? TIMER_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error_die("epoll_wait 失败");
+        }
+        loop_now_ms = monotonic_ms();
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+
+            if (events[i].data.ptr == &inotify_fd) {
+                cache_handle_inotify();
+                continue;
+            }
+
+            if (c == NULL) {
+                // 一次性接受所有排队的连接, 达到连接上限时把监听套接字移出 epoll
+                while (1) {
+                    if (admission_full()) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, server_sock, NULL);
+                        accept_paused = 1;
+                        stat_add(&my_stats->accept_pauses, 1);
+                        break;
+                    }
+                    struct sockaddr_in peer;
+                    socklen_t peer_len = sizeof(peer);
+                    int fd = accept4(server_sock, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK);
+                    if (fd < 0) {
+                        if (errno != EAGAIN && errno != EINTR) perror("accept 失败");
+                        break;
+                    }
+                    c = malloc(sizeof(*c));
+                    if (!c) {
+                        close(fd);
+                        continue;
+                    }
+                    conn_init(c, fd);
+                    c->peer = peer;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                        conn_close(c);
+                        free(c);
+                        continue;
+                    }
+                    active_conns++;
+                    conn_timer_update(c);
+                }
+                continue;
+            }
+
+            if (events[i].events & EPOLLERR || conn_drive(c) == DRIVE_CLOSE) {
+                event_conn_close(c);
+            } else {
+                conn_timer_update(c);
+            }
+        }
+
+        timer_advance(&wheel, loop_now_ms / TIMER_TICK_MS, event_conn_expire);
+
+        if (accept_paused) {
+            if (admission_full()) {
+                shed_backlog(server_sock);
+            } else {
+                ev.events = EPOLLIN;
+                ev.data.ptr = NULL;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) error_die("epoll_ctl 失败");
+                accept_paused = 0;
+            }
+        }
+    }
+}
+
+// ---------------- io_uring 后端 ----------------
+// 不依赖 liburing, 直接使用系统调用和共享内存环。特性:
+//   * 多发 accept (IORING_ACCEPT_MULTISHOT), 新连接直接放进注册文件表
+//   * 接收使用内核提供的缓冲区环 (IORING_REGISTER_PBUF_RING), 空闲连接不占用接收缓冲区
+//   * 文件正文用 read -> send 链 (IOSQE_IO_LINK), 读入注册缓冲区后立即发送, 一次提交两个操作
+// 整个循环每批事件只需一次 io_uring_enter。内核不支持时退回 epoll 事件循环。
+
+#define URING_ENTRIES 4096
+#define URING_BGID 1
+#define URING_RECV_BUFS 1024        // 提供给内核的接收缓冲区个数 (2 的幂)
+#define URING_CHUNK_SIZE (64 * 1024)
+#define URING_CHUNKS 128            // 文件正文中转用的注册缓冲区个数
+#define URING_MAX_FILES 65536
+
+// user_data 低 4 位存操作类型, 其余位是连接指针 (calloc 返回的地址按 16 字节对齐)
+enum uring_op { UOP_ACCEPT = 1, UOP_RECV, UOP_READ, UOP_SEND, UOP_SHUTDOWN, UOP_CLOSE, UOP_TICK, UOP_NOTIFY };
+
+struct uring_conn {
+    struct conn c;              // 必须是第一个成员, 状态机函数仍然只看到 struct conn
+    int inflight;               // 尚未收到完成事件的操作数, 归零前不能释放
+    int recv_armed;
+    int sending;
+    int closing;
+    int read_failed;
+    int chunk;                  // 占用的中转缓冲区下标, -1 表示没有
+    size_t chunk_len;
+    size_t chunk_sent;
+    struct iovec iov[MAX_IOV];
+    struct msghdr msg;
+    struct uring_conn *wait_next;   // 等待中转缓冲区或接收缓冲区的队列
+    int waiting;
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;          // 本地已填写的 SQE 位置, 提交时才发布给内核
+    unsigned submitted;
+} ring;
+
+int fixed_files = 0;            // 连接套接字是否在注册文件表中 (c.fd 为表下标)
+int fixed_bufs = 0;             // 中转缓冲区是否已注册, 可用 READ_FIXED
+struct io_uring_buf_ring *recv_ring;
+char *recv_bufs;
+char *chunk_mem;
+int chunk_free[URING_CHUNKS];
+int num_chunk_free = 0;
+struct uring_conn *wait_head = NULL, *wait_tail = NULL;
+int accept_armed = 0;
+int accept_cancelling = 0;      // 达到连接上限, 已提交取消多发 accept 的请求
+struct __kernel_timespec tick_ts = { 0, TIMER_TICK_MS * 1000000 };
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int uring_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 4;
+    ring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    if (ring.fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) return -1;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char *ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) return -1;
+    ring.sq_head = (unsigned *)(ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(ptr + p.sq_off.array);
+    ring.cq_head = (unsigned *)(ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(ptr + p.cq_off.cqes);
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) return -1;
+    ring.sq_entries = p.sq_entries;
+    // SQ 数组固定为恒等映射, 之后只需推进 tail
+    for (unsigned i = 0; i < p.sq_entries; i++) ring.sq_array[i] = i;
+    ring.sqe_tail = ring.submitted = *ring.sq_tail;
+
+    // 接收缓冲区环: 内核在数据到达时才从中取一块, 用完后由我们放回
+    size_t br_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    recv_ring = mmap(NULL, br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recv_bufs = malloc((size_t)URING_RECV_BUFS * BUFFER_SIZE);
+    if (recv_ring == MAP_FAILED || !recv_bufs) return -1;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)recv_ring;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+    for (int i = 0; i < URING_RECV_BUFS; i++) {
+        struct io_uring_buf *buf = &recv_ring->bufs[i];
+        buf->addr = (unsigned long)(recv_bufs + (size_t)i * BUFFER_SIZE);
+        buf->len = BUFFER_SIZE;
+        buf->bid = i;
+    }
+    __atomic_store_n(&recv_ring->tail, URING_RECV_BUFS, __ATOMIC_RELEASE);
+
+    // 以下两项是可选优化, 注册失败 (例如 RLIMIT_MEMLOCK 太小) 时退回普通文件描述符和普通 read
+    struct rlimit rl;
+    unsigned nr_files = URING_MAX_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nr_files) nr_files = rl.rlim_cur;
+    // 访问日志需要客户端地址, 多发 accept 不能逐个返回地址, 只好对普通描述符调用 getpeername
+    int *files = access_log_path ? NULL : malloc(nr_files * sizeof(int));
+    if (files) {
+        for (unsigned i = 0; i < nr_files; i++) files[i] = -1;
+        fixed_files = sys_io_uring_register(ring.fd, IORING_REGISTER_FILES, files, nr_files) == 0;
+        free(files);
+    }
+
+    chunk_mem = mmap(NULL, (size_t)URING_CHUNKS * URING_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk_mem == MAP_FAILED) return -1;
+    struct iovec chunk_iov = { chunk_mem, (size_t)URING_CHUNKS * URING_CHUNK_SIZE };
+    fixed_bufs = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, &chunk_iov, 1) == 0;
+    for (int i = 0; i < URING_CHUNKS; i++) chunk_free[num_chunk_free++] = i;
+    return 0;
+}
+
+void uring_submit(unsigned wait_nr) {
+    unsigned to_submit = ring.sqe_tail - ring.submitted;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = sys_io_uring_enter(ring.fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno != EAGAIN && errno != EBUSY) error_die("io_uring_enter 失败");
+    if (ret > 0) ring.submitted += ret;
+}
+
+struct io_uring_sqe *uring_get_sqe(void) {
+    // SQ 满了就先提交一批腾出位置
+    while (ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        uring_submit(0);
+    }
+    struct io_uring_sqe *sqe = &ring.sqes[ring.sqe_tail & *ring.sq_mask];
+    ring.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+struct io_uring_sqe *uring_prep(int opcode, struct uring_conn *uc, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    sqe->opcode = opcode;
+    sqe->user_data = (unsigned long)uc | op;
+    if (uc) uc->inflight++;
+    return sqe;
+}
+
+// 针对连接套接字的操作: 使用注册文件表时 fd 是表下标
+void uring_set_sock(struct io_uring_sqe *sqe, struct uring_conn *uc) {
+    sqe->fd = uc->c.fd;
+    if (fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+void uring_arm_accept(int server_sock) {
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_ACCEPT, NULL, UOP_ACCEPT);
+    sqe->fd = server_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    if (fixed_files) sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    accept_armed = 1;
+    accept_cancelling = 0;
+}
+
+// 暂停 accept: 取消多发 accept, 它以 -ECANCELED 结束后由定时器在有空位时重新挂上
+void uring_pause_accept(void) {
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_ASYNC_CANCEL, NULL, UOP_CLOSE);
+    sqe->fd = -1;
+    sqe->addr = UOP_ACCEPT;
+    accept_cancelling = 1;
+    stat_add(&my_stats->accept_pauses, 1);
+}
+
+void uring_arm_tick(void) {
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_TIMEOUT, NULL, UOP_TICK);
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&tick_ts;
+    sqe->len = 1;
+}
+
+void uring_arm_notify(void) {
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_POLL_ADD, NULL, UOP_NOTIFY);
+    sqe->fd = inotify_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+// 接收长度限制为 in_buf (HTTP/2 连接为帧缓冲区) 的剩余空间, 请求处理不过来时自然形成 TCP 背压
+void uring_arm_recv(struct uring_conn *uc) {
+    struct conn *c = &uc->c;
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_RECV, uc, UOP_RECV);
+    uring_set_sock(sqe, uc);
+    sqe->len = c->h2 ? sizeof(c->h2->in) - c->h2->in_len : sizeof(c->in_buf) - 1 - c->in_len;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    uc->recv_armed = 1;
+}
+
+void uring_recycle_buffer(int bid) {
+    unsigned short tail = recv_ring->tail;
+    struct io_uring_buf *buf = &recv_ring->bufs[tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (unsigned long)(recv_bufs + (size_t)bid * BUFFER_SIZE);
+    buf->len = BUFFER_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&recv_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void wait_queue_push(struct uring_conn *uc) {
+    uc->waiting = 1;
+    uc->wait_next = NULL;
+    if (wait_tail) wait_tail->wait_next = uc;
+    else wait_head = uc;
+    wait_tail = uc;
+}
+
+void wait_queue_remove(struct uring_conn *uc) {
+    struct uring_conn **pp = &wait_head, *prev = NULL;
+    while (*pp && *pp != uc) {
+        prev = *pp;
+        pp = &(*pp)->wait_next;
+    }
+    if (!*pp) return;
+    *pp = uc->wait_next;
+    if (wait_tail == uc) wait_tail = prev;
+    uc->waiting = 0;
+}
+
+// 提交当前片段的发送: 内存片段合并成一个 sendmsg;
+// 文件片段先 read 到注册缓冲区, 用 IOSQE_IO_LINK 串上 send, 读完内核立即发送
+void uring_send_segment(struct uring_conn *uc) {
+    struct conn *c = &uc->c;
+    struct segment *seg = &c->segs[c->seg_idx];
+
+    if (seg->mem) {
+        int i, cnt = 0;
+        for (i = c->seg_idx; i < c->seg_cnt && c->segs[i].mem && cnt < MAX_IOV; i++) {
+            uc->iov[cnt].iov_base = (void *)c->segs[i].mem;
+            uc->iov[cnt].iov_len = c->segs[i].len;
+            cnt++;
+        }
+        memset(&uc->msg, 0, sizeof(uc->msg));
+        uc->msg.msg_iov = uc->iov;
+        uc->msg.msg_iovlen = cnt;
+        struct io_uring_sqe *sqe = uring_prep(IORING_OP_SENDMSG, uc, UOP_SEND);
+        uring_set_sock(sqe, uc);
+        sqe->addr = (unsigned long)&uc->msg;
+        sqe->msg_flags = MSG_NOSIGNAL | (i < c->seg_cnt ? MSG_MORE : 0);
+        uc->sending = 1;
+        return;
+    }
+
+    if (num_chunk_free == 0) {
+        // 中转缓冲区用完了, 排队等别的连接释放
+        wait_queue_push(uc);
+        return;
+    }
+    uc->chunk = chunk_free[--num_chunk_free];
+    uc->chunk_len = seg->len < URING_CHUNK_SIZE ? seg->len : URING_CHUNK_SIZE;
+    uc->chunk_sent = 0;
+    uc->read_failed = 0;
+    char *buf = chunk_mem + (size_t)uc->chunk * URING_CHUNK_SIZE;
+
+    struct io_uring_sqe *sqe = uring_prep(fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ, uc, UOP_READ);
+    sqe->fd = c->file_fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = uc->chunk_len;
+    sqe->off = seg->off;
+    sqe->buf_index = 0;
+    sqe->flags |= IOSQE_IO_LINK;
+
+    sqe = uring_prep(IORING_OP_SEND, uc, UOP_SEND);
+    uring_set_sock(sqe, uc);
+    sqe->addr = (unsigned long)buf;
+    sqe->len = uc->chunk_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    uc->sending = 1;
+}
+
+void uring_release_chunk(struct uring_conn *uc) {
+    if (uc->chunk < 0) return;
+    chunk_free[num_chunk_free++] = uc->chunk;
+    uc->chunk = -1;
+}
+
+void uring_conn_finalize(struct uring_conn *uc) {
+    struct conn *c = &uc->c;
+    uring_release_chunk(uc);
+    if (c->file_fd >= 0) close(c->file_fd);
+    c->file_fd = -1;
+    if (c->entry) cache_entry_put(c->entry);
+    free(c->parts_buf);
+    h2_free(c->h2);
+    if (fixed_files) {
+        struct io_uring_sqe *sqe = uring_prep(IORING_OP_CLOSE, NULL, UOP_CLOSE);
+        sqe->file_index = c->fd + 1;
+    } else {
+        close(c->fd);
+    }
+    free(uc);
+    active_conns--;
+}
+
+// 关闭连接: 先 shutdown 让挂起的 recv/send 尽快完成, 所有操作都完成后再释放
+void uring_conn_close(struct uring_conn *uc) {
+    if (uc->closing) return;
+    uc->closing = 1;
+    timer_del(&wheel, &uc->c.timer);
+    if (uc->waiting) wait_queue_remove(uc);
+    if (uc->inflight == 0) {
+        uring_conn_finalize(uc);
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_prep(IORING_OP_SHUTDOWN, uc, UOP_SHUTDOWN);
+    uring_set_sock(sqe, uc);
+    sqe->len = SHUT_RDWR;
+}
+
+// 与 conn_drive 对应的推进函数, 只是把系统调用换成了提交到环上的操作
+void uring_conn_run(struct uring_conn *uc) {
+    struct conn *c = &uc->c;
+    while (!uc->closing) {
+        if (c->state == CONN_READ_REQUEST) {
+            if (process_request(c)) continue;
+            if (!uc->recv_armed) uring_arm_recv(uc);
+            conn_timer_update(c);
+            return;
+        }
+        if (c->state == CONN_H2) {
+            if (h2_process(c)) continue;
+            if (!uc->recv_armed) uring_arm_recv(uc);
+            conn_timer_update(c);
+            return;
+        }
+        if (c->state == CONN_WRITE_RESPONSE) {
+            if (uc->sending || uc->waiting) {
+                conn_timer_update(c);
+                return;
+            }
+            while (c->seg_idx < c->seg_cnt && c->segs[c->seg_idx].len == 0) c->seg_idx++;
+            if (c->seg_idx == c->seg_cnt) {
+                if (c->h2) h2_output_done(c);
+                else finish_response(c);
+                continue;
+            }
+            uring_send_segment(uc);
+            conn_timer_update(c);
+            return;
+        }
+        break;
+    }
+    uring_conn_close(uc);
+}
+
+// 注册文件表中的连接没有普通描述符, 不能设置 SO_LINGER, 只做统计
+void uring_conn_expire(struct timer_node *t) {
+    struct conn *c = timer_conn(t);
+    conn_timed_out(c, !fixed_files);
+    uring_conn_close((struct uring_conn *)c);
+}
+
+void uring_handle_cqe(struct io_uring_cqe *cqe, int server_sock) {
+    enum uring_op op = cqe->user_data & 15;
+    struct uring_conn *uc = (struct uring_conn *)(unsigned long)(cqe->user_data & ~15UL);
+    int res = cqe->res;
+
+    if (op == UOP_ACCEPT) {
+        if (!(cqe->flags & IORING_CQE_F_MORE)) accept_armed = 0; // 多发 accept 被终止, 由定时器重新挂上
+        if (res < 0) return;
+        uc = calloc(1, sizeof(*uc));
+        if (!uc) {
+            if (fixed_files) {
+                struct io_uring_sqe *sqe = uring_prep(IORING_OP_CLOSE, NULL, UOP_CLOSE);
+                sqe->file_index = res + 1;
+            } else {
+                close(res);
+            }
+            return;
+        }
+        conn_init(&uc->c, res);
+        if (++active_conns >= max_conns && max_conns && accept_armed && !accept_cancelling) uring_pause_accept();
+        if (my_log_ring) {
+            socklen_t peer_len = sizeof(uc->c.peer);
+            getpeername(res, (struct sockaddr *)&uc->c.peer, &peer_len);
+        }
+        uc->chunk = -1;
+        uring_conn_run(uc);
+        return;
+    }
+    if (op == UOP_TICK) {
+        timer_advance(&wheel, loop_now_ms / TIMER_TICK_MS, uring_conn_expire);
+        if (!accept_armed && !admission_full()) uring_arm_accept(server_sock);
+        else if (admission_full()) shed_backlog(server_sock);
+        uring_arm_tick();
+        return;
+    }
+    if (op == UOP_NOTIFY) {
+        cache_handle_inotify();
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_notify();
+        return;
+    }
+    if (op == UOP_CLOSE) return;
+
+    uc->inflight--;
+    if (op == UOP_RECV) {
+        uc->recv_armed = 0;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (res > 0 && !uc->closing) {
+                struct h2_conn *h2 = uc->c.h2;
+                if (h2) {
+                    memcpy(h2->in + h2->in_len, recv_bufs + (size_t)bid * BUFFER_SIZE, res);
+                    h2->in_len += res;
+                } else {
+                    memcpy(uc->c.in_buf + uc->c.in_len, recv_bufs + (size_t)bid * BUFFER_SIZE, res);
+                    uc->c.in_len += res;
+                }
+            }
+            uring_recycle_buffer(bid);
+        }
+    }
+    if (uc->closing) {
+        if (uc->inflight == 0) uring_conn_finalize(uc);
+        return;
+    }
+
+    if (op == UOP_RECV) {
+        if (res == -ENOBUFS) {
+            // 接收缓冲区暂时用完, 等本批完成事件处理完 (缓冲区已归还) 后再挂接收
+            wait_queue_push(uc);
+            return;
+        }
+        if (res <= 0) {
+            uring_conn_close(uc);
+            return;
+        }
+    } else if (op == UOP_READ) {
+        // 短读说明文件被截断; 链上的 send 会以 -ECANCELED 完成, 在那里关闭连接
+        if (res != (int)uc->chunk_len) uc->read_failed = 1;
+        return;
+    } else if (op == UOP_SEND) {
+        if (res < 0 || uc->read_failed) {
+            uring_conn_close(uc);
+            return;
+        }
+        if (uc->chunk >= 0) {
+            uc->chunk_sent += res;
+            if (uc->chunk_sent < uc->chunk_len) {
+                // 极少见的短写: 从中转缓冲区补发剩余部分
+                struct io_uring_sqe *sqe = uring_prep(IORING_OP_SEND, uc, UOP_SEND);
+                uring_set_sock(sqe, uc);
+                sqe->addr = (unsigned long)(chunk_mem + (size_t)uc->chunk * URING_CHUNK_SIZE + uc->chunk_sent);
+                sqe->len = uc->chunk_len - uc->chunk_sent;
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+                return;
+            }
+            segments_advance(&uc->c, uc->chunk_len);
+            uring_release_chunk(uc);
+        } else {
+            segments_advance(&uc->c, res);
+        }
+        uc->sending = 0;
+    }
+
+    uring_conn_run(uc);
+}
+
+// 唤醒等待缓冲区的连接: 接收缓冲区已归还, 中转缓冲区有空闲
+void uring_resume_waiters(void) {
+    struct uring_conn *list = wait_head;
+    wait_head = wait_tail = NULL;
+    while (list) {
+        struct uring_conn *uc = list;
+        list = list->wait_next;
+        uc->waiting = 0;
+        if (uc->c.state == CONN_WRITE_RESPONSE && !uc->sending && num_chunk_free == 0) {
+            wait_queue_push(uc);
+            continue;
+        }
+        uring_conn_run(uc);
+    }
+}
+
+// 返回 -1 表示内核不支持所需的 io_uring 特性, 由调用者退回 epoll
+int run_uring_loop(int server_sock) {
+    if (uring_init() < 0) {
+        perror("io_uring 初始化失败, 退回 epoll 事件循环");
+        return -1;
+    }
+    printf("io_uring 后端已启用 (注册文件表: %s, 注册缓冲区: %s)\n",
+           fixed_files ? "是" : "否", fixed_bufs ? "是" : "否");
+    fflush(stdout);
+
+    if (cache_init() >= 0) uring_arm_notify();
+    uring_arm_accept(server_sock);
+    uring_arm_tick();
+    loop_now_ms = monotonic_ms();
+    wheel.now = loop_now_ms / TIMER_TICK_MS;
+
+    while (1) {
+        uring_submit(1);
+        loop_now_ms = monotonic_ms();
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            uring_handle_cqe(&ring.cqes[head & *ring.cq_mask], server_sock);
+            head++;
+            if (head == tail) {
+                // 处理过程中可能又有新的完成事件
+                __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+                tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+        if (wait_head) uring_resume_waiters();
+    }
+}
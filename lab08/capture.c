@@ -1,24 +1,89 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
 #include <linux/videodev2.h>
 
 #define DEVICE_PATH "/dev/video0"
 #define OUTPUT_FILE "webroot/camera_frame.jpg"
+#define INDEX_FILE "webroot/index.html"
 #define BUFFER_COUNT 4
+#define MAX_EVENTS 64
+#define REQUEST_SIZE 2048
+#define DEFAULT_FPS 30
+#define MAX_FAKE_FRAMES 4096
+#define BOUNDARY "frame"
+#define STREAM_SNDBUF (256 * 1024)  // keeps at most a frame or two queued in the kernel per client
 
 struct buffer {
     void *start;
     size_t length;
 };
 
+// A captured frame (or any other response body). Frames are copied out of
+// the capture buffer once and then shared by every client that sends them;
+// the last reference frees the frame.
+struct frame {
+    int refcount;
+    unsigned long seq;
+    size_t length;
+    unsigned char data[];
+};
+
+enum client_state { CLIENT_READ_REQUEST, CLIENT_STREAM, CLIENT_ONCE };
+
+// One HTTP client. A streaming client is always either idle (frame == NULL,
+// waiting for the next capture) or sending exactly one part: head + frame + "\r\n".
+struct client {
+    int fd;
+    enum client_state state;
+    char request[REQUEST_SIZE];
+    size_t request_len;
+    char head[512];             // response header (first part only) + part header
+    size_t head_len;
+    const char *tail;
+    size_t tail_len;
+    struct frame *frame;
+    size_t sent;                // bytes of the current part already written
+    unsigned long last_seq;     // sequence number of the last frame started
+    unsigned long frames_sent;
+    unsigned long frames_skipped;
+    int header_sent;
+    int dead;                   // failed outside its own event; freed after the event batch
+    struct client *prev, *next;
+};
+
 static struct buffer *buffers = NULL;
 static int fd = -1;
+static const char *device_path = DEVICE_PATH;
+
+// File-backed fake camera: a file of concatenated JPEG images, replayed in a loop
+static const char *fake_path = NULL;
+static unsigned char *fake_data = NULL;
+static size_t fake_size = 0;
+static size_t fake_offset[MAX_FAKE_FRAMES];
+static size_t fake_length[MAX_FAKE_FRAMES];
+static int fake_count = 0;
+static int fake_next = 0;
+
+static struct frame *latest = NULL;
+static unsigned long frames_captured = 0;
+static struct client *clients = NULL;
+static int epfd = -1;
+static volatile sig_atomic_t stop_requested = 0;
 
 void errno_exit(const char *msg) {
     fprintf(stderr, "%s error %d, %s\n", msg, errno, strerror(errno));
@@ -33,6 +98,21 @@ int xioctl(int fd, int request, void *arg) {
     return r;
 }
 
+void stop_handler(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d device | -f frames.mjpeg [-r fps]] [-p port]\n", prog);
+    fprintf(stderr, "  -d  V4L2 capture device (default %s)\n", DEVICE_PATH);
+    fprintf(stderr, "  -f  use a file of concatenated JPEG frames as a fake camera\n");
+    fprintf(stderr, "  -r  frame rate of the fake camera (default %d)\n", DEFAULT_FPS);
+    fprintf(stderr, "  -p  stream live frames over HTTP on this port as multipart/x-mixed-replace;\n"
+                    "      without -p one frame is saved to %s\n", OUTPUT_FILE);
+    exit(EXIT_FAILURE);
+}
+
 void init_device(unsigned int *width, unsigned int *height) {
     struct v4l2_capability cap;
     struct v4l2_format fmt;
@@ -40,7 +120,7 @@ void init_device(unsigned int *width, unsigned int *height) {
     // Query device capabilities
     if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
         if (errno == EINVAL) {
-            fprintf(stderr, "%s is not a V4L2 device\n", DEVICE_PATH);
+            fprintf(stderr, "%s is not a V4L2 device\n", device_path);
             exit(EXIT_FAILURE);
         } else {
             errno_exit("VIDIOC_QUERYCAP");
@@ -49,13 +129,13 @@ void init_device(unsigned int *width, unsigned int *height) {
     
     // Verify that device supports video capture
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "%s is not a video capture device\n", DEVICE_PATH);
+        fprintf(stderr, "%s is not a video capture device\n", device_path);
         exit(EXIT_FAILURE);
     }
     
     // Verify that device supports streaming I/O
     if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-        fprintf(stderr, "%s does not support streaming I/O\n", DEVICE_PATH);
+        fprintf(stderr, "%s does not support streaming I/O\n", device_path);
         exit(EXIT_FAILURE);
     }
     
@@ -90,7 +170,7 @@ void init_mmap() {
     
     if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
         if (errno == EINVAL) {
-            fprintf(stderr, "%s does not support memory mapping\n", DEVICE_PATH);
+            fprintf(stderr, "%s does not support memory mapping\n", device_path);
             exit(EXIT_FAILURE);
         } else {
             errno_exit("VIDIOC_REQBUFS");
@@ -98,7 +178,7 @@ void init_mmap() {
     }
     
     if (req.count < 2) {
-        fprintf(stderr, "Insufficient buffer memory on %s\n", DEVICE_PATH);
+        fprintf(stderr, "Insufficient buffer memory on %s\n", device_path);
         exit(EXIT_FAILURE);
     }
     
@@ -177,13 +257,79 @@ void close_device() {
     fd = -1;
 }
 
-int main() {
+struct frame *frame_alloc(size_t length) {
+    struct frame *f = malloc(sizeof(*f) + length);
+    if (!f) return NULL;
+    f->refcount = 1;
+    f->seq = 0;
+    f->length = length;
+    return f;
+}
+
+struct frame *frame_new(const void *data, size_t length) {
+    struct frame *f = frame_alloc(length);
+    if (f) memcpy(f->data, data, length);
+    return f;
+}
+
+void frame_put(struct frame *f) {
+    if (f && --f->refcount == 0) free(f);
+}
+
+// Split the fake camera file into frames. A frame runs from an SOI marker
+// (FF D8 FF) to the EOI marker (FF D9) that is directly followed by the next
+// SOI or by the end of the file, so EOI markers of embedded thumbnails are skipped.
+void open_fake_source(int fps) {
+    struct stat st;
+    int ffd = open(fake_path, O_RDONLY);
+    if (ffd == -1 || fstat(ffd, &st) == -1) {
+        fprintf(stderr, "Cannot open fake source %s: %s\n", fake_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    fake_size = st.st_size;
+    fake_data = fake_size ? mmap(NULL, fake_size, PROT_READ, MAP_PRIVATE, ffd, 0) : MAP_FAILED;
+    if (fake_data == MAP_FAILED) errno_exit("mmap");
+    close(ffd);
+
+    size_t start = 0;
+    while (start + 3 <= fake_size && fake_count < MAX_FAKE_FRAMES) {
+        if (memcmp(fake_data + start, "\xff\xd8\xff", 3) != 0) break;
+        size_t end = start + 3;
+        for (; end + 2 <= fake_size; end++) {
+            if (fake_data[end] != 0xff || fake_data[end + 1] != 0xd9) continue;
+            if (end + 2 == fake_size || (end + 5 <= fake_size &&
+                memcmp(fake_data + end + 2, "\xff\xd8\xff", 3) == 0)) break;
+        }
+        if (end + 2 > fake_size) break;
+        fake_offset[fake_count] = start;
+        fake_length[fake_count] = end + 2 - start;
+        fake_count++;
+        start = end + 2;
+    }
+    if (fake_count == 0) {
+        fprintf(stderr, "%s does not contain any JPEG frames\n", fake_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // The fake camera "delivers" a frame on every timer tick
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (fd == -1) errno_exit("timerfd_create");
+    struct itimerspec its;
+    its.it_interval.tv_sec = 1 / fps;
+    its.it_interval.tv_nsec = 1000000000L / fps % 1000000000L;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) errno_exit("timerfd_settime");
+
+    printf("Fake camera: %d frames from %s at %d fps\n", fake_count, fake_path, fps);
+}
+
+void open_camera(int nonblocking) {
     unsigned int width, height;
     
     // Open the device
-    fd = open(DEVICE_PATH, O_RDWR);
+    fd = open(device_path, O_RDWR | (nonblocking ? O_NONBLOCK : 0));
     if (fd == -1) {
-        fprintf(stderr, "Cannot open device %s: %s\n", DEVICE_PATH, strerror(errno));
+        fprintf(stderr, "Cannot open device %s: %s\n", device_path, strerror(errno));
         exit(EXIT_FAILURE);
     }
     
@@ -195,6 +341,37 @@ int main() {
     
     // Start capturing
     start_capturing();
+}
+
+void close_camera() {
+    if (fake_path) {
+        munmap(fake_data, fake_size);
+        close(fd);
+        fd = -1;
+        return;
+    }
+
+    // Stop capturing
+    stop_capturing();
+
+    // Cleanup
+    uninit_device();
+    close_device();
+}
+
+// Take the next frame from the source. The capture buffer goes straight back
+// to the driver after one copy, so clients never hold up the capture queue.
+// Returns NULL when no frame is ready (EAGAIN) or on a transient error.
+struct frame *grab_frame() {
+    struct frame *f;
+
+    if (fake_path) {
+        unsigned long long ticks;
+        if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks)) return NULL;
+        f = frame_new(fake_data + fake_offset[fake_next], fake_length[fake_next]);
+        fake_next = (fake_next + 1) % fake_count;
+        return f;
+    }
 
     struct v4l2_buffer buf;
     memset(&buf, 0, sizeof(buf));
@@ -204,11 +381,34 @@ int main() {
     // Dequeue a buffer with captured data
     if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
         if (errno == EAGAIN) {
-            return 0;
+            return NULL;
         } else {
             errno_exit("VIDIOC_DQBUF");
         }
     }
+
+    f = frame_new(buffers[buf.index].start, buf.bytesused);
+
+    // Return the buffer to the queue
+    if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+        errno_exit("VIDIOC_QBUF");
+    }
+    return f;
+}
+
+// Original behaviour: save one frame for the lab06 web server to serve
+int capture_one_frame() {
+    struct frame *f = NULL;
+
+    while (!f) {
+        // The fake camera's timer fd is non-blocking; wait for its first tick
+        if (fake_path) {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            poll(&pfd, 1, -1);
+        }
+        f = grab_frame();
+        if (!f && !fake_path) return 0;
+    }
     
     // Save the frame to a file
     FILE *fout = fopen(OUTPUT_FILE, "wb");
@@ -218,21 +418,357 @@ int main() {
     }
     
     // Write the MJPG data directly to a JPG file
-    fwrite(buffers[buf.index].start, buf.bytesused, 1, fout);
+    fwrite(f->data, f->length, 1, fout);
     fclose(fout);
-    printf("Saved %u bytes to %s\n", buf.bytesused, OUTPUT_FILE);
+    printf("Saved %zu bytes to %s\n", f->length, OUTPUT_FILE);
+    frame_put(f);
+    return 1;
+}
     
-    // Return the buffer to the queue
-    if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-        errno_exit("VIDIOC_QBUF");
+int create_listen_socket(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock == -1) errno_exit("socket");
+    int opt = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) errno_exit("bind");
+    if (listen(sock, SOMAXCONN) == -1) errno_exit("listen");
+    return sock;
+}
+
+void client_close(struct client *c) {
+    if (c->state == CLIENT_STREAM) {
+        if (c->last_seq) c->frames_skipped += frames_captured - c->last_seq;
+        printf("Stream client %d closed: %lu frames sent, %lu skipped\n",
+               c->fd, c->frames_sent, c->frames_skipped);
+    }
+    frame_put(c->frame);
+    close(c->fd);
+    if (c->prev) c->prev->next = c->next;
+    else clients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    free(c);
+}
+
+// Begin sending the latest frame as the next part of the stream. Frames
+// captured while the client was still busy with an older one are skipped.
+void client_start_frame(struct client *c) {
+    c->frame = latest;
+    latest->refcount++;
+    if (c->last_seq && latest->seq > c->last_seq + 1) {
+        c->frames_skipped += latest->seq - c->last_seq - 1;
+    }
+    c->last_seq = latest->seq;
+    c->sent = 0;
+    c->head_len = 0;
+    if (!c->header_sent) {
+        c->head_len = snprintf(c->head, sizeof(c->head),
+                               "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+                               "Cache-Control: no-cache, no-store\r\nPragma: no-cache\r\n"
+                               "Connection: close\r\n\r\n");
+        c->header_sent = 1;
+    }
+    c->head_len += snprintf(c->head + c->head_len, sizeof(c->head) - c->head_len,
+                            "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n",
+                            latest->length);
+    c->tail = "\r\n";
+    c->tail_len = 2;
+}
+
+// Write as much of the current part as the socket accepts. Returns -1 if the
+// client has to be closed, 0 otherwise (finished, idle, or waiting for EPOLLOUT).
+int client_send(struct client *c) {
+    while (c->frame) {
+        struct iovec iov[3] = {
+            { c->head, c->head_len },
+            { c->frame->data, c->frame->length },
+            { (void *)c->tail, c->tail_len },
+        };
+        size_t total = c->head_len + c->frame->length + c->tail_len;
+        size_t skip = c->sent;
+        int first = 0;
+        while (first < 3 && skip >= iov[first].iov_len) {
+            skip -= iov[first].iov_len;
+            first++;
+        }
+        if (first < 3) {
+            iov[first].iov_base = (char *)iov[first].iov_base + skip;
+            iov[first].iov_len -= skip;
+            ssize_t n = writev(c->fd, iov + first, 3 - first);
+            if (n == -1 && errno == EINTR) continue;
+            // Socket buffer is full: stop here and let new frames pile up
+            // into "latest"; the client picks up whichever is newest later
+            if (n == -1 && errno == EAGAIN) return 0;
+            if (n == -1) return -1;
+            c->sent += n;
+        }
+        if (c->sent < total) continue;
+
+        frame_put(c->frame);
+        c->frame = NULL;
+        if (c->state == CLIENT_ONCE) return -1;
+        c->frames_sent++;
+        if (latest && latest->seq != c->last_seq) client_start_frame(c);
+    }
+    return 0;
+}
+
+// Prepare a single non-streaming response (page or snapshot); the client is closed once it is sent
+void client_respond(struct client *c, const char *status, const char *type, struct frame *body) {
+    c->state = CLIENT_ONCE;
+    c->frame = body;
+    c->sent = 0;
+    c->head_len = snprintf(c->head, sizeof(c->head),
+                           "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                           "Cache-Control: no-cache\r\nConnection: close\r\n\r\n",
+                           status, type, body->length);
+    c->tail = "";
+    c->tail_len = 0;
+}
+
+// Read a whole file into a frame sized from fstat, so Content-Length always
+// matches the body actually sent
+struct frame *load_file(const char *path) {
+    int in = open(path, O_RDONLY);
+    if (in == -1) return NULL;
+    struct stat st;
+    struct frame *f = NULL;
+    if (fstat(in, &st) == 0 && S_ISREG(st.st_mode)) f = frame_alloc(st.st_size);
+    size_t got = 0;
+    while (f && got < f->length) {
+        ssize_t n = read(in, f->data + got, f->length - got);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break; // file shrank underneath us: send what was read
+        got += n;
+    }
+    if (f) f->length = got;
+    close(in);
+    return f;
+}
+
+void handle_request(struct client *c) {
+    char method[16], path[256];
+    struct frame *body = NULL;
+
+    if (sscanf(c->request, "%15s %255s", method, path) != 2 || strcmp(method, "GET") != 0) {
+        body = frame_new("Bad Request\n", 12);
+        if (body) client_respond(c, "400 Bad Request", "text/plain", body);
+        return;
     }
     
-    // Stop capturing
-    stop_capturing();
+    if (strcmp(path, "/stream.mjpg") == 0) {
+        c->state = CLIENT_STREAM;
+        // A large socket buffer would only hold stale frames; keep it small
+        // so a slow reader falls back to skipping instead of lagging behind
+        int sndbuf = STREAM_SNDBUF;
+        setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        printf("Stream client %d connected\n", c->fd);
+        if (latest) client_start_frame(c);
+        return;
+    }
+    if (strcmp(path, "/snapshot.jpg") == 0 || strcmp(path, "/camera_frame.jpg") == 0) {
+        if (latest) {
+            latest->refcount++;
+            client_respond(c, "200 OK", "image/jpeg", latest);
+            return;
+        }
+        body = frame_new("No frame captured yet\n", 22);
+        if (body) client_respond(c, "503 Service Unavailable", "text/plain", body);
+        return;
+    }
+    if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
+        body = load_file(INDEX_FILE);
+        if (body) {
+            client_respond(c, "200 OK", "text/html; charset=utf-8", body);
+            return;
+        }
+    }
+    body = frame_new("Not Found\n", 10);
+    if (body) client_respond(c, "404 Not Found", "text/plain", body);
+}
     
-    // Cleanup
-    uninit_device();
-    close_device();
+// Read from a client. Streaming clients are not expected to send anything
+// more; reading only detects the peer closing. Returns -1 to close the client.
+int client_read(struct client *c) {
+    while (1) {
+        if (c->state != CLIENT_READ_REQUEST) {
+            char discard[512];
+            ssize_t n = read(c->fd, discard, sizeof(discard));
+            if (n > 0) continue;
+            if (n == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+            return -1;
+        }
+        size_t room = sizeof(c->request) - 1 - c->request_len;
+        if (room == 0) return -1;
+        ssize_t n = read(c->fd, c->request + c->request_len, room);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return 0;
+        if (n <= 0) return -1;
+        c->request_len += n;
+        c->request[c->request_len] = '\0';
+        if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n")) {
+            handle_request(c);
+            if (c->state == CLIENT_READ_REQUEST) return -1;
+            return client_send(c);
+        }
+    }
+}
+
+// Make a new frame the latest one and push it to every idle stream client.
+// Busy clients keep sending their current frame and skip to the newest one afterwards.
+// A client whose send fails is only marked dead here: it may still have an event
+// pending later in the current epoll batch, so it is freed by reap_dead_clients.
+void publish_frame(struct frame *f) {
+    f->seq = ++frames_captured;
+    frame_put(latest);
+    latest = f;
+
+    struct client *c = clients;
+    while (c) {
+        struct client *next = c->next;
+        if (c->state == CLIENT_STREAM && !c->frame && !c->dead) {
+            client_start_frame(c);
+            if (client_send(c) == -1) {
+                c->dead = 1;
+                shutdown(c->fd, SHUT_RDWR);
+            }
+        }
+        c = next;
+    }
+}
+
+void reap_dead_clients(void) {
+    struct client *c = clients;
+    while (c) {
+        struct client *next = c->next;
+        if (c->dead) client_close(c);
+        c = next;
+    }
+}
+
+// Streaming mode: one epoll loop multiplexes the capture source, the listen
+// socket and all clients, so the capture side never blocks on a slow reader.
+void run_stream_server(int port) {
+    int listen_sock = create_listen_socket(port);
+    struct epoll_event ev, events[MAX_EVENTS];
+
+    epfd = epoll_create1(0);
+    if (epfd == -1) errno_exit("epoll_create1");
+
+    // data.ptr NULL is the capture source, &listen_sock is the listen socket
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) errno_exit("epoll_ctl");
+    ev.data.ptr = &listen_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) == -1) errno_exit("epoll_ctl");
+
+    printf("Streaming on http://0.0.0.0:%d/stream.mjpg (snapshot: /snapshot.jpg)\n", port);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            errno_exit("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                struct frame *f = grab_frame();
+                if (f) publish_frame(f);
+            } else if (ptr == &listen_sock) {
+                int cfd;
+                while ((cfd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+                    struct client *c = calloc(1, sizeof(*c));
+                    if (!c) {
+                        close(cfd);
+                        continue;
+                    }
+                    c->fd = cfd;
+                    c->state = CLIENT_READ_REQUEST;
+                    c->next = clients;
+                    if (clients) clients->prev = c;
+                    clients = c;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &ev) == -1) client_close(c);
+                }
+            } else {
+                struct client *c = ptr;
+                if (c->dead) continue;
+                uint32_t e = events[i].events;
+                int r = 0;
+                if (e & (EPOLLERR | EPOLLHUP)) r = -1;
+                if (r == 0 && (e & (EPOLLIN | EPOLLRDHUP))) r = client_read(c);
+                if (r == 0 && (e & EPOLLOUT)) r = client_send(c);
+                if (r == -1) client_close(c);
+            }
+        }
+        reap_dead_clients();
+    }
+
+    while (clients) client_close(clients);
+    frame_put(latest);
+    latest = NULL;
+    close(epfd);
+    close(listen_sock);
+    printf("Captured %lu frames\n", frames_captured);
+}
+
+int main(int argc, char *argv[]) {
+    int port = 0, fps = DEFAULT_FPS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:f:r:p:")) != -1) {
+        switch (opt) {
+            case 'd':
+                device_path = optarg;
+                break;
+            case 'f':
+                fake_path = optarg;
+                break;
+            case 'r':
+                fps = atoi(optarg);
+                if (fps <= 0 || fps > 1000) usage(argv[0]);
+                break;
+            case 'p':
+                port = atoi(optarg);
+                if (port <= 0 || port > 65535) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc) usage(argv[0]);
+
+    if (fake_path) {
+        open_fake_source(fps);
+    } else {
+        open_camera(port != 0);
+    }
+
+    if (port) {
+        // A client disconnecting mid-frame must not kill the capture loop
+        signal(SIGPIPE, SIG_IGN);
+        signal(SIGINT, stop_handler);
+        signal(SIGTERM, stop_handler);
+        run_stream_server(port);
+        close_camera();
+        return 0;
+    }
+
+    if (!capture_one_frame()) {
+        close_camera();
+        return 0;
+    }
+
+    close_camera();
     
     printf("Successfully captured one frame as JPEG\n");
     